@@ -0,0 +1,101 @@
+/* $Id$
+ *
+ * amsdos.c - AMSDOS directory and block allocation for dsktools.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "amsdos.h"
+
+int amsdos_init(Amsdos *amsdos, Trackinfo *trackinfo, int tracks)
+{
+	int i;
+
+	memset(amsdos, 0, sizeof(*amsdos));
+	if ((trackinfo->spt != AMSDOS_SPT) ||
+		!standard_layout(trackinfo, trackinfo->sectorinfo[0].track) ||
+		(trackinfo->sectorinfo[0].bps != 2))
+		return FALSE;
+
+	amsdos->base = first_sector(trackinfo);
+	if (amsdos->base == OFF_DAT)
+		amsdos->reserved = 0;
+	else if (amsdos->base == OFF_SYS)
+		amsdos->reserved = 2;
+	else
+		return FALSE;
+	amsdos->tracks = tracks;
+
+	for (i=0; i<AMSDOS_DIRBLOCKS; i++)
+		amsdos->used[i] = TRUE;
+	amsdos->nused = AMSDOS_DIRBLOCKS;
+	return TRUE;
+}
+
+int amsdos_dirtrack(Amsdos *amsdos)
+{
+	return amsdos->reserved;
+}
+
+int amsdos_scan_dir(Amsdos *amsdos, unsigned char *dir)
+{
+	unsigned char *entry;
+	int i, j, block, nblocks, live = 0;
+
+	nblocks = (amsdos->tracks - amsdos->reserved) * AMSDOS_SPT * 512 /
+		AMSDOS_BLOCK;
+	for (i=0; i<AMSDOS_DIRSECTS * 512; i+=32) {
+		entry = dir + i;
+
+		/* user numbers above 15 are deleted files (0xE5) */
+		if (entry[0] > 15)
+			continue;
+		live++;
+		for (j=16; j<32; j++) {
+			block = entry[j];
+			if ((block == 0) || (block >= nblocks) ||
+				amsdos->used[block])
+				continue;
+			amsdos->used[block] = TRUE;
+			amsdos->nused++;
+		}
+	}
+	return live;
+}
+
+unsigned int amsdos_live(Amsdos *amsdos, Trackinfo *trackinfo, int track)
+{
+	Sectorinfo *sectorinfo;
+	unsigned int live = 0;
+	int i, logical, block;
+
+	for (i=0; i<trackinfo->spt; i++) {
+		sectorinfo = &trackinfo->sectorinfo[i];
+		logical = sectorinfo->sector - amsdos->base;
+		if ((track < amsdos->reserved) || (logical < 0) ||
+			(logical >= AMSDOS_SPT) || (sectorinfo->bps != 2)) {
+			live |= 1 << i;
+			continue;
+		}
+		logical += (track - amsdos->reserved) * AMSDOS_SPT;
+		block = logical * 512 / AMSDOS_BLOCK;
+
+		/* directory entries only name 8 bit blocks, larger disks
+		 * keep the rest of their blocks */
+		if ((block >= AMSDOS_MAXBLOCKS) || amsdos->used[block])
+			live |= 1 << i;
+	}
+	return live;
+}
@@ -0,0 +1,58 @@
+/* $Id$
+ *
+ * amsdos.h - AMSDOS directory and block allocation for dsktools.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef AMSDOS_H
+#define AMSDOS_H
+
+#include "common.h"
+
+/* AMSDOS formats: 9 sectors of 512 bytes, 1K blocks, the directory in
+ * blocks 0 and 1 at the start of the first track after the reserved ones.
+ */
+#define AMSDOS_SPT 9
+#define AMSDOS_BLOCK 1024
+#define AMSDOS_DIRSECTS 4	/* 64 entries of 32 bytes */
+#define AMSDOS_DIRBLOCKS 2
+#define AMSDOS_MAXBLOCKS 256
+
+typedef struct amsdos_t {
+	int base;		/* first sector number, OFF_DAT or OFF_SYS */
+	int reserved;		/* tracks before the directory */
+	int tracks;
+	unsigned char used[AMSDOS_MAXBLOCKS];
+	int nused;		/* blocks allocated, directory included */
+} Amsdos;
+
+/* Recognise a DATA or SYSTEM format from the IDs of a track. Returns FALSE
+ * for anything else. */
+int amsdos_init(Amsdos *amsdos, Trackinfo *trackinfo, int tracks);
+
+/* Track holding the directory, it starts with sector base */
+int amsdos_dirtrack(Amsdos *amsdos);
+
+/* Mark the blocks the directory (AMSDOS_DIRSECTS sectors in sector number
+ * order) refers to. Returns the number of live entries. */
+int amsdos_scan_dir(Amsdos *amsdos, unsigned char *dir);
+
+/* Bitmask of the sectors of a track in trackinfo order that hold live data:
+ * reserved tracks, the directory and allocated blocks. Sectors that are not
+ * part of the format or lie past the allocation map count as live. */
+unsigned int amsdos_live(Amsdos *amsdos, Trackinfo *trackinfo, int track);
+
+#endif /* AMSDOS_H */
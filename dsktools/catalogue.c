@@ -0,0 +1,184 @@
+/* $Id$
+ *
+ * catalogue.c - Catalogue of known images for dsktools.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "catalogue.h"
+
+#define CAT_LINE (MAX_TRACKS*MAX_SIDES*18 + 4096)
+
+/* Where a track was first read from depends on where the disk happened to
+ * be, so prints start with the lowest sector number */
+static int cat_first(Trackinfo *trackinfo)
+{
+	int i, first = 0;
+
+	for (i=1; i<trackinfo->spt; i++)
+		if (trackinfo->sectorinfo[i].sector <
+			trackinfo->sectorinfo[first].sector)
+			first = i;
+	return first;
+}
+
+unsigned int layout_print(Trackinfo *trackinfo)
+{
+	unsigned char id[6];
+	unsigned int hash;
+	Sectorinfo *sectorinfo;
+	int i, first;
+
+	id[0] = trackinfo->spt;
+	hash = fnv1a(FNV_INIT, id, 1);
+	first = cat_first(trackinfo);
+	for (i=0; i<trackinfo->spt; i++) {
+		sectorinfo = &trackinfo->sectorinfo[(first + i) %
+			trackinfo->spt];
+		id[0] = sectorinfo->track;
+		id[1] = sectorinfo->head;
+		id[2] = sectorinfo->sector;
+		id[3] = sectorinfo->bps;
+		id[4] = sectorinfo->err1 & CAT_ERR1;
+		id[5] = sectorinfo->err2 & CAT_ERR2;
+		hash = fnv1a(hash, id, 6);
+	}
+	return hash;
+}
+
+unsigned int content_print(Track *track)
+{
+	Trackinfo *trackinfo = &track->info;
+	unsigned int hash = FNV_INIT;
+	int i, j, first, off;
+
+	first = cat_first(trackinfo);
+	for (i=0; i<trackinfo->spt; i++) {
+		j = (first + i) % trackinfo->spt;
+		for (off=0; j>0; j--)
+			off += sector_len(&trackinfo->sectorinfo[j-1]);
+		hash = fnv1a(hash, track->data + off,
+			sector_len(&trackinfo->sectorinfo[(first + i) %
+			trackinfo->spt]));
+	}
+	return hash;
+}
+
+int cat_load(Catalogue *cat, char *filename)
+{
+	static char line[CAT_LINE];
+	Catentry *entry;
+	FILE *in;
+	char *p;
+	int i, n, len;
+
+	cat->entry = NULL;
+	cat->nentries = 0;
+	in = fopen(filename, "r");
+	if (in == NULL)
+		return 0;
+
+	while (fgets(line, sizeof(line), in) != NULL) {
+		len = strlen(line);
+		if (len && (line[len-1] == '\n'))
+			line[--len] = 0;
+		if ((len == 0) || (line[0] == '#'))
+			continue;
+
+		entry = realloc(cat->entry,
+			(cat->nentries + 1) * sizeof(Catentry));
+		if (entry == NULL) {
+			myabort("Error: Out of memory\n");
+		}
+		cat->entry = entry;
+		entry = &cat->entry[cat->nentries];
+
+		p = line;
+		if ((sscanf(p, "%i %i%n", &entry->ntracks, &entry->heads,
+			&n) != 2) || (entry->ntracks < 0) ||
+			(entry->ntracks > MAX_TRACKS*MAX_SIDES))
+			goto bad;
+		p += n;
+		for (i=0; i<entry->ntracks; i++) {
+			if (sscanf(p, " %x:%x%n", &entry->layout[i],
+				&entry->content[i], &n) != 2)
+				goto bad;
+			p += n;
+		}
+		if (*p++ != ' ')
+			goto bad;
+		entry->name = strdup(p);
+		cat->nentries++;
+	}
+	fclose(in);
+	return 0;
+
+bad:
+	fprintf(stderr, "Broken line %i in catalogue %s\n",
+		cat->nentries + 1, filename);
+	fclose(in);
+	cat_free(cat);
+	return -1;
+}
+
+void cat_free(Catalogue *cat)
+{
+	int i;
+
+	for (i=0; i<cat->nentries; i++)
+		free(cat->entry[i].name);
+	free(cat->entry);
+	cat->entry = NULL;
+	cat->nentries = 0;
+}
+
+void cat_write(FILE *out, char *name, Image *image)
+{
+	int i;
+
+	fprintf(out, "%i %i", image->ntracks, image->diskinfo.heads);
+	for (i=0; i<image->ntracks; i++)
+		fprintf(out, " %08x:%08x",
+			layout_print(&image->track[i].info),
+			content_print(&image->track[i]));
+	fprintf(out, " %s\n", name);
+}
+
+Catentry *cat_match(Catalogue *cat, Image *image, int ntracks)
+{
+	Catentry *entry, *best = NULL;
+	int i, j, same, most = 0;
+
+	for (i=0; i<cat->nentries; i++) {
+		entry = &cat->entry[i];
+		if ((entry->heads != image->diskinfo.heads) ||
+			(entry->ntracks < ntracks))
+			continue;
+		same = 0;
+		for (j=0; j<ntracks; j++) {
+			if (entry->layout[j] !=
+				layout_print(&image->track[j].info))
+				break;
+			if (entry->content[j] ==
+				content_print(&image->track[j]))
+				same++;
+		}
+		if ((j == ntracks) && (same > most)) {
+			best = entry;
+			most = same;
+		}
+	}
+	return best;
+}
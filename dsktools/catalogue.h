@@ -0,0 +1,70 @@
+/* $Id$
+ *
+ * catalogue.h - Catalogue of known images for dsktools.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef CATALOGUE_H
+#define CATALOGUE_H
+
+#include "common.h"
+
+/* The catalogue is a text file, one line per image:
+ *
+ *	<tracks> <heads> <layout>:<content> ... <image file name>
+ *
+ * with a pair of FNV-1a fingerprints in hex for every track. The layout
+ * print covers the sector IDs in disk order and the errors the FDC gave,
+ * the content print the sector data.
+ */
+#define CAT_TRACKS 3		/* cylinders read before looking a disk up */
+
+typedef struct catentry_t {
+	char *name;		/* image file */
+	int ntracks;		/* tracks * heads */
+	int heads;
+	unsigned int layout[MAX_TRACKS*MAX_SIDES];
+	unsigned int content[MAX_TRACKS*MAX_SIDES];
+} Catentry;
+
+typedef struct catalogue_t {
+	Catentry *entry;
+	int nentries;
+} Catalogue;
+
+/* Fingerprints of a track */
+unsigned int layout_print(Trackinfo *trackinfo);
+unsigned int content_print(Track *track);
+
+/* Read a catalogue, a missing file is an empty one. Returns -1 on errors. */
+int cat_load(Catalogue *cat, char *filename);
+
+void cat_free(Catalogue *cat);
+
+/* Append the line for an image */
+void cat_write(FILE *out, char *name, Image *image);
+
+/* The entry whose first ntracks tracks have the layout of those of image
+ * and share the most content with them, at least one track. NULL if there
+ * is none. */
+Catentry *cat_match(Catalogue *cat, Image *image, int ntracks);
+
+/* Errors a sector is known to give: the ones that say something about the
+ * disk, not about the read */
+#define CAT_ERR1 (ST1_MAM | ST1_ND | ST1_CRC)
+#define CAT_ERR2 (ST2_MAM | ST2_CRC | ST2_CM)
+
+#endif /* CATALOGUE_H */
@@ -20,12 +20,143 @@
 
 #include "common.h"
 
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <wmmintrin.h>
+#include <tmmintrin.h>
+#endif
+
 void myabort(char *s)
 {
 	fprintf(stderr,s);
 	exit(1);
 }
 
+int open_drive(int drive)
+{
+	char name[32];
+	int fd;
+
+	if (plan_active || replay_active)
+		return drive;
+
+	sprintf(name, "/dev/fd%01d", drive);
+	fd = open(name, O_ACCMODE | O_NDELAY);
+	if (fd < 0) {
+		perror("Error opening floppy device");
+		exit(1);
+	}
+	return fd;
+}
+
+/* Real time mode state: the end of the last command of the current track
+ * (per thread, for dskwrite copies) and the longest time the host took to
+ * issue the next one */
+int realtime_active = FALSE;
+static __thread long rt_last = 0;
+static long rt_worst = 0;
+static char rt_ring[0x10000];
+
+static long rt_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+int fdc_cmd(int fd, struct floppy_raw_cmd *raw_cmd)
+{
+	long length[TRACE_CHAIN];
+	int i, err;
+	long start;
+
+	if (plan_active)
+		return plan_cmd(raw_cmd);
+
+	start = rt_now();
+	if (realtime_active && rt_last && (start - rt_last > rt_worst))
+		rt_worst = start - rt_last;
+	if (replay_active) {
+		err = replay_cmd(raw_cmd);
+	} else {
+		/* the kernel leaves the residue in length */
+		for (i=0; trace_active && (i < TRACE_CHAIN); i++) {
+			length[i] = raw_cmd[i].length;
+			if (!(raw_cmd[i].flags & FD_RAW_MORE))
+				break;
+		}
+		err = ioctl(fd, FDRAWCMD, raw_cmd);
+		if (trace_active)
+			trace_cmd(raw_cmd, length, start, err);
+	}
+	rt_last = rt_now();
+	return err;
+}
+
+void realtime_begin(void)
+{
+	struct sched_param param;
+	volatile char touch[0x10000];
+
+	if (plan_active)
+		return;
+	realtime_active = TRUE;
+
+	/* keep everything in memory, also what is allocated later */
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+		perror("Warning: could not lock memory");
+
+	/* real time scheduling, or at least the best nice level */
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = sched_get_priority_min(SCHED_FIFO) + 10;
+	if (sched_setscheduler(0, SCHED_FIFO, &param) == 0) {
+		fprintf(stderr, "Real time scheduling (SCHED_FIFO %i)\n",
+			param.sched_priority);
+	} else if (setpriority(PRIO_PROCESS, 0, -20) == 0) {
+		fprintf(stderr, "No real time scheduling, nice -20\n");
+	} else {
+		fprintf(stderr, "No real time scheduling\n");
+	}
+
+	/* fault in the stack and the progress buffer now, not between two
+	 * commands */
+	memset((char *) touch, 0, sizeof(touch));
+	memset(rt_ring, 0, sizeof(rt_ring));
+
+	/* progress goes to memory and out between tracks */
+	setvbuf(stderr, rt_ring, _IOFBF, sizeof(rt_ring));
+}
+
+void realtime_prefault(void *buf, int len)
+{
+	if (realtime_active)
+		memset(buf, 0, len);
+}
+
+void realtime_track(void)
+{
+	if (!realtime_active)
+		return;
+	fflush(stderr);
+	rt_last = 0;
+}
+
+void realtime_end(void)
+{
+	if (!realtime_active)
+		return;
+	fprintf(stderr, "Worst gap between commands %li us\n", rt_worst);
+	fflush(stderr);
+	setvbuf(stderr, NULL, _IONBF, 0);
+	realtime_active = FALSE;
+}
+
 void printdiskinfo(FILE *out, Diskinfo *diskinfo)
 {
 	char *magic = diskinfo->magic;
@@ -75,146 +206,1941 @@ void init_sectorinfo(Sectorinfo *sectorinfo, int track, int head, int sector)
 	sectorinfo->unused2 = 0;
 }
 
-/* Initialise a raw FDC command */
-void init_raw_cmd(struct floppy_raw_cmd *raw_cmd)
+int sector_size(Sectorinfo *sectorinfo)
 {
-	raw_cmd->flags = 0;
-	raw_cmd->track = 0;
-	raw_cmd->data  = NULL;
-	raw_cmd->kernel_data = NULL;
-	raw_cmd->next  = NULL;
-	raw_cmd->length = 0;
-	raw_cmd->phys_length = 0;
-	raw_cmd->buffer_length = 0;
-	raw_cmd->cmd_count = 0;
-	raw_cmd->reply_count = 0;
-	raw_cmd->resultcode = 0;	
+	return 128 << (sectorinfo->bps & 7);
 }
 
-void reset(int fd) {
+int sector_len(Sectorinfo *sectorinfo)
+{
+	return sectorinfo->unused1 + (sectorinfo->unused2 * 256);
+}
 
-	int err;
+void set_sector_len(Sectorinfo *sectorinfo, int len)
+{
+	sectorinfo->unused1 = len & 0xFF;
+	sectorinfo->unused2 = len >> 8;
+}
 
-	err = ioctl(fd, FDRESET);
-	if (err < 0) {
-		perror("Error resetting fdc");
-		exit(1);
+void set_unread(Trackinfo *trackinfo, unsigned int mask)
+{
+	trackinfo->unused1[0] = mask & 0xFF;
+	trackinfo->unused1[1] = (mask >> 8) & 0xFF;
+	trackinfo->unused1[2] = (mask >> 16) & 0xFF;
+}
+
+unsigned int get_unread(Trackinfo *trackinfo)
+{
+	return trackinfo->unused1[0] | (trackinfo->unused1[1] << 8) |
+		(trackinfo->unused1[2] << 16);
+}
+
+void init_image(Image *image, int tracks, int heads)
+{
+	memset(image, 0, sizeof(*image));
+	image->diskinfo.tracks = tracks;
+	image->diskinfo.heads = heads;
+	image->ntracks = tracks * heads;
+	image->track = calloc(image->ntracks, sizeof(Track));
+	if (image->track == NULL) {
+		myabort("Error: Out of memory\n");
 	}
+}
 
+void free_image(Image *image)
+{
+	int i;
+
+	for (i=0; i<image->ntracks; i++)
+		free(image->track[i].data);
+	free(image->track);
+	image->track = NULL;
+	image->ntracks = 0;
 }
 
-void recalibrate(int fd, int drive) {
+static int write_pad(FILE *file, int len)
+{
+	static const unsigned char zero[0x100];
+	int n;
 
-	int i, err;
-	struct floppy_raw_cmd raw_cmd;
-	unsigned char mask = 0xFF;
+	while (len > 0) {
+		n = len > sizeof(zero) ? sizeof(zero) : len;
+		if (fwrite(zero, 1, n, file) != n)
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
 
-	/* some floppy disc controllers will seek a maximum of 77 tracks
-	   for a reclibrate command. This is not sufficient if the 
-	   position of the read/write head is on track 78 or above as is
-	   possible with a 80 track drive.
- 
-	   other floppy disc controllers will seek 80 tracks for a 
-	   recalibrate command.
+static int image_error(Image *image, char *s)
+{
+	fprintf(stderr, "%s\n", s);
+	if (image != NULL)
+		free_image(image);
+	return -1;
+}
 
-	   1) perform a recalibrate command.
-              the result will either be a successfull seek, and the
-              read/write head will be over track 0. (seek end,
-              interrupt code = 0). Or there will be an error (seek end,
-	      equipment check, and interrupt code!=0).
-	   2) test if the read/write head is over track 0 using
-	      get drive status.
-           3) if the read/write head is not over track 0 (possible with
-	      floppy disc controllers that seek up to 77 tracks), then do
-              a second recalibrate. 
-           4) test if the read/write head is over track 0 using
-              get drive status.
-           5) if the read/write head is not over track 0 then drive may
-              be broken, or may not be connected.
-	*/
+int load_image(FILE *file, Image *image)
+{
+	Diskinfo diskinfo;
+	Track *track;
+	int i, j, count, tracklen, len, edsk;
 
-	/* first recalibrate */
-	init_raw_cmd(&raw_cmd);
-	raw_cmd.flags = FD_RAW_INTR;
-	raw_cmd.length = 0;
-	raw_cmd.cmd[raw_cmd.cmd_count++] = FD_RECALIBRATE & mask;
-	raw_cmd.cmd[raw_cmd.cmd_count++] = drive;			
-	err = ioctl(fd, FDRAWCMD, &raw_cmd);
-	if (err < 0) {
-		perror("Error recalibrating");
-		exit(1);
+	/* read disk info, detect extended image */
+	count = fread(&diskinfo, 1, sizeof(diskinfo), file);
+	if (count != sizeof(diskinfo)) {
+		return image_error(NULL,
+			"Error reading Disk-Info: File to short");
+	}
+	edsk = FALSE;
+	if (strncmp(diskinfo.magic, MAGIC_DISK, strlen(MAGIC_DISK))) {
+		if (strncmp(diskinfo.magic, MAGIC_EDISK, strlen(MAGIC_EDISK))) {
+			return image_error(NULL,
+				"Error reading Disk-Info: Invalid Disk-Info");
+		}
+		edsk = TRUE;
+	}
+	if ((diskinfo.heads < 1) || (diskinfo.heads > MAX_SIDES) ||
+		(diskinfo.tracks * diskinfo.heads > sizeof(diskinfo.tracklenhigh))) {
+		return image_error(NULL,
+			"Error reading Disk-Info: Invalid geometry");
 	}
 
-	/* if read/write head was at track>77 and floppy disc controller
-	can only seek 77 tracks using recalibrate command:
-	- seek end
-	- seek complete
-	- track0 is not set
+	init_image(image, diskinfo.tracks, diskinfo.heads);
+	image->diskinfo = diskinfo;
+	image->edsk = edsk;
 
-	perform a second recalibrate to seek the remaining tracks */	
-	
-	/* get drive status */
-	init_raw_cmd(&raw_cmd);
-	raw_cmd.flags = 0;
-	raw_cmd.length = 0;
-	raw_cmd.cmd[raw_cmd.cmd_count++] = FD_GETSTATUS & mask;
-	raw_cmd.cmd[raw_cmd.cmd_count++] = drive;
-	err = ioctl(fd, FDRAWCMD, &raw_cmd);
-	if (err<0)
-	{
-		perror("Error recalibrating");
+	/* Get tracklen for normal disk images */
+	tracklen = diskinfo.tracklen[0] + diskinfo.tracklen[1]*256;
+
+	for (i=0; i<image->ntracks; i++) {
+		track = &image->track[i];
+		if (edsk)
+			tracklen = diskinfo.tracklenhigh[i]*256;
+
+		/* unformatted tracks are left out of EDSK images */
+		if (tracklen == 0) {
+			strncpy(track->info.magic, MAGIC_TRACK,
+				sizeof(track->info.magic));
+			track->info.track = i / diskinfo.heads;
+			track->info.head = i % diskinfo.heads;
+			continue;
+		}
+		if (tracklen < sizeof(Trackinfo)) {
+			return image_error(image,
+				"Error reading Track-Info: Invalid track size");
+		}
+
+		count = fread(&track->info, 1, sizeof(track->info), file);
+		if (count != sizeof(track->info)) {
+			return image_error(image,
+				"Error reading Track-Info: File to short");
+		}
+		if (strncmp(track->info.magic, MAGIC_TRACK, strlen(MAGIC_TRACK)))
+			return image_error(image,
+				"Error reading Track-Info: Invalid Track-Info");
+		if (track->info.spt > 29)
+			return image_error(image,
+				"Error reading Track-Info: Too many sectors");
+
+		track->len = tracklen - sizeof(Trackinfo);
+		track->data = malloc(track->len ? track->len : 1);
+		if (track->data == NULL) {
+			myabort("Error: Out of memory\n");
+		}
+		count = fread(track->data, 1, track->len, file);
+		if (count != track->len)
+			return image_error(image,
+				"Error reading Track: File to short");
+
+		/* keep the data length of every sector, then drop padding */
+		len = 0;
+		for (j=0; j<track->info.spt; j++) {
+			if (!edsk)
+				set_sector_len(&track->info.sectorinfo[j],
+					sector_size(&track->info.sectorinfo[j]));
+			len += sector_len(&track->info.sectorinfo[j]);
+		}
+		if (len > track->len)
+			return image_error(image,
+				"Error reading Track: Sectors exceed track");
+		track->len = len;
+	}
+	return 0;
+}
+
+void read_image(FILE *file, Image *image)
+{
+	if (load_image(file, image) < 0)
 		exit(1);
+}
+
+int write_image(FILE *file, Image *image)
+{
+	Diskinfo diskinfo;
+	Trackinfo trackinfo;
+	Track *track;
+	int i, j, count, tracklen;
+
+	/* normal images need one track size for all tracks */
+	diskinfo = image->diskinfo;
+	if (image->edsk) {
+		memcpy(diskinfo.magic, MAGIC_EDISK_WRITE, sizeof(diskinfo.magic));
+		memset(diskinfo.unused1, 0, sizeof(diskinfo.unused1));
+		strncpy((char *) diskinfo.unused1, CREATOR,
+			sizeof(diskinfo.unused1));
+		diskinfo.tracklen[0] = 0;
+		diskinfo.tracklen[1] = 0;
+		for (i=0; i<image->ntracks; i++) {
+			track = &image->track[i];
+			diskinfo.tracklenhigh[i] = track->info.spt ?
+				(track->len + 0x1FF) >> 8 : 0;
+		}
+	} else {
+		if (strncmp(diskinfo.magic, MAGIC_DISK, strlen(MAGIC_DISK))) {
+			memset(diskinfo.magic, 0, sizeof(diskinfo.magic));
+			strncpy(diskinfo.magic, MAGIC_DISK_WRITE,
+				sizeof(diskinfo.magic));
+		}
+		tracklen = TRACKLEN;
+		for (i=0; i<image->ntracks; i++) {
+			if (image->track[i].len > tracklen)
+				tracklen = image->track[i].len;
+		}
+		tracklen = ((tracklen + 0xFF) & ~0xFF) + 0x100;
+		diskinfo.tracklen[0] = tracklen & 0xFF;
+		diskinfo.tracklen[1] = tracklen >> 8;
 	}
-	/* at track 0? */
-	if (raw_cmd.reply[0] & ST3_TZ)
-		return;
 
+	count = fwrite(&diskinfo, 1, sizeof(diskinfo), file);
+	if (count != sizeof(diskinfo)) {
+		fprintf(stderr, "Error writing Disk-Info: File to short\n");
+		return -1;
+	}
 
-	/* no */
+	for (i=0; i<image->ntracks; i++) {
+		track = &image->track[i];
+		if (image->edsk && (track->info.spt == 0))
+			continue;
 
-	/* recalibrate a second time */
-	init_raw_cmd(&raw_cmd);
-	raw_cmd.flags = FD_RAW_INTR;
-	raw_cmd.length = 0;
-	raw_cmd.cmd[raw_cmd.cmd_count++] = FD_RECALIBRATE & mask;
-	raw_cmd.cmd[raw_cmd.cmd_count++] = drive;			
-	err = ioctl(fd, FDRAWCMD, &raw_cmd);
-	if (err < 0) {
-		perror("Error recalibrating");
-		exit(1);
+		trackinfo = track->info;
+		if (!image->edsk) {
+			for (j=0; j<trackinfo.spt; j++) {
+				trackinfo.sectorinfo[j].unused1 = 0;
+				trackinfo.sectorinfo[j].unused2 = 0;
+			}
+		}
+		count = fwrite(&trackinfo, 1, sizeof(trackinfo), file);
+		if (count != sizeof(trackinfo)) {
+			fprintf(stderr, "Error writing Track-Info: File to short\n");
+			return -1;
+		}
+		count = fwrite(track->data, 1, track->len, file);
+		if ((count != track->len) || write_pad(file, image->edsk ?
+			((track->len + 0xFF) & ~0xFF) - track->len :
+			tracklen - 0x100 - track->len)) {
+			fprintf(stderr, "Error writing Track: File to short\n");
+			return -1;
+		}
 	}
+	return 0;
+}
 
-	/* get drive status */
-	init_raw_cmd(&raw_cmd);
-	raw_cmd.flags = 0;
-	raw_cmd.length = 0;
-	raw_cmd.cmd[raw_cmd.cmd_count++] = FD_GETSTATUS & mask;
-	raw_cmd.cmd[raw_cmd.cmd_count++] = drive;
-	err = ioctl(fd, FDRAWCMD, &raw_cmd);
-	if (err<0)
-	{
-		perror("Error recalibrating");
-		exit(1);
+int track_bytes(Trackinfo *trackinfo, int gap)
+{
+	int i, n = 0;
+
+	for (i=0; i<trackinfo->spt; i++)
+		n += RAW_SECT_BYTES + sector_size(&trackinfo->sectorinfo[i]);
+	if (trackinfo->spt > 1)
+		n += (trackinfo->spt - 1) * gap;
+	return n;
+}
+
+int track_fits(Trackinfo *trackinfo, int gap)
+{
+	return track_bytes(trackinfo, gap) <= RAW_TRACK_BYTES - RAW_SPEED_TOL;
+}
+
+int compute_gap(Trackinfo *trackinfo, int *gap, int *gpl)
+{
+	int want, room;
+
+	want = trackinfo->gap ? trackinfo->gap : GAP;
+	room = RAW_TRACK_BYTES - RAW_SPEED_TOL - track_bytes(trackinfo, 0);
+
+	*gap = want;
+	if (trackinfo->spt > 1) {
+		if (room / (trackinfo->spt - 1) < *gap)
+			*gap = room / (trackinfo->spt - 1);
+		if (*gap < want && *gap < RAW_MIN_GAP)
+			*gap = want < RAW_MIN_GAP ? want : RAW_MIN_GAP;
+		room -= (trackinfo->spt - 1) * *gap;
 	}
 
-	/* at track 0? */
-	if (raw_cmd.reply[0] & ST3_TZ)
+	/* GPL scales like the standard pair of 0x52 (format) and 0x2A */
+	*gpl = (*gap * 0x2A) / 0x52;
+	if (*gpl < 1)
+		*gpl = 1;
+
+	return room;
+}
+
+void rotateleft_sectorids(Trackinfo *trackinfo, int pos) {
+
+	Sectorinfo sectorinfo[29];
+	int i, spt;
+
+	memcpy( sectorinfo, trackinfo->sectorinfo, sizeof( Sectorinfo ) * 29 );
+
+	spt = trackinfo->spt;
+	for( i=0; i<spt; i++ ) {
+		memcpy( &trackinfo->sectorinfo[i],
+			&sectorinfo[(i+pos)%spt], sizeof( Sectorinfo ) );
+	}
+
+}
+
+void rotate_sectorids(Trackinfo *trackinfo) {
+
+	int i, low, pos, sector;
+
+	low = 0xFF;
+	pos = 0;
+
+	/* Find lowest sector number */
+	for( i=0; i<trackinfo->spt; i++ ) {
+		sector = trackinfo->sectorinfo[i].sector;
+		if ( sector < low ) {
+			low = sector;
+			pos = i;
+		}
+	}
+
+	/* Rotate sectorids in trackinfo left by pos positions */
+	rotateleft_sectorids(trackinfo, pos);
+
+}
+
+int standard_layout(Trackinfo *trackinfo, int track)
+{
+	Sectorinfo *sectorinfo = trackinfo->sectorinfo;
+	unsigned int seen = 0;
+	int i, low = 0xFF, d;
+
+	if (trackinfo->spt < 2)
+		return FALSE;
+	for (i=0; i<trackinfo->spt; i++) {
+		if ((sectorinfo[i].track != track) ||
+			(sectorinfo[i].head != sectorinfo[0].head) ||
+			(sectorinfo[i].bps != sectorinfo[0].bps) ||
+			sectorinfo[i].err1 || sectorinfo[i].err2)
+			return FALSE;
+		if (sectorinfo[i].sector < low)
+			low = sectorinfo[i].sector;
+	}
+	for (i=0; i<trackinfo->spt; i++) {
+		d = sectorinfo[i].sector - low;
+		if ((d >= trackinfo->spt) || (seen & (1 << d)))
+			return FALSE;
+		seen |= 1 << d;
+	}
+	return TRUE;
+}
+
+void interleave_sectors(Trackinfo *trackinfo, int *order, int interleave,
+	int skew)
+{
+	int logical[29], used[29];
+	int i, j, p, tmp, spt = trackinfo->spt;
+
+	if (spt == 0)
 		return;
 
-	/* if recalibrate failed a second time:
-	- disc drive is broken
-	- disc drive doesn't exist
-	*/
+	/* logical order is by sector number */
+	for (i=0; i<spt; i++)
+		logical[i] = i;
+	for (i=1; i<spt; i++) {
+		for (j=i; (j > 0) && (trackinfo->sectorinfo[logical[j-1]].sector >
+			trackinfo->sectorinfo[logical[j]].sector); j--) {
+			tmp = logical[j];
+			logical[j] = logical[j-1];
+			logical[j-1] = tmp;
+		}
+	}
 
-	printf("Disc drive malfunction, or disc drive not connected");
-	exit(1);
+	memset(used, 0, sizeof(used));
+	skew %= spt;
+	p = 0;
+	for (i=0; i<spt; i++) {
+		while (used[p])
+			p = (p + 1) % spt;
+		used[p] = TRUE;
+		order[(p + skew) % spt] = logical[i];
+		p = (p + interleave) % spt;
+	}
 }
 
-void init(int fd, int drive) {
+int first_sector(Trackinfo *trackinfo)
+{
+	int i, low = 0xFF;
 
-	reset( fd );
-	usleep( 100 );
-	recalibrate( fd,drive);
-	usleep( 100 );
+	for (i=0; i<trackinfo->spt; i++)
+		if (trackinfo->sectorinfo[i].sector < low)
+			low = trackinfo->sectorinfo[i].sector;
+	return low;
+}
+
+int mt_layout(Trackinfo *side0, Trackinfo *side1, int track)
+{
+	if (!standard_layout(side0, track) ||
+		(first_sector(side0) != 1) ||
+		(side0->sectorinfo[0].head != 0))
+		return FALSE;
+	if (side1 == NULL)
+		return TRUE;
+	return standard_layout(side1, track) &&
+		(first_sector(side1) == 1) &&
+		(side1->sectorinfo[0].head == 1) &&
+		(side1->spt == side0->spt) &&
+		(side1->sectorinfo[0].bps == side0->sectorinfo[0].bps);
+}
+
+void id_order(Trackinfo *trackinfo, unsigned char *data, unsigned char *buf,
+	int tobuf)
+{
+	int i, size, low;
+	unsigned char *sect;
+
+	low = first_sector(trackinfo);
+	for (i=0; i<trackinfo->spt; i++) {
+		size = sector_size(&trackinfo->sectorinfo[i]);
+		sect = buf + (trackinfo->sectorinfo[i].sector - low) * size;
+		if (tobuf)
+			memcpy(sect, data, size);
+		else
+			memcpy(data, sect, size);
+		data += size;
+	}
+}
+
+int skew_for(Trackinfo *trackinfo, long us)
+{
+	long sector;
+
+	if (trackinfo->spt == 0)
+		return 0;
+	sector = (RAW_SECT_BYTES + sector_size(&trackinfo->sectorinfo[0]) +
+		trackinfo->gap) * 32L;
+	return ((us + sector - 1) / sector) % trackinfo->spt;
+}
+
+/* CRC-16/CCITT.
+ *
+ * The table driven version processes 8 bytes per step with 8 tables
+ * (slicing-by-8): table[k][n] is the CRC of byte n followed by k zero
+ * bytes. The carry-less multiply version folds 16 byte blocks with PCLMUL,
+ * x^192 and x^128 mod P bring a block 128 bits further, and leaves the
+ * last block and the tail to the tables. Both are checked against the
+ * bitwise definition before the fast one is used, once per process before
+ * the first CRC, whichever thread asks for it.
+ */
+
+#define CRC_POLY 0x1021
+
+static unsigned short crc_table[8][256];
+static unsigned long long crc_k[4];	/* x^128, x^192, x^512, x^576 mod P */
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static int crc_use_clmul = FALSE;
+
+unsigned int fnv1a(unsigned int hash, const unsigned char *buf, int len)
+{
+	while (len--) {
+		hash ^= *buf++;
+		hash *= 0x01000193;
+	}
+	return hash;
+}
+
+unsigned short crc16_bitwise(unsigned short crc, const unsigned char *buf,
+	int len)
+{
+	int i;
+
+	while (len--) {
+		crc ^= *buf++ << 8;
+		for (i=0; i<8; i++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ CRC_POLY : (crc << 1);
+	}
+	return crc;
+}
+
+unsigned short crc16_table(unsigned short crc, const unsigned char *buf,
+	int len)
+{
+	while (len >= 8) {
+		crc = crc_table[7][buf[0] ^ (crc >> 8)] ^
+			crc_table[6][buf[1] ^ (crc & 0xFF)] ^
+			crc_table[5][buf[2]] ^ crc_table[4][buf[3]] ^
+			crc_table[3][buf[4]] ^ crc_table[2][buf[5]] ^
+			crc_table[1][buf[6]] ^ crc_table[0][buf[7]];
+		buf += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = (crc << 8) ^ crc_table[0][(crc >> 8) ^ *buf++];
+	return crc;
+}
+
+/* x^n mod P, a 16 bit polynomial */
+static unsigned long long crc_xpow(int n)
+{
+	unsigned int r = 1;
+
+	while (n--) {
+		r <<= 1;
+		if (r & 0x10000)
+			r ^= 0x10000 | CRC_POLY;
+	}
+	return r;
 }
 
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("pclmul,ssse3")))
+static __m128i crc_fold(__m128i x, __m128i k)
+{
+	return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11),
+		_mm_clmulepi64_si128(x, k, 0x00));
+}
+
+__attribute__((target("pclmul,ssse3")))
+unsigned short crc16_clmul(unsigned short crc, const unsigned char *buf,
+	int len)
+{
+	const __m128i swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+		8, 9, 10, 11, 12, 13, 14, 15);
+	__m128i k128, k512, x0, x1, x2, x3;
+	unsigned char last[16];
+
+	if (len < 64)
+		return crc16_table(crc, buf, len);
+
+	/* low half: x^128, high half: x^192 (the high half of a block
+	 * is 64 bits further away) */
+	k128 = _mm_set_epi64x(crc_k[1], crc_k[0]);
+	k512 = _mm_set_epi64x(crc_k[3], crc_k[2]);
+
+	/* the register is the same as the first two bytes xor-ed */
+	x0 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) buf), swap);
+	x0 = _mm_xor_si128(x0, _mm_slli_si128(_mm_cvtsi32_si128(crc), 14));
+	x1 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) (buf+16)), swap);
+	x2 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) (buf+32)), swap);
+	x3 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) (buf+48)), swap);
+	buf += 64;
+	len -= 64;
+
+	/* four blocks at a time, each folded 512 bits */
+	while (len >= 64) {
+		x0 = _mm_xor_si128(crc_fold(x0, k512), _mm_shuffle_epi8(
+			_mm_loadu_si128((__m128i *) buf), swap));
+		x1 = _mm_xor_si128(crc_fold(x1, k512), _mm_shuffle_epi8(
+			_mm_loadu_si128((__m128i *) (buf+16)), swap));
+		x2 = _mm_xor_si128(crc_fold(x2, k512), _mm_shuffle_epi8(
+			_mm_loadu_si128((__m128i *) (buf+32)), swap));
+		x3 = _mm_xor_si128(crc_fold(x3, k512), _mm_shuffle_epi8(
+			_mm_loadu_si128((__m128i *) (buf+48)), swap));
+		buf += 64;
+		len -= 64;
+	}
+	x0 = _mm_xor_si128(crc_fold(x0, k128), x1);
+	x0 = _mm_xor_si128(crc_fold(x0, k128), x2);
+	x0 = _mm_xor_si128(crc_fold(x0, k128), x3);
+	while (len >= 16) {
+		x0 = _mm_xor_si128(crc_fold(x0, k128), _mm_shuffle_epi8(
+			_mm_loadu_si128((__m128i *) buf), swap));
+		buf += 16;
+		len -= 16;
+	}
+
+	/* what is left is a 128 bit message, plus the tail */
+	_mm_storeu_si128((__m128i *) last, _mm_shuffle_epi8(x0, swap));
+	crc = crc16_table(0, last, 16);
+	return crc16_table(crc, buf, len);
+}
+
+int crc_has_clmul(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul") &&
+		__builtin_cpu_supports("ssse3");
+}
+#else
+unsigned short crc16_clmul(unsigned short crc, const unsigned char *buf,
+	int len)
+{
+	return crc16_table(crc, buf, len);
+}
+
+int crc_has_clmul(void)
+{
+	return FALSE;
+}
+#endif
+
+static void crc16_setup(void)
+{
+	unsigned char test[1024];
+	unsigned short crc;
+	int i, k, len;
+
+	for (i=0; i<256; i++) {
+		crc = i << 8;
+		for (k=0; k<8; k++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ CRC_POLY : (crc << 1);
+		crc_table[0][i] = crc;
+	}
+	for (k=1; k<8; k++)
+		for (i=0; i<256; i++)
+			crc_table[k][i] = (crc_table[k-1][i] << 8) ^
+				crc_table[0][crc_table[k-1][i] >> 8];
+	crc_k[0] = crc_xpow(128);
+	crc_k[1] = crc_xpow(192);
+	crc_k[2] = crc_xpow(512);
+	crc_k[3] = crc_xpow(576);
+
+	/* self check on all lengths up to a few blocks, and a long one */
+	for (i=0; i<sizeof(test); i++)
+		test[i] = (i * 167 + 13) ^ (i >> 3);
+	for (len=0; len<=sizeof(test); len += (len < 200) ? 1 : 103) {
+		crc = crc16_bitwise(0xFFFF, test, len);
+		if (crc16_table(0xFFFF, test, len) != crc)
+			myabort("Error: CRC table self check failed\n");
+		if (crc_has_clmul() && (crc16_clmul(0xFFFF, test, len) != crc)) {
+			fprintf(stderr, "PCLMUL CRC self check failed, "
+				"using tables\n");
+			return;
+		}
+	}
+	crc_use_clmul = crc_has_clmul();
+}
+
+void crc16_init(void)
+{
+	pthread_once(&crc_once, crc16_setup);
+}
+
+unsigned short crc16_ccitt(unsigned short crc, const unsigned char *buf,
+	int len)
+{
+	crc16_init();
+	if (crc_use_clmul && (len >= 64))
+		return crc16_clmul(crc, buf, len);
+	return crc16_table(crc, buf, len);
+}
+
+/* Raw track decoding.
+ *
+ * The FDC only frames bytes once, at the start of the READ TRACK transfer.
+ * Sectors that were written later (write splices) may therefore turn up
+ * shifted by a few bits, so address marks are searched for at every bit
+ * position. Anything that does not pass the CRC is left to the caller.
+ */
+
+#define MAX_MARKS 256
+
+typedef struct rawmark_t {
+	int bit;		/* bit offset of the first 0xA1 sync byte */
+	unsigned char type;	/* 0xFE id, 0xFB data, 0xF8 deleted data */
+	unsigned char chrn[4];	/* C, H, R, N for valid id marks */
+	char valid;
+} Rawmark;
+
+static unsigned char rawbyte(unsigned char *raw, int bit)
+{
+	int i = bit >> 3, s = bit & 7;
+
+	if (s == 0)
+		return raw[i];
+	return (raw[i] << s) | (raw[i+1] >> (8 - s));
+}
+
+static void rawcopy(unsigned char *dst, unsigned char *raw, int bit, int n)
+{
+	while (n--) {
+		*dst++ = rawbyte(raw, bit);
+		bit += 8;
+	}
+}
+
+/* Check the CRC of the field at bit with n bytes following the mark */
+static int rawcrc(unsigned char *raw, int bit, unsigned char type, int n)
+{
+	unsigned char mark[4] = { 0xA1, 0xA1, 0xA1, 0 };
+	unsigned char field[0x400];
+	unsigned short crc;
+	int k;
+
+	mark[3] = type;
+	crc = crc16_ccitt(0xFFFF, mark, 4);
+	bit += 32;
+	if ((bit & 7) == 0) {
+		crc = crc16_ccitt(crc, raw + (bit >> 3), n);
+		bit += 8*n;
+		n = 0;
+	}
+
+	/* shifted fields are realigned a piece at a time */
+	for (; n > 0; n -= k, bit += 8*k) {
+		k = (n > sizeof(field)) ? sizeof(field) : n;
+		rawcopy(field, raw, bit, k);
+		crc = crc16_ccitt(crc, field, k);
+	}
+	return ((rawbyte(raw, bit) << 8) | rawbyte(raw, bit+8)) == crc;
+}
+
+/* Is there a CRC-correct data field of n bytes for the id mark at bit?
+ * Returns the bit offset of its mark or -1. */
+static int find_data(Rawmark *marks, int nmarks, unsigned char *raw,
+	int nbits, int bit, int n)
+{
+	int i, d;
+
+	for (i=0; i<nmarks; i++) {
+		if (marks[i].type == 0xFE)
+			continue;
+		d = (marks[i].bit - bit) / 8;
+		if ((d < 30) || (d > 70))
+			continue;
+		if (marks[i].bit + (4 + n + 2) * 8 + 8 > nbits)
+			continue;
+		if (rawcrc(raw, marks[i].bit, marks[i].type, n))
+			return i;
+	}
+	return -1;
+}
+
+int decode_track(unsigned char *raw, int len, Trackinfo *trackinfo,
+	unsigned char *data, int maxlen)
+{
+	Rawmark marks[MAX_MARKS];
+	Rawmark *ids[MAX_MARKS];
+	int pos[29], end[29];
+	int nmarks = 0, nids = 0, nbits = len * 8;
+	int i, j, k, m, n, bit, rev, first, size, off, mask, gap;
+	unsigned char type, mark[4] = { 0xA1, 0xA1, 0xA1, 0 };
+	Sectorinfo *sectorinfo;
+
+	/* collect address marks at any bit alignment */
+	for (bit=0; bit + 48 <= nbits && nmarks < MAX_MARKS; bit++) {
+		if ((rawbyte(raw, bit) != 0xA1) ||
+			(rawbyte(raw, bit+8) != 0xA1) ||
+			(rawbyte(raw, bit+16) != 0xA1))
+			continue;
+		type = rawbyte(raw, bit+24);
+		if ((type != 0xFE) && (type != 0xFB) && (type != 0xF8))
+			continue;
+		marks[nmarks].bit = bit;
+		marks[nmarks].type = type;
+		marks[nmarks].valid = FALSE;
+		if ((type == 0xFE) && (bit + 10*8 + 8 <= nbits) &&
+			rawcrc(raw, bit, type, 4)) {
+			rawcopy(marks[nmarks].chrn, raw, bit+32, 4);
+			marks[nmarks].valid = TRUE;
+			ids[nids++] = &marks[nmarks];
+		}
+		nmarks++;
+		bit += 31;
+	}
+	if (nids == 0)
+		return -1;
+
+	/* the first id seen again one revolution later gives the track length */
+	rev = 0;
+	for (i=1; i<nids; i++) {
+		k = ids[i]->bit - ids[0]->bit;
+		if (!memcmp(ids[i]->chrn, ids[0]->chrn, 4) &&
+			(k > (RAW_TRACK_BYTES * 8 * 94) / 100) &&
+			(k < (RAW_TRACK_BYTES * 8 * 106) / 100)) {
+			rev = k;
+			break;
+		}
+	}
+	if (rev == 0)
+		return -1;
+
+	/* one revolution worth of ids */
+	n = 0;
+	while ((n < nids) && (ids[n]->bit < ids[0]->bit + rev - 16*8))
+		n++;
+	if (n > 29)
+		n = 29;
+
+	/* the sector the capture started in has its id just before the
+	 * end of the first revolution */
+	first = 0;
+	k = rev - RAW_ID_TO_DATA * 8;
+	for (i=0; i<n; i++) {
+		if (abs(ids[i]->bit - k) < abs(ids[first]->bit - k))
+			first = i;
+	}
+	if (abs(ids[first]->bit - k) > 32*8)
+		first = -1;
+
+	trackinfo->spt = n;
+	trackinfo->bps = ids[first < 0 ? 0 : first]->chrn[3];
+	mask = 0;
+	off = 0;
+	for (m=0; m<n; m++) {
+		i = ((first < 0 ? 0 : first) + m) % n;
+		sectorinfo = &trackinfo->sectorinfo[m];
+		sectorinfo->track = ids[i]->chrn[0];
+		sectorinfo->head = ids[i]->chrn[1];
+		sectorinfo->sector = ids[i]->chrn[2];
+		sectorinfo->bps = ids[i]->chrn[3];
+		sectorinfo->err1 = 0;
+		sectorinfo->err2 = 0;
+		pos[m] = ids[i]->bit;
+		end[m] = -1;
+
+		size = 128 << (sectorinfo->bps & 7);
+		if (off + size > maxlen) {
+			trackinfo->spt = m;
+			break;
+		}
+
+		/* the partial sector at the start of the capture */
+		if ((m == 0) && (first >= 0) && (size + 2 <= len)) {
+			mark[3] = 0xFB;
+			if (crc16_ccitt(crc16_ccitt(0xFFFF, mark, 4), raw,
+				size) != ((raw[size] << 8) | raw[size+1])) {
+				mark[3] = 0xF8;
+			}
+			if (crc16_ccitt(crc16_ccitt(0xFFFF, mark, 4), raw,
+				size) == ((raw[size] << 8) | raw[size+1])) {
+				memcpy(data + off, raw, size);
+				if (mark[3] == 0xF8)
+					sectorinfo->err2 = 0x40;
+				mask |= 1 << m;
+			}
+		}
+
+		/* either occurrence of the id will do */
+		for (j=0; !(mask & (1 << m)) && (j < 2); j++) {
+			k = find_data(marks, nmarks, raw, nbits,
+				pos[m] + j*rev, size);
+			if (k < 0)
+				continue;
+			rawcopy(data + off, raw, marks[k].bit + 32, size);
+			if (marks[k].type == 0xF8)
+				sectorinfo->err2 = 0x40;
+			if (j == 0)
+				end[m] = marks[k].bit + (4 + size + 2) * 8;
+			mask |= 1 << m;
+		}
+		off += size;
+	}
+
+	/* measure GAP3 between neighbouring sectors of the first revolution */
+	gap = 0x100;
+	for (m=0; m+1<trackinfo->spt; m++) {
+		if ((end[m] < 0) || (pos[m+1] < end[m]))
+			continue;
+		k = (pos[m+1] - end[m]) / 8 - 12;
+		if ((k > 0) && (k < gap))
+			gap = k;
+	}
+	if (gap < 0x100)
+		trackinfo->gap = gap;
+
+	return mask;
+}
+
+/* Initialise a raw FDC command */
+void init_raw_cmd(struct floppy_raw_cmd *raw_cmd)
+{
+	raw_cmd->flags = 0;
+	raw_cmd->track = 0;
+	raw_cmd->data  = NULL;
+	raw_cmd->kernel_data = NULL;
+	raw_cmd->next  = NULL;
+	raw_cmd->length = 0;
+	raw_cmd->phys_length = 0;
+	raw_cmd->buffer_length = 0;
+	raw_cmd->cmd_count = 0;
+	raw_cmd->reply_count = 0;
+	raw_cmd->resultcode = 0;	
+}
+
+void reset(int fd) {
+
+	int err;
+
+	if (plan_active) {
+		plan_note("RESET");
+		return;
+	}
+	if (replay_active) {
+		trace_reset();
+		return;
+	}
+
+	err = ioctl(fd, FDRESET);
+	if (err < 0) {
+		perror("Error resetting fdc");
+		exit(1);
+	}
+	if (trace_active)
+		trace_reset();
+
+}
+
+int find_track0(int fd, int drive) {
+
+	int i, err;
+	struct floppy_raw_cmd raw_cmd;
+	unsigned char mask = 0xFF;
+
+	/* some floppy disc controllers will seek a maximum of 77 tracks
+	   for a reclibrate command. This is not sufficient if the 
+	   position of the read/write head is on track 78 or above as is
+	   possible with a 80 track drive.
+ 
+	   other floppy disc controllers will seek 80 tracks for a 
+	   recalibrate command.
+
+	   1) perform a recalibrate command.
+              the result will either be a successfull seek, and the
+              read/write head will be over track 0. (seek end,
+              interrupt code = 0). Or there will be an error (seek end,
+	      equipment check, and interrupt code!=0).
+	   2) test if the read/write head is over track 0 using
+	      get drive status.
+           3) if the read/write head is not over track 0 (possible with
+	      floppy disc controllers that seek up to 77 tracks), then do
+              a second recalibrate. 
+           4) test if the read/write head is over track 0 using
+              get drive status.
+           5) if the read/write head is not over track 0 then drive may
+              be broken, or may not be connected.
+	*/
+
+	/* first recalibrate */
+	init_raw_cmd(&raw_cmd);
+	raw_cmd.flags = FD_RAW_INTR;
+	raw_cmd.length = 0;
+	raw_cmd.cmd[raw_cmd.cmd_count++] = FD_RECALIBRATE & mask;
+	raw_cmd.cmd[raw_cmd.cmd_count++] = drive;			
+	err = fdc_cmd(fd, &raw_cmd);
+	if (err < 0)
+		return -1;
+
+	/* if read/write head was at track>77 and floppy disc controller
+	can only seek 77 tracks using recalibrate command:
+	- seek end
+	- seek complete
+	- track0 is not set
+
+	perform a second recalibrate to seek the remaining tracks */	
+	
+	/* get drive status */
+	init_raw_cmd(&raw_cmd);
+	raw_cmd.flags = 0;
+	raw_cmd.length = 0;
+	raw_cmd.cmd[raw_cmd.cmd_count++] = FD_GETSTATUS & mask;
+	raw_cmd.cmd[raw_cmd.cmd_count++] = drive;
+	err = fdc_cmd(fd, &raw_cmd);
+	if (err<0)
+		return -1;
+	/* at track 0? */
+	if (raw_cmd.reply[0] & ST3_TZ)
+		return 0;
+
+
+	/* no */
+
+	/* recalibrate a second time */
+	init_raw_cmd(&raw_cmd);
+	raw_cmd.flags = FD_RAW_INTR;
+	raw_cmd.length = 0;
+	raw_cmd.cmd[raw_cmd.cmd_count++] = FD_RECALIBRATE & mask;
+	raw_cmd.cmd[raw_cmd.cmd_count++] = drive;			
+	err = fdc_cmd(fd, &raw_cmd);
+	if (err < 0)
+		return -1;
+
+	/* get drive status */
+	init_raw_cmd(&raw_cmd);
+	raw_cmd.flags = 0;
+	raw_cmd.length = 0;
+	raw_cmd.cmd[raw_cmd.cmd_count++] = FD_GETSTATUS & mask;
+	raw_cmd.cmd[raw_cmd.cmd_count++] = drive;
+	err = fdc_cmd(fd, &raw_cmd);
+	if (err<0)
+		return -1;
+
+	/* at track 0? */
+	if (raw_cmd.reply[0] & ST3_TZ)
+		return 0;
+
+	/* if recalibrate failed a second time:
+	- disc drive is broken
+	- disc drive doesn't exist
+	*/
+
+	return 1;
+}
+
+void recalibrate(int fd, int drive) {
+
+	int err;
+
+	err = find_track0(fd, drive);
+	if (err < 0) {
+		perror("Error recalibrating");
+		exit(1);
+	}
+	if (err) {
+		printf("Disc drive malfunction, or disc drive not connected");
+		exit(1);
+	}
+}
+
+void	seek(int fd, int drive, int track)
+{
+	int i, err;
+	struct floppy_raw_cmd raw_cmd;
+	unsigned char mask = 0xFF;
+
+	init_raw_cmd(&raw_cmd);
+	raw_cmd.flags = FD_RAW_INTR;
+	raw_cmd.track = track;
+	raw_cmd.rate  = 0;
+	raw_cmd.length= 0;
+
+	raw_cmd.cmd[raw_cmd.cmd_count++] = FD_SEEK & mask;
+	raw_cmd.cmd[raw_cmd.cmd_count++] = drive;
+	raw_cmd.cmd[raw_cmd.cmd_count++] = track;
+
+	err = fdc_cmd(fd, &raw_cmd);
+
+	if (err<0)
+		printf("error");
+}
+
+long seek_time(int fd, int drive)
+{
+	struct timeval start, end;
+	long t;
+
+	if (plan_active)
+		return drivetiming[drive].cmd + drivetiming[drive].step +
+			drivetiming[drive].settle;
+
+	seek(fd, drive, 0);
+	gettimeofday(&start, NULL);
+	seek(fd, drive, 1);
+	gettimeofday(&end, NULL);
+	seek(fd, drive, 0);
+
+	t = (end.tv_sec - start.tv_sec) * 1000000L +
+		(end.tv_usec - start.tv_usec);
+	return t + drivetiming[drive].settle;
+}
+
+long switch_time(int fd, int drive)
+{
+	struct floppy_raw_cmd raw_cmd;
+	struct timeval start, end;
+	unsigned char mask = 0xFF;
+	long t = 0;
+	int i;
+
+	if (plan_active)
+		return drivetiming[drive].cmd;
+
+	/* SENSE DRIVE STATUS does not wait for the disk, so the time of one
+	 * on head 1 right after one on head 0 is the turnaround alone */
+	for (i=0; i<2*SWITCH_SAMPLES; i++) {
+		init_raw_cmd(&raw_cmd);
+		raw_cmd.flags = 0;
+		raw_cmd.length = 0;
+		raw_cmd.cmd[raw_cmd.cmd_count++] = FD_GETSTATUS & mask;
+		raw_cmd.cmd[raw_cmd.cmd_count++] = ((i & 1) << 2) | drive;
+		gettimeofday(&start, NULL);
+		if (fdc_cmd(fd, &raw_cmd) < 0) {
+			perror("Error sensing drive");
+			exit(1);
+		}
+		gettimeofday(&end, NULL);
+		if (i & 1)
+			t += (end.tv_sec - start.tv_sec) * 1000000L +
+				(end.tv_usec - start.tv_usec);
+	}
+	return t / SWITCH_SAMPLES;
+}
+
+int disk_changed(int fd, int drive)
+{
+	struct floppy_raw_cmd raw_cmd;
+	unsigned char mask = 0xFF;
+
+	if (plan_active || replay_active)
+		return FALSE;
+
+	/* the driver copies the change line into the flags of every raw
+	 * command; FDGETDRVSTAT keeps FD_DISK_CHANGED until the block device
+	 * is opened again, so it would not clear for raw users */
+	init_raw_cmd(&raw_cmd);
+	raw_cmd.flags = 0;
+	raw_cmd.length = 0;
+	raw_cmd.cmd[raw_cmd.cmd_count++] = FD_GETSTATUS & mask;
+	raw_cmd.cmd[raw_cmd.cmd_count++] = drive;
+	if (fdc_cmd(fd, &raw_cmd) < 0) {
+		perror("Error sensing drive");
+		exit(1);
+	}
+	if (!(raw_cmd.flags & FD_RAW_DISK_CHANGE))
+		return FALSE;
+
+	/* the line only goes back once the drive steps with a disk in it */
+	seek(fd, drive, 1);
+	seek(fd, drive, 0);
+	return TRUE;
+}
+
+static char *profile_name(int drive, char *name)
+{
+	sprintf(name, "%s/fd%i", PROFILE_DIR, drive);
+	return name;
+}
+
+int set_profile(int fd, int drive, Profile *profile)
+{
+	struct floppy_drive_params params;
+
+	drivetiming[drive & 3].step = profile->srt;
+	drivetiming[drive & 3].settle = profile->hlt * 1000;
+	if (plan_active || replay_active)
+		return 0;
+
+	if (ioctl(fd, FDGETDRVPRM, &params) < 0)
+		return -1;
+	params.srt = profile->srt;
+	params.hlt = profile->hlt;
+	if (ioctl(fd, FDSETDRVPRM, &params) < 0)
+		return -1;
+	return 0;
+}
+
+int read_profile(int drive, Profile *profile)
+{
+	char name[64];
+	FILE *in;
+	int n;
+
+	in = fopen(profile_name(drive, name), "r");
+	if (in == NULL)
+		return FALSE;
+	n = fscanf(in, "srt %li hlt %li", &profile->srt, &profile->hlt);
+	fclose(in);
+	return (n == 2) && (profile->srt > 0) && (profile->hlt > 0);
+}
+
+int save_profile(int drive, Profile *profile)
+{
+	char name[64];
+	FILE *out;
+
+	mkdir(PROFILE_DIR, 0755);
+	out = fopen(profile_name(drive, name), "w");
+	if (out == NULL)
+		return -1;
+	fprintf(out, "srt %li hlt %li\n", profile->srt, profile->hlt);
+	return fclose(out);
+}
+
+void init(int fd, int drive) {
+
+	Profile profile;
+
+	/* reset and recalibrate only return once the FDC is done, no
+	 * padding needed around them */
+	reset( fd );
+
+	/* step as fast as dskcal found the drive can */
+	if (read_profile(drive, &profile)) {
+		if (set_profile(fd, drive, &profile) < 0)
+			perror("Warning: could not set drive profile");
+		else
+			fprintf(stderr, "Drive %i: step %lius, head load "
+				"%lims\n", drive, profile.srt, profile.hlt);
+	}
+
+	recalibrate( fd, drive & 3 );
+}
+
+void init_trackinfo( Trackinfo *trackinfo, int track, int side ) {
+
+	int i;
+
+	memset(trackinfo, 0, sizeof(*trackinfo));
+
+	strncpy( trackinfo->magic, MAGIC_TRACK, sizeof( trackinfo->magic ) );
+	//unsigned char unused1[0x03];
+	trackinfo->track = track;
+	trackinfo->head = side;
+	//unsigned char unused2[0x02];
+	trackinfo->bps = 2;
+	trackinfo->spt = 0;
+	trackinfo->gap = 82;
+	trackinfo->fill = 0xFF;
+	//trackinfo->sectorinfo[29];
+//	for ( i=0; i<9; i++ ) {
+//		init_sectorinfo( &trackinfo->sectorinfo[i], track, 0, 0xC1+i );
+//	}
+
+}
+
+/* The number of sectors on the track: the shortest period after which
+ * the n IDs read one after the other repeat, NSECTS if they do not (or a
+ * READ ID failed) */
+static int id_period(struct floppy_raw_cmd *cmds, int n)
+{
+	int i, p;
+
+	for (i=0; i<n; i++) {
+		if (cmds[i].reply[0] & 0xC0)
+			return NSECTS;
+	}
+	for (p=1; (p<n) && (p<=MAX_SECTS); p++) {
+		for (i=0; i+p<n; i++) {
+			if (memcmp(&cmds[i].reply[3], &cmds[i+p].reply[3], 4))
+				break;
+		}
+		if (i+p == n)
+			return p;
+	}
+	return NSECTS;
+}
+
+int read_ids(int fd, Trackinfo *trackinfo, int head, int drive) {
+
+	/* on the stack, dskfarm and dskcopy read in several threads */
+	unsigned char buf[8*1024];
+	int i, err;
+	struct floppy_raw_cmd cmds[32];
+	struct floppy_raw_cmd *cur_cmd;
+
+	unsigned char mask = 0xFF;
+
+	cur_cmd = cmds;
+
+	/* --  detect unformatted track -- */
+	/* attempt to read an id and compare the result information
+	against what we are expecting for a unformatted track */
+
+	/* initialise this cmd */
+	init_raw_cmd(cur_cmd);
+	cur_cmd->flags = /*FD_RAW_READ |*/ FD_RAW_INTR;
+	cur_cmd->track = trackinfo->track;
+	cur_cmd->rate  = 2;	/* SD */
+	cur_cmd->length= /*(128<<(trackinfo->bps))*/ 0;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = READ_ID & mask;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = (head<<2) | drive;
+			
+	err = fdc_cmd(fd, cmds);
+
+	if ((cur_cmd->reply[0] & 0x0c0)==0x040) 
+	{
+		/* check for specific command response which indicates
+		a unformatted track */
+		if (
+			(cur_cmd->reply[1]==1) && /* ST1 */
+			(cur_cmd->reply[2]==0) && /* ST2 */
+			(cur_cmd->reply[4]==0) && /* H */
+			(cur_cmd->reply[5]==1) && /* R */
+			(cur_cmd->reply[6]==0) /* N */
+			)
+		{
+			return 0;
+		}
+
+/*		int i;
+		for (i=0; i<7; i++)
+		{
+			printf("%02x ",cur_cmd->reply[i]);
+		}
+		printf("\r\n");
+*/
+	}	
+
+
+	/* setup a list of 32 read id commands:
+	- if each read id command is done seperatly then
+		some id's will be skipped. (the time between reading a id and
+		the next using seperate reads is too long for small sectors of
+		256 bytes in size!
+		- I've only seen up to 32 sectors on copyprotections,
+		I don't think there are copyprotections that use more.
+		- don't use seek flag; this seems to cause id's to be missed.
+		
+	   problems:
+		- need to calculate number of sectors per track
+		- need to find the first sector id
+	*/
+	/* synchronises with 2nd sector id on track */
+
+	cur_cmd=cmds;
+	init_raw_cmd(cur_cmd);
+	cur_cmd->flags = FD_RAW_READ | FD_RAW_INTR;
+	cur_cmd->flags |= FD_RAW_MORE;
+//	cur_cmd->flags |= FD_RAW_SPIN;
+
+	cur_cmd->data = buf;
+	cur_cmd->track = trackinfo->track;
+	cur_cmd->rate  = 2;	/* SD */
+	cur_cmd->length= 6500;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = FD_READTRACK & mask;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = (head<<2) | drive;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = 7;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = 0x02a;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = 0x0ff;
+
+#if 0
+	/* synchronises with 2nd sector id on track */
+	cur_cmd=cmds;
+	init_raw_cmd(cur_cmd);
+	cur_cmd->flags = FD_RAW_READ | FD_RAW_INTR;
+	cur_cmd->flags |= FD_RAW_MORE;
+	cur_cmd->data = buf;
+	cur_cmd->track = trackinfo->track;
+	cur_cmd->rate  = 2;	/* SD */
+	cur_cmd->length= (128<<(trackinfo->bps));
+	cur_cmd->cmd[cur_cmd->cmd_count++] = FD_READTRACK & mask;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = (head<<2) | drive;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = 1;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = 0x02a;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = 0x0ff;
+#endif
+#if 0
+	/* synchronises with 1st sector id on track */
+	/* attempt to read a non-existant sector */
+	cur_cmd=cmds;
+	init_raw_cmd(cur_cmd);
+	cur_cmd->flags = FD_RAW_READ | FD_RAW_INTR;
+	cur_cmd->flags |= FD_RAW_SPIN;
+	cur_cmd->flags |= FD_RAW_MORE;
+	cur_cmd->data = buf;
+	cur_cmd->track = trackinfo->track;
+	cur_cmd->rate  = 2;	/* SD */
+	cur_cmd->length= (128<<(trackinfo->bps));
+	cur_cmd->cmd[cur_cmd->cmd_count++] = FD_READ & mask;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = (head<<2) | drive;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = 0x0ca;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = 2;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = 0x0ca;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = 0x02a;
+	cur_cmd->cmd[cur_cmd->cmd_count++] = 0x0ff;
+#endif
+
+	/* initialise the read id command list */
+	for (i=1; i<32; i++)
+	{
+		cur_cmd = &cmds[i];
+
+		/* initialise this cmd */
+		init_raw_cmd(cur_cmd);
+		cur_cmd->flags = /*FD_RAW_READ |*/ FD_RAW_INTR;
+		if (i!=(32-1))
+		{
+			cur_cmd->flags |= FD_RAW_MORE;
+		}
+		cur_cmd->track = trackinfo->track;
+		cur_cmd->rate  = 2;	/* SD */
+		cur_cmd->length= 0; /*(128<<(trackinfo->bps));*/
+		cur_cmd->cmd[cur_cmd->cmd_count++] = READ_ID & mask;
+		cur_cmd->cmd[cur_cmd->cmd_count++] = (head<<2) | drive;
+	}		
+	
+	err = fdc_cmd(fd, cmds);
+
+		if (err < 0) {
+		  perror("Error reading id");
+		  exit(1);
+		}
+
+/*	cur_cmd = cmds;
+	for (i=0; i<7; i++)
+	{
+		printf("%02x\r\n",cur_cmd->reply[i]);
+	}
+*/	
+
+	trackinfo->spt = id_period(&cmds[1], 31);
+	for (i=1; i<trackinfo->spt+1; i++)
+	{
+		cur_cmd = &cmds[i];
+		trackinfo->sectorinfo[i-1].track = cur_cmd->reply[3];
+		trackinfo->sectorinfo[i-1].head = cur_cmd->reply[4];
+		trackinfo->sectorinfo[i-1].sector = cur_cmd->reply[5];
+		trackinfo->sectorinfo[i-1].bps = cur_cmd->reply[6];
+	}
+
+	
+
+//	rotate_sectorids( trackinfo );
+
+	return trackinfo->spt;
+}
+
+int read_id(int fd, int track, int head, int drive, unsigned char *chrn) {
+
+	struct floppy_raw_cmd raw_cmd;
+
+	init_raw_cmd(&raw_cmd);
+	raw_cmd.flags = FD_RAW_INTR;
+	raw_cmd.track = track;
+	raw_cmd.rate  = 2;	/* SD */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = READ_ID;
+	raw_cmd.cmd[raw_cmd.cmd_count++] = (head<<2) | drive;
+	if (fdc_cmd(fd, &raw_cmd) < 0) {
+		perror("Error reading ID");
+		exit(1);
+	}
+	if (raw_cmd.reply[0] & 0xC0)
+		return -1;
+	memcpy(chrn, &raw_cmd.reply[3], 4);
+	return 0;
+}
+
+/* Capture a whole track with a single READ TRACK. N=6 makes the FDC
+ * transfer well past the end of the first sector, so the buffer holds the
+ * gaps, ID fields and data fields of more than one revolution. Returns the
+ * number of bytes transferred. */
+
+int read_track_raw(int fd, unsigned char *raw, int track, int head, int drive) {
+
+	int err;
+	struct floppy_raw_cmd raw_cmd;
+	unsigned char mask = 0xFF;
+
+	init_raw_cmd(&raw_cmd);
+	raw_cmd.flags = FD_RAW_READ | FD_RAW_INTR;
+	raw_cmd.data  = raw;
+	raw_cmd.track = track;
+	raw_cmd.rate  = 2;	/* SD */
+	raw_cmd.length= RAW_CAPTURE_LEN;
+	raw_cmd.cmd[raw_cmd.cmd_count++] = FD_READTRACK & mask;
+	raw_cmd.cmd[raw_cmd.cmd_count++] = (head<<2) | drive;
+	raw_cmd.cmd[raw_cmd.cmd_count++] = track;	/* track */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = head;	/* head */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = 1;		/* sector */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = 6;		/* sectorsize */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = 1;		/* EOT */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = 0x02a;	/* GPL */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = 0x0ff;	/* DTL */
+
+	err = fdc_cmd(fd, &raw_cmd);
+	if (err < 0) {
+		perror("Error reading track");
+		exit(1);
+	}
+
+	/* the kernel leaves the DMA residue in length */
+	return RAW_CAPTURE_LEN - raw_cmd.length;
+}
+
+/* standard FD_READ causes problems and is slower! */
+
+/* Read a sector, retrying with recalibrates. The FDC status is kept in the
+ * sector info like in a DSK image. With weak set a data CRC error returns at
+ * once, so the caller can take copies instead. Returns 0 if the sector was
+ * read, otherwise ST1 | ST2 << 8 of the last attempt. */
+
+int read_sect(int fd, Trackinfo *trackinfo, Sectorinfo *sectorinfo,
+	unsigned char *data, int track, int head, int drive, int weak,
+	int retries) {
+
+	int i, err, retry=0, ok=0;
+	struct floppy_raw_cmd raw_cmd;
+	unsigned char mask = 0xFF;
+
+//	reset(fd);
+
+	do {
+		init_raw_cmd(&raw_cmd);
+		raw_cmd.flags = FD_RAW_READ | FD_RAW_INTR;
+		raw_cmd.track = track;
+		raw_cmd.rate  = 2;	/* SD */
+		raw_cmd.length= sector_size(sectorinfo);
+		raw_cmd.data  = data;
+		raw_cmd.cmd_count = 0;
+		raw_cmd.cmd[raw_cmd.cmd_count++] = READ_DATA & mask;
+		raw_cmd.cmd[raw_cmd.cmd_count++] = (head<<2) | drive;	/* head */
+		raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->track;	/* track */
+		raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->head;	/* head */	
+		raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->sector;	/* sector */
+		raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->bps;	/* sectorsize */
+		raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->sector;	/* sector */
+		raw_cmd.cmd[raw_cmd.cmd_count++] = trackinfo->gap;	/* GPL */
+		raw_cmd.cmd[raw_cmd.cmd_count++] = 0xFF;		/* DTL */
+	
+		err = fdc_cmd(fd, &raw_cmd);
+		if (err < 0) {
+			perror("Error reading");
+			exit(1);
+		}
+
+		sectorinfo->err1 = raw_cmd.reply[1] & ~ST1_EOC;
+		sectorinfo->err2 = raw_cmd.reply[2];
+
+		if (((raw_cmd.reply[0] &0x0f8)==0x040) && (raw_cmd.reply[1]==0x080)) {
+			/* end of cylinder */
+			return 0;
+		}
+
+		if (weak && (raw_cmd.reply[2] & ST2_CRC)) {
+			/* data CRC error, let the caller take copies */
+			return sectorinfo->err1 | (sectorinfo->err2 << 8);
+		}
+
+		if (raw_cmd.reply[0] & 0x40) {
+			if (retry++ >= retries)
+				break;
+			recalibrate(fd,drive);
+			seek(fd, drive, track);
+			fprintf(stderr,"TRY %d \n",retry);
+		}
+		else ok = 1; // Read ok, go to next
+	} while (ok == 0);
+
+	if (!ok && !retries)
+		return sectorinfo->err1 | (sectorinfo->err2 << 8);
+	if(!ok) {
+		printf("\n%02x %02x %02x\r\n",raw_cmd.reply[0],raw_cmd.reply[1], raw_cmd.reply[2]);
+		fprintf(stderr, "Could not read sector %0X\n",
+			sectorinfo->sector);
+		return sectorinfo->err1 | (sectorinfo->err2 << 8);
+	}
+	return 0;
+}
+
+/* Read all sectors of a plain track with one command, in sector number
+ * order. With mt the command carries on with head 1 of the cylinder, which
+ * then has to be numbered from 1 as well. Returns 0 if everything came in
+ * without error. */
+
+int read_sectors(int fd, Trackinfo *trackinfo, unsigned char *data,
+	int track, int head, int drive, int mt) {
+
+	int err, low;
+	struct floppy_raw_cmd raw_cmd;
+	unsigned char mask = 0xFF;
+	Sectorinfo *sectorinfo = trackinfo->sectorinfo;
+
+	low = first_sector(trackinfo);
+	init_raw_cmd(&raw_cmd);
+	raw_cmd.flags = FD_RAW_READ | FD_RAW_INTR;
+	raw_cmd.track = track;
+	raw_cmd.rate  = 2;	/* SD */
+	raw_cmd.length= sector_size(sectorinfo) * trackinfo->spt * (mt ? 2 : 1);
+	raw_cmd.data  = data;
+	raw_cmd.cmd[raw_cmd.cmd_count++] = (READ_DATA | (mt ? 0x80 : 0)) & mask;
+	raw_cmd.cmd[raw_cmd.cmd_count++] = (head<<2) | drive;	/* head */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->track;	/* track */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->head;	/* head */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = low;			/* sector */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->bps;	/* sectorsize */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = low + trackinfo->spt - 1; /* EOT */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = trackinfo->gap;	/* GPL */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = 0xFF;		/* DTL */
+
+	err = fdc_cmd(fd, &raw_cmd);
+	if (err < 0) {
+		perror("Error reading");
+		exit(1);
+	}
+
+	/* without terminal count the FDC ends with "end of cylinder" */
+	if (raw_cmd.length != 0)
+		return -1;
+	if ((raw_cmd.reply[0] & 0xC0) == 0)
+		return 0;
+	if (((raw_cmd.reply[0] & 0xC0) == 0x40) &&
+		(raw_cmd.reply[1] == ST1_EOC) && (raw_cmd.reply[2] == 0))
+		return 0;
+	return -1;
+}
+
+/* notes:
+ *
+ * the C (track),H (head),R (sector id),N (sector size) parameters in the
+ * sector id field do not need to be the same as the physical track and
+ * physical side.
+ */
+
+/* The format map lists the sector IDs in the order given by order[] (see
+ * interleave_sectors()), or as in the image if order is NULL. */
+
+void format_cmd(struct floppy_raw_cmd *raw_cmd, format_map_t *map, int track,
+	Trackinfo *trackinfo, unsigned char side, int *order) {
+
+	int i;
+	unsigned char mask = 0xFF;
+	Sectorinfo *sectorinfo;
+
+	for (i=0; i<trackinfo->spt; i++) {
+		//map[i].sector = 0xC1+i;
+		//map[i].size = 2;	/* 0=128, 1=256, 2=512,... */
+		sectorinfo = &trackinfo->sectorinfo[order ? order[i] : i];
+		map[i].sector = sectorinfo->sector;
+		map[i].size = sectorinfo->bps;
+		map[i].cylinder = sectorinfo->track;
+		map[i].head = sectorinfo->head;
+	}
+	init_raw_cmd(raw_cmd);
+	raw_cmd->flags = FD_RAW_WRITE | FD_RAW_INTR;
+	raw_cmd->track = track;
+	raw_cmd->rate  = 2;	/* SD */
+	raw_cmd->length= trackinfo->spt * sizeof(format_map_t);
+	raw_cmd->data  = map;
+
+	raw_cmd->cmd[raw_cmd->cmd_count++] = FD_FORMAT & mask;
+	raw_cmd->cmd[raw_cmd->cmd_count++] = side;	/* head: 4 or 0 */
+	//raw_cmd->cmd[raw_cmd->cmd_count++] = 2;	/* sectorsize */
+	//raw_cmd->cmd[raw_cmd->cmd_count++] = 9;	/* sectors */
+	//raw_cmd->cmd[raw_cmd->cmd_count++] = 82;/* GAP */
+	//raw_cmd->cmd[raw_cmd->cmd_count++] = 0;	/* filler */
+	raw_cmd->cmd[raw_cmd->cmd_count++] = trackinfo->bps;	/* sectorsize */
+	raw_cmd->cmd[raw_cmd->cmd_count++] = trackinfo->spt;	/* sectors */
+	raw_cmd->cmd[raw_cmd->cmd_count++] = trackinfo->gap;	/* GAP */
+	raw_cmd->cmd[raw_cmd->cmd_count++] = trackinfo->fill;	/* filler */
+}
+
+void format_track(int fd, int track, Trackinfo *trackinfo, unsigned char side,
+	int *order) {
+
+	int err;
+	struct floppy_raw_cmd raw_cmd;
+	format_map_t data[FORMAT_MAP];
+
+	//fprintf(stderr, "Formatting Track %i\n", track);
+	format_cmd(&raw_cmd, data, track, trackinfo, side, order);
+	raw_cmd.flags |= FD_RAW_NEED_SEEK;
+	err = fdc_cmd(fd, &raw_cmd);
+	if (err < 0) {
+		perror("Error formatting");
+		exit(1);
+	}
+	if (raw_cmd.reply[0] & 0x40) {
+		fprintf(stderr, "Could not format track %i\n", track);
+		exit(1);
+	}
+}
+
+int read_track_data(int fd, Track *trk, int track, int head, int drive,
+	unsigned char *scratch, int single, int retries, FILE *log)
+{
+	Sectorinfo *sectorinfo;
+	int j, len, off, bad = 0;
+
+	init_trackinfo(&trk->info, track, head);
+	read_ids(fd, &trk->info, head, drive);
+	if (log) {
+		printtrackinfo(log, &trk->info);
+		fprintf(log, " [");
+	}
+
+	len = 0;
+	for (j=0; j<trk->info.spt; j++) {
+		sectorinfo = &trk->info.sectorinfo[j];
+		set_sector_len(sectorinfo, sector_size(sectorinfo));
+		len += sector_len(sectorinfo);
+	}
+	if (len > MAX_EDSK_TRACKLEN) {
+		if (log)
+			fprintf(log, "too long ");
+		trk->info.spt = 0;
+		len = 0;
+	}
+	trk->data = malloc(len ? len : 1);
+	if (trk->data == NULL) {
+		myabort("Error: Out of memory\n");
+	}
+	trk->len = len;
+
+	if (!single && standard_layout(&trk->info, track) &&
+		(read_sectors(fd, &trk->info, scratch, track, head, drive,
+		FALSE) == 0)) {
+		id_order(&trk->info, trk->data, scratch, FALSE);
+		if (log) {
+			for (j=0; j<trk->info.spt; j++)
+				fprintf(log, "%02X+ ",
+					trk->info.sectorinfo[j].sector);
+			fprintf(log, "]\n");
+		}
+		return 0;
+	}
+
+	off = 0;
+	for (j=0; j<trk->info.spt; j++) {
+		sectorinfo = &trk->info.sectorinfo[j];
+		if (log)
+			fprintf(log, "%02X", sectorinfo->sector);
+		if (read_sect(fd, &trk->info, sectorinfo, trk->data + off,
+			track, head, drive, FALSE, retries)) {
+			if (log)
+				fprintf(log, "? ");
+			bad++;
+		} else if (log)
+			fprintf(log, " ");
+		off += sector_len(sectorinfo);
+	}
+	if (log)
+		fprintf(log, "]\n");
+	return bad;
+}
+
+#define MAX_RETRY 20
+
+/* notes:
+ *
+ * when writing, you must specify the sector c,h,r,n exactly, otherwise fdc
+ * will fail to write data to sector.
+ */
+
+//void write_sect(int fd, int track, unsigned char sector, unsigned char *data) {
+void write_sect(int fd, Sectorinfo *sectorinfo, unsigned char *data,
+	unsigned char side, int gpl) {
+
+	int i, err;
+	struct floppy_raw_cmd raw_cmd;
+	//format_map_t data[9];
+	unsigned char mask = 0xFF;
+
+	init_raw_cmd(&raw_cmd);
+	raw_cmd.flags = FD_RAW_WRITE | FD_RAW_INTR;
+	raw_cmd.flags |= FD_RAW_NEED_SEEK;
+
+	raw_cmd.track = sectorinfo->track;
+	raw_cmd.rate  = 2;	/* SD */
+	raw_cmd.length= sector_size(sectorinfo); /* Sectorsize */
+	raw_cmd.data  = data;
+
+	/* the sector info keeps ST2 of the read that made the image: a
+	 * control mark there means the sector was found with a deleted
+	 * data mark, so it is written back as deleted data */
+	if (sectorinfo->err2 & ST2_CM)
+	{
+		/* "write deleted data" (totally untested!) */
+		raw_cmd.cmd[raw_cmd.cmd_count++] = FD_WRITE_DEL & mask;
+	}
+	else
+	{
+		/* "write data" */
+		raw_cmd.cmd[raw_cmd.cmd_count++] = FD_WRITE & mask;
+	}
+
+	// these parameters are same for "write data" and "write deleted data".
+	raw_cmd.cmd[raw_cmd.cmd_count++] = side;		/* head */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->track;	/* track */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->head;	/* head */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->sector;	/* sector */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->bps;	/* sectorsize */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->sector;	/* sector */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = gpl;			/* GPL */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = 0xFF;		/* DTL */
+
+	char ok=0, retry=0;
+
+	do {
+		err = fdc_cmd(fd, &raw_cmd);
+		if (err < 0) {
+			perror("Error writing");
+			exit(1);
+		}
+		if (raw_cmd.reply[0] & 0x40) {
+			retry++;
+			if (retry>MAX_RETRY) ok=1;
+			recalibrate(fd, side & 3); //Force the head to move again
+		}
+		else ok=1;
+	} while (ok==0);
+
+	if (retry>MAX_RETRY)
+		fprintf(stderr, "Could not write sector %0X\n",
+			sectorinfo->sector);
+}
+
+/* Write all sectors of a plain track with one command, data in sector
+ * number order. With mt the command carries on with head 1, which must be
+ * formatted with sectors numbered from 1 as well. Returns 0 on success, the
+ * caller then falls back to writing sector by sector. */
+
+int write_sectors(int fd, Trackinfo *trackinfo, unsigned char *data,
+	unsigned char side, int gpl, int mt) {
+
+	int err, low;
+	struct floppy_raw_cmd raw_cmd;
+	unsigned char mask = 0xFF;
+	Sectorinfo *sectorinfo = trackinfo->sectorinfo;
+
+	if (!mt)
+		mask &= ~0x80;
+	low = first_sector(trackinfo);
+	init_raw_cmd(&raw_cmd);
+	raw_cmd.flags = FD_RAW_WRITE | FD_RAW_INTR;
+	raw_cmd.flags |= FD_RAW_NEED_SEEK;
+
+	raw_cmd.track = sectorinfo->track;
+	raw_cmd.rate  = 2;	/* SD */
+	raw_cmd.length= sector_size(sectorinfo) * trackinfo->spt * (mt ? 2 : 1);
+	raw_cmd.data  = data;
+
+	raw_cmd.cmd[raw_cmd.cmd_count++] = FD_WRITE & mask;	/* MT */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = side;		/* head */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->track;	/* track */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->head;	/* head */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = low;			/* sector */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->bps;	/* sectorsize */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = low + trackinfo->spt - 1; /* EOT */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = gpl;			/* GPL */
+	raw_cmd.cmd[raw_cmd.cmd_count++] = 0xFF;		/* DTL */
+
+	err = fdc_cmd(fd, &raw_cmd);
+	if (err < 0) {
+		perror("Error writing");
+		exit(1);
+	}
+
+	/* without terminal count the FDC ends with "end of cylinder" */
+	if (raw_cmd.length != 0)
+		return -1;
+	if ((raw_cmd.reply[0] & 0xC0) == 0)
+		return 0;
+	if (((raw_cmd.reply[0] & 0xC0) == 0x40) &&
+		(raw_cmd.reply[1] == ST1_EOC) && (raw_cmd.reply[2] == 0))
+		return 0;
+	return -1;
+}
+
+/* Block device fast path.
+ *
+ * The floppy driver reads and writes a whole track per revolution through
+ * its track buffer once it knows the geometry. FDSETPRM gives it the plain
+ * CPC layouts: SPT sectors of 512 bytes numbered from OFF_DAT or OFF_SYS,
+ * the sector base going into the stretch field. A second descriptor opened
+ * for reading or writing then moves whole cylinders with pread()/pwrite().
+ * The driver's retries are cut down meanwhile, so a track that does not
+ * match fails quickly and is done with raw commands instead.
+ */
+
+static struct floppy_max_errors block_errors;
+
+void plain_layout(Trackinfo *trackinfo, int track, int head, int base)
+{
+	int i;
+
+	init_trackinfo(trackinfo, track, head);
+	trackinfo->spt = SPT;
+	trackinfo->bps = BPS;
+	trackinfo->fill = FILL;
+	for (i=0; i<SPT; i++) {
+		init_sectorinfo(&trackinfo->sectorinfo[i], track, head,
+			base + i);
+		set_sector_len(&trackinfo->sectorinfo[i], 128 << BPS);
+	}
+}
+
+int block_layout(Trackinfo *trackinfo, int track, int head)
+{
+	int base;
+
+	if ((trackinfo->spt != SPT) || !standard_layout(trackinfo, track) ||
+		(trackinfo->sectorinfo[0].bps != BPS) ||
+		(trackinfo->sectorinfo[0].head != head))
+		return 0;
+	base = first_sector(trackinfo);
+	if ((base != OFF_DAT) && (base != OFF_SYS))
+		return 0;
+	return base;
+}
+
+int block_open(int fd, int drive, int base, int tracks, int heads,
+	int writing)
+{
+	struct floppy_struct geometry;
+	struct floppy_max_errors errors;
+	char name[32];
+	int bfd;
+
+	if (plan_active || trace_active || replay_active)
+		return -1;
+
+	memset(&geometry, 0, sizeof(geometry));
+	geometry.size = tracks * heads * SPT;
+	geometry.sect = SPT;
+	geometry.head = heads;
+	geometry.track = tracks;
+	geometry.stretch = FD_MKSECTBASE(base);
+	geometry.gap = 0x2A;		/* GPL for reads and writes */
+	geometry.rate = 2;		/* 250kbps */
+	geometry.spec1 = 0xDF;
+	geometry.fmt_gap = 0x52;
+	if (ioctl(fd, FDSETPRM, &geometry) < 0)
+		return -1;
+
+	sprintf(name, "/dev/fd%01d", drive);
+	bfd = open(name, (writing ? O_RDWR : O_RDONLY) | O_NDELAY);
+	if (bfd < 0) {
+		ioctl(fd, FDCLRPRM);
+		return -1;
+	}
+	ioctl(bfd, FDFLUSH);
+
+	/* give up on a track after two tries, raw commands take over */
+	if (ioctl(fd, FDGETMAXERRS, &block_errors) == 0) {
+		errors = block_errors;
+		errors.abort = 2;
+		errors.read_track = 1;
+		errors.reporting = 3;
+		ioctl(fd, FDSETMAXERRS, &errors);
+	}
+	return bfd;
+}
+
+int block_io(int bfd, unsigned char *buf, int track, int head, int heads,
+	int ntracks, int writing)
+{
+	off_t off = ((off_t) track * heads + head) * SPT * (128 << BPS);
+	int len = ntracks * SPT * (128 << BPS);
+
+	if (writing) {
+		if ((pwrite(bfd, buf, len, off) != len) || (fdatasync(bfd) < 0))
+			return -1;
+	} else {
+		if (pread(bfd, buf, len, off) != len)
+			return -1;
+	}
+	return 0;
+}
+
+void block_close(int fd, int bfd)
+{
+	fsync(bfd);
+	ioctl(bfd, FDFLUSH);
+	close(bfd);
+	if (block_errors.abort)
+		ioctl(fd, FDSETMAXERRS, &block_errors);
+	ioctl(fd, FDCLRPRM);
+}
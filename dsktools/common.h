@@ -37,6 +37,13 @@
 #define FD_READ_DEL		0xCC	/* read deleted with MT, MFM */
 #define FD_WRITE_DEL		0xC9	/* write deleted with MT, MFM */
 
+/* uPD765 commands with MFM, and without MT for single sectors */
+#define FD_READTRACK (2|0x040)
+#define READ_ID 0x04a
+#define READ_DATA 0x046
+#define NSECTS 9	/* sectors assumed when the IDs read do not repeat */
+#define MAX_SECTS 29	/* sector infos in a Track-Info block */
+
 /* Boolean values
  */
 #define	TRUE -1
@@ -47,9 +54,12 @@
 #define MAGIC_DISK "MV - CPC"
 #define MAGIC_DISK_WRITE "MV - CPCEMU / 27 Dec 01 01:11"
 #define MAGIC_EDISK "EXTENDED"
+#define MAGIC_EDISK_WRITE "EXTENDED CPC DSK File\r\nDisk-Info\r\n"
+#define CREATOR "dsktools"
 #define	TRACKS 40
 #define MAX_TRACKS 82
 #define MAX_SIDES 2
+#define MAX_DRIVES 8	/* /dev/fd0 to /dev/fd7, four per controller */
 #define HEADS 1
 #define TRACKLEN_INFO (TRACKLEN + 0x100)
 
@@ -65,11 +75,31 @@
 #define TRACKLEN 0x1200
 
 #define MAX_TRACKLEN 0x2000
+#define MAX_EDSK_TRACKLEN 0xFE00	/* data bytes of one EDSK track */
 
 #define OFF_IBM 0x01
 #define OFF_SYS 0x41
 #define OFF_DAT 0xC1
 
+/* Raw track capture (READ TRACK with an oversized N). The transfer starts
+ * at the data field of the first sector after the index hole and runs on
+ * for more than one revolution, so every ID field is seen at least once.
+ */
+#define RAW_CAPTURE_LEN 0x2000	/* bytes transferred by one capture */
+#define RAW_TRACK_BYTES 6250	/* MFM bytes per revolution, 250kbps/300rpm */
+#define RAW_ID_TO_DATA 48	/* ID address mark to first data byte */
+
+/* Track layout on disk, in MFM bytes */
+#define RAW_INDEX_BYTES 146	/* GAP4a, sync, IAM and GAP1 after the index */
+#define RAW_SECT_BYTES 62	/* sync, IDAM, CHRN, CRC, GAP2, sync, DAM, CRC */
+#define RAW_SPEED_TOL 94	/* 1.5% drive speed tolerance */
+#define RAW_MIN_GAP 8		/* smallest GAP3 we choose for a write splice */
+
+/* Default drive timing in microseconds, see Drivetiming */
+#define PLAN_STEP 6000
+#define PLAN_SETTLE 15000
+#define PLAN_CMD 4000
+
 
 typedef struct diskinfo_t {
 	char magic[0x22];
@@ -104,6 +134,42 @@ typedef struct trackinfo_t {
 	Sectorinfo sectorinfo[29];
 } Trackinfo;
 
+/* A track held in memory: its Track-Info block and the sector data as stored
+ * in the image. The length of each sector's data is always kept in unused1
+ * (low) and unused2 (high) of its Sectorinfo, as in an EDSK file, so weak
+ * sectors can carry several copies of their data.
+ */
+typedef struct track_t {
+	Trackinfo info;
+	unsigned char *data;
+	int len;
+} Track;
+
+/* A whole disk image in memory, tracks ordered as in the file */
+typedef struct image_t {
+	Diskinfo diskinfo;
+	int edsk;		/* write as extended image */
+	int ntracks;		/* tracks * heads */
+	Track *track;
+} Image;
+
+/* Mechanical and host timing of a drive, in microseconds */
+typedef struct drivetiming_t {
+	long step;		/* per track stepped */
+	long settle;		/* head settle after a seek */
+	long cmd;		/* host latency of one raw command */
+} Drivetiming;
+
+/* Drive profile written by dskcal: the fastest step rate and head load
+ * time the drive handled reliably. Kept in PROFILE_DIR/fd<drive> and
+ * loaded by init(). */
+#define PROFILE_DIR "/etc/dsktools"
+
+typedef struct profile_t {
+	long srt;		/* step rate, microseconds per track */
+	long hlt;		/* head load and settle, milliseconds */
+} Profile;
+
 /* format map */
 typedef	struct format_map {
 	unsigned char cylinder;
@@ -114,6 +180,39 @@ typedef	struct format_map {
 
 void myabort(char *s);
 
+/* Open /dev/fd<drive> for raw commands */
+int open_drive(int drive);
+
+/* Issue a raw FDC command, or a chain of them linked with FD_RAW_MORE.
+ * All raw commands go through here so a job can be planned instead. */
+int fdc_cmd(int fd, struct floppy_raw_cmd *raw_cmd);
+
+/* Record every raw command to a trace file, or answer them from one
+ * instead of a drive (trace.c) */
+#define TRACE_CHAIN 64		/* longest chain of commands */
+
+extern int trace_active;
+extern int replay_active;
+
+void trace_begin(char *filename, int replay);
+void trace_end(void);
+void trace_cmd(struct floppy_raw_cmd *raw_cmd, long *length, long start,
+	int err);
+int replay_cmd(struct floppy_raw_cmd *raw_cmd);
+void trace_reset(void);
+
+/* Real time mode: lock memory, ask for SCHED_FIFO (falling back to the
+ * best nice level), prefault and buffer progress output on stderr until
+ * realtime_track() flushes it between tracks. fdc_cmd() meanwhile measures
+ * the worst gap between two commands on a track, realtime_end() reports
+ * it. */
+extern int realtime_active;
+
+void realtime_begin(void);
+void realtime_prefault(void *buf, int len);
+void realtime_track(void);
+void realtime_end(void);
+
 void printdiskinfo(FILE *out, Diskinfo *diskinfo);
 
 void printsectorinfo(FILE *out, Sectorinfo *sectorinfo);
@@ -122,6 +221,112 @@ void printtrackinfo(FILE *out, Trackinfo *trackinfo);
 
 void init_sectorinfo(Sectorinfo *sectorinfo, int track, int head, int sector);
 
+/* Size of a sector as given by its N, and the length of its data in memory */
+int sector_size(Sectorinfo *sectorinfo);
+int sector_len(Sectorinfo *sectorinfo);
+void set_sector_len(Sectorinfo *sectorinfo, int len);
+
+/* Sectors (bitmask in trackinfo order, first 24 only) that were not read
+ * from the disk but filled in, kept in the unused bytes after the track
+ * info magic */
+void set_unread(Trackinfo *trackinfo, unsigned int mask);
+unsigned int get_unread(Trackinfo *trackinfo);
+
+/* Allocate an empty image with tracks*heads tracks */
+void init_image(Image *image, int tracks, int heads);
+
+void free_image(Image *image);
+
+/* Read a DSK or EDSK image, exits on errors */
+void read_image(FILE *file, Image *image);
+
+/* Read a DSK or EDSK image, returns -1 after reporting an error */
+int load_image(FILE *file, Image *image);
+
+/* Write an image as DSK or, if image->edsk is set, as EDSK. Returns -1
+ * when the file could not be written. */
+int write_image(FILE *file, Image *image);
+
+/* Bytes a track layout occupies on disk when formatted with GAP3 gap. The
+ * last GAP3 and the gaps around the index are not counted, the FDC may
+ * overwrite those when the track wraps around. */
+int track_bytes(Trackinfo *trackinfo, int gap);
+
+/* 32 bit FNV-1a hash, start with FNV_INIT */
+#define FNV_INIT 0x811C9DC5
+
+unsigned int fnv1a(unsigned int hash, const unsigned char *buf, int len);
+
+/* Does the layout fit one revolution, allowing for drive speed? */
+int track_fits(Trackinfo *trackinfo, int gap);
+
+/* Choose the format GAP3 and read/write GPL for a track: the image's GAP3,
+ * or the largest smaller one that lets the track fit one revolution.
+ * Returns the bytes to spare, negative if the track does not fit. */
+int compute_gap(Trackinfo *trackinfo, int *gap, int *gpl);
+
+/* Rotate the sector IDs of a track left by pos, or so that the lowest
+ * sector number comes first. The sector data is not moved. */
+void rotateleft_sectorids(Trackinfo *trackinfo, int pos);
+void rotate_sectorids(Trackinfo *trackinfo);
+
+/* Is this a plain layout: consecutive sector numbers of one size, C the
+ * physical track, no errors? Only those may be reordered. */
+int standard_layout(Trackinfo *trackinfo, int track);
+
+/* Physical order of the sectors of a track, order[slot] being the index of
+ * a sector in trackinfo. Consecutive sector numbers are interleave slots
+ * apart and the first one is skew slots after the index. */
+void interleave_sectors(Trackinfo *trackinfo, int *order, int interleave,
+	int skew);
+
+/* Lowest sector number of a track */
+int first_sector(Trackinfo *trackinfo);
+
+/* Can one MT command carry on from head 0 to head 1? The FDC continues with
+ * sector 1 and H=1, so both sides must be plain tracks numbered from 1.
+ * side1 may be NULL while head 1 is still unknown. */
+int mt_layout(Trackinfo *side0, Trackinfo *side1, int track);
+
+/* Copy the sectors of a plain track between image order (data) and the
+ * sector number order a multi-sector command transfers (buf) */
+void id_order(Trackinfo *trackinfo, unsigned char *data, unsigned char *buf,
+	int tobuf);
+
+/* Skew in sectors that covers us microseconds on this track */
+int skew_for(Trackinfo *trackinfo, long us);
+
+/* CRC-16/CCITT as used by the FDC for ID and data fields, continuing from
+ * crc (0xFFFF to start). Uses the fastest implementation that passed the
+ * self check of crc16_init(). */
+unsigned short crc16_ccitt(unsigned short crc, const unsigned char *buf,
+	int len);
+
+/* The implementations: bitwise reference, slicing-by-8 tables and PCLMUL
+ * folding (the tables where the CPU has no PCLMUL). The last two need
+ * crc16_init() first. */
+unsigned short crc16_bitwise(unsigned short crc, const unsigned char *buf,
+	int len);
+unsigned short crc16_table(unsigned short crc, const unsigned char *buf,
+	int len);
+unsigned short crc16_clmul(unsigned short crc, const unsigned char *buf,
+	int len);
+
+/* Build the tables and check the implementations against each other, the
+ * first call only; crc16_ccitt() calls it */
+void crc16_init(void);
+
+/* Does the CPU have PCLMUL and SSSE3 for crc16_clmul()? */
+int crc_has_clmul(void);
+
+/* Decode a raw track capture into sector IDs and data. Fills trackinfo with
+ * the IDs in rotational order (starting at the index hole) and copies each
+ * sector whose data CRC checks into data, packed as in a DSK image and
+ * limited to maxlen bytes. Returns a bitmask of the recovered sectors, or
+ * -1 if no full revolution of IDs could be found. */
+int decode_track(unsigned char *raw, int len, Trackinfo *trackinfo,
+	unsigned char *data, int maxlen);
+
 /* Initialise a raw FDC command */
 void init_raw_cmd(struct floppy_raw_cmd *raw_cmd);
 
@@ -130,8 +335,130 @@ void reset(int fd);
 
 void init(int fd, int drive);
 
+/* Hand a profile to the floppy driver and the planner. Returns -1 if the
+ * driver refused it. */
+int set_profile(int fd, int drive, Profile *profile);
+
+/* Read the profile of a drive, FALSE if it has none */
+int read_profile(int drive, Profile *profile);
+
+int save_profile(int drive, Profile *profile);
+
+/* Recalibrate, 0 if the head then is on track 0, 1 if it is not (no drive
+ * there), -1 if the command failed */
+int find_track0(int fd, int drive);
+
 /* Recalibrate FDD to track 0 */
 void recalibrate(int fd, int drive);
 
+void seek(int fd, int drive, int track);
+
+/* Time from starting a one track seek until data can be read, measured on
+ * the drive (planned from drivetiming when planning) */
+long seek_time(int fd, int drive);
+
+/* Time from a command on head 0 until the next one on head 1 reaches the
+ * controller, measured on the drive (drivetiming when planning) */
+#define SWITCH_SAMPLES 8
+long switch_time(int fd, int drive);
+
+/* TRUE if the disk was changed (or taken out) since the last command,
+ * from the change line; always FALSE when planning or replaying */
+int disk_changed(int fd, int drive);
+
+void init_trackinfo(Trackinfo *trackinfo, int track, int side);
+
+/* Sector IDs of a track, in the order they pass the head starting with the
+ * second sector after the index. Returns the number of sectors, 0 for an
+ * unformatted track. */
+int read_ids(int fd, Trackinfo *trackinfo, int head, int drive);
+
+/* C, H, R, N of the next ID field to pass the head. Returns -1 if there is
+ * none. */
+int read_id(int fd, int track, int head, int drive, unsigned char *chrn);
+
+/* Capture a track with one READ TRACK, returns the bytes transferred */
+int read_track_raw(int fd, unsigned char *raw, int track, int head,
+	int drive);
+
+/* Read one sector, retrying up to retries times with recalibrates unless
+ * weak is set and the data CRC is bad. Returns 0, or ST1 | ST2 << 8 of the
+ * failed read. */
+int read_sect(int fd, Trackinfo *trackinfo, Sectorinfo *sectorinfo,
+	unsigned char *data, int track, int head, int drive, int weak,
+	int retries);
+
+/* Read all sectors of a plain track with one command in sector number
+ * order, with mt continuing on head 1. Returns 0 if all were read. */
+int read_sectors(int fd, Trackinfo *trackinfo, unsigned char *data,
+	int track, int head, int drive, int mt);
+
+/* Read a whole track as dskread does without options: the IDs, then a
+ * plain track with one command (into scratch, MAX_EDSK_TRACKLEN bytes),
+ * everything else sector by sector with retries. Allocates trk->data, the
+ * head must be over the track. With a log, the IDs and a mark for every
+ * sector are written to it. Returns the number of sectors not read. */
+int read_track_data(int fd, Track *trk, int track, int head, int drive,
+	unsigned char *scratch, int single, int retries, FILE *log);
+
+/* Format a track with the sector IDs of trackinfo, in the order given by
+ * order[] or as in trackinfo if order is NULL. side is the second command
+ * byte: head << 2 | unit. Exits if the FDC refuses. */
+void format_track(int fd, int track, Trackinfo *trackinfo, unsigned char side,
+	int *order);
+
+/* Set up the FORMAT command format_track() issues, without a seek, so it
+ * can be chained. The format map goes to map, which must hold FORMAT_MAP
+ * entries as the transfer is one sector long. */
+#define FORMAT_MAP 128
+
+void format_cmd(struct floppy_raw_cmd *raw_cmd, format_map_t *map, int track,
+	Trackinfo *trackinfo, unsigned char side, int *order);
+
+/* Write one sector with its exact C, H, R, N, as deleted data if ST2 says
+ * so, retrying with recalibrates */
+void write_sect(int fd, Sectorinfo *sectorinfo, unsigned char *data,
+	unsigned char side, int gpl);
+
+/* Write all sectors of a plain track with one command, data in sector
+ * number order, with mt continuing on head 1. Returns 0 on success. */
+int write_sectors(int fd, Trackinfo *trackinfo, unsigned char *data,
+	unsigned char side, int gpl, int mt);
+
+/* A plain CPC track: SPT sectors of 512 bytes numbered from base */
+void plain_layout(Trackinfo *trackinfo, int track, int head, int base);
+
+/* Block device fast path for plain DATA and SYSTEM disks. block_layout()
+ * returns the sector base if the floppy driver can read or write the track
+ * by itself, else 0. block_open() hands the geometry to the driver with
+ * FDSETPRM and opens the block device, -1 if that is not possible (also
+ * while planning or tracing). block_io() moves ntracks tracks from track
+ * and head on, in sector number order, returns -1 if the driver failed.
+ * block_close() gives the drive back to autodetection. */
+int block_layout(Trackinfo *trackinfo, int track, int head);
+int block_open(int fd, int drive, int base, int tracks, int heads,
+	int writing);
+int block_io(int bfd, unsigned char *buf, int track, int head, int heads,
+	int ntracks, int writing);
+void block_close(int fd, int bfd);
+
+/* Dry-run planner (plan.c). While plan_active is set fdc_cmd() simulates
+ * commands and logs them instead of talking to a drive. */
+extern int plan_active;
+extern Drivetiming drivetiming[4];
+
+void plan_begin(FILE *out);
+
+int plan_cmd(struct floppy_raw_cmd *raw_cmd);
+
+/* Log a step that is not a raw command */
+void plan_note(char *name);
+
+/* Report a reason the job can not run */
+void plan_error(char *format, ...);
+
+/* Print the estimate, returns the number of problems found */
+int plan_end(void);
+
 #endif /* COMMON_H */
 
@@ -0,0 +1,105 @@
+/* $Id$
+ *
+ * crcbench.c - Compare and time the CRC-16/CCITT implementations of
+ * dsktools on the data of an 80 track double sided disk.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define BENCH_TRACKS 80
+#define SECTORS (BENCH_TRACKS * MAX_SIDES * SPT)
+#define SECTOR 512
+
+typedef unsigned short (*Crcfunc)(unsigned short, const unsigned char *,
+	int);
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* CRC of every sector like the FDC computes it, data mark included */
+static unsigned int run(Crcfunc crc, unsigned char *disk)
+{
+	static const unsigned char mark[4] = { 0xA1, 0xA1, 0xA1, 0xFB };
+	unsigned int sum = 0;
+	int i;
+
+	for (i=0; i<SECTORS; i++)
+		sum += crc(crc(0xFFFF, mark, 4), disk + i*SECTOR, SECTOR);
+	return sum;
+}
+
+static void bench(char *name, Crcfunc crc, unsigned char *disk,
+	unsigned int expect)
+{
+	double start, t;
+	int n, rounds;
+
+	if (run(crc, disk) != expect) {
+		printf("%-8s differs from the bitwise CRC\n", name);
+		exit(1);
+	}
+	rounds = 1;
+	do {
+		start = now();
+		for (n=0; n<rounds; n++)
+			run(crc, disk);
+		t = now() - start;
+		rounds *= 2;
+	} while (t < 0.2);
+	rounds /= 2;
+	printf("%-8s %10.1f us per disk %8.1f MB/s\n", name,
+		t / rounds * 1e6, (double) SECTORS * SECTOR * rounds / t / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned char *disk;
+	unsigned int expect;
+	int i;
+
+	disk = malloc(SECTORS * SECTOR);
+	if (disk == NULL) {
+		myabort("Error: Out of memory\n");
+	}
+	srand(1);
+	for (i=0; i<SECTORS * SECTOR; i++)
+		disk[i] = rand();
+
+	crc16_init();
+	expect = run(crc16_bitwise, disk);
+	printf("%i sectors of %i bytes\n", SECTORS, SECTOR);
+	bench("bitwise", crc16_bitwise, disk, expect);
+	bench("table", crc16_table, disk, expect);
+	if (crc_has_clmul())
+		bench("pclmul", crc16_clmul, disk, expect);
+	else
+		printf("%-8s not supported by this CPU\n", "pclmul");
+	bench("default", crc16_ccitt, disk, expect);
+
+	free(disk);
+	return 0;
+}
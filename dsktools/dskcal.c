@@ -0,0 +1,289 @@
+/* $Id$
+ *
+ * dskcal.c - Find the fastest step rate and head load time a floppy drive
+ * handles reliably and save them as its profile for the other dsktools.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "common.h"
+
+#include <unistd.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <linux/fd.h>
+#include <linux/fdreg.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <fcntl.h>
+
+/* Options for calibrate() */
+typedef struct calopts_t {
+	int drives[MAX_DRIVES];
+	int ndrives;
+	int tracks;		/* tracks to seek across */
+	int rounds;		/* times every setting is tried */
+	int save;		/* write the profile */
+} Calopts;
+
+/* notes:
+ *
+ * The step rate and head load time are set with FDSETDRVPRM; the floppy
+ * driver sends them to the FDC with SPECIFY before the next command. At
+ * 250kbps the FDC steps in units of 2ms and loads the head in units of
+ * 4ms, so only those values are tried, fastest last. After every seek a
+ * READ ID must find the cylinder the head was sent to, which needs a disk
+ * formatted with the physical track in C (any DATA, SYSTEM or PC disk).
+ *
+ * The head load time only matters when the head has been unloaded, so
+ * while it is tried every READ ID waits for the head unload time (HUT of
+ * the driver) and HUT_MARGIN more first. The head settle time after a
+ * step is not something the FDC or the driver can be told; it is part of
+ * what the step test measures.
+ */
+
+#define HUT_MARGIN 10000	/* us waited past the head unload time */
+
+static long srts[] = { 12000, 10000, 8000, 6000, 4000, 2000, 0 };
+static long hlts[] = { 32, 24, 16, 12, 8, 4, 0 };
+
+/* Is the head over track? Waits idle microseconds first. */
+int check_id(int fd, int unit, int track, long idle) {
+
+	unsigned char chrn[4];
+
+	if (idle)
+		usleep(idle);
+	return (read_id(fd, track, 0, unit, chrn) == 0) &&
+		(chrn[0] == track);
+}
+
+/* Single steps out and back, then ever longer seeks from track 0, each
+ * checked with READ ID after idle microseconds. Returns the time taken in
+ * microseconds, -1 as soon as the head is not where it should be. */
+long seek_test(int fd, int unit, int tracks, int rounds, long idle) {
+
+	struct timeval start, end;
+	int r, t, len;
+
+	gettimeofday(&start, NULL);
+	for (r=0; r<rounds; r++) {
+		for (t=1; t<tracks; t++) {
+			seek(fd, unit, t);
+			if (!check_id(fd, unit, t, idle))
+				return -1;
+		}
+		for (t=tracks-2; t>=0; t--) {
+			seek(fd, unit, t);
+			if (!check_id(fd, unit, t, idle))
+				return -1;
+		}
+		for (len=2; len<tracks; len*=2) {
+			seek(fd, unit, len);
+			if (!check_id(fd, unit, len, idle))
+				return -1;
+			seek(fd, unit, 0);
+			if (!check_id(fd, unit, 0, idle))
+				return -1;
+		}
+	}
+	gettimeofday(&end, NULL);
+	return (end.tv_sec - start.tv_sec) * 1000000L +
+		(end.tv_usec - start.tv_usec);
+}
+
+/* Try one setting, leave the head on track 0 */
+int try_profile(int fd, int drive, Profile *profile, Calopts *opts,
+	long idle) {
+
+	long t;
+
+	if (set_profile(fd, drive, profile) < 0) {
+		perror("Error setting drive parameters");
+		exit(1);
+	}
+	t = seek_test(fd, drive & 3, opts->tracks, opts->rounds, idle);
+	fprintf(stderr, "  step %5lius, head load %2lims: ", profile->srt,
+		profile->hlt);
+	if (t < 0) {
+		fprintf(stderr, "failed\n");
+		recalibrate(fd, drive & 3);
+		return FALSE;
+	}
+	fprintf(stderr, "%.2fs\n", t / 1000000.0);
+	return TRUE;
+}
+
+void calibrate(int drive, Calopts *opts) {
+
+	struct floppy_drive_params params;
+	Profile start, best, profile;
+	long idle;
+	int fd, i;
+
+	fprintf(stderr, "Drive %i\n", drive);
+	fd = open_drive(drive);
+
+	/* start from the slowest settings; what the driver uses now may be
+	 * an old profile another tool has set, so it is only put back */
+	reset(fd);
+	recalibrate(fd, drive & 3);
+	if (ioctl(fd, FDGETDRVPRM, &params) < 0) {
+		perror("Error getting drive parameters");
+		exit(1);
+	}
+	idle = params.hut * 1000L + HUT_MARGIN;
+	start.srt = srts[0];
+	start.hlt = hlts[0];
+	best = start;
+	if (!try_profile(fd, drive, &best, opts, 0) ||
+		!try_profile(fd, drive, &best, opts, idle)) {
+		fprintf(stderr, "Drive %i fails with the slowest settings, "
+			"is a formatted disk in it?\n", drive);
+		best.srt = params.srt;
+		best.hlt = params.hlt;
+		set_profile(fd, drive, &best);
+		close(fd);
+		return;
+	}
+
+	/* step rate first, with the default head load time */
+	profile = best;
+	for (i=0; srts[i]; i++) {
+		if (srts[i] >= best.srt)
+			continue;
+		profile.srt = srts[i];
+		if (!try_profile(fd, drive, &profile, opts, 0))
+			break;
+		best = profile;
+	}
+
+	/* then the head load time at that step rate, loading the head
+	 * again for every READ ID */
+	profile = best;
+	for (i=0; hlts[i]; i++) {
+		if (hlts[i] >= best.hlt)
+			continue;
+		profile.hlt = hlts[i];
+		if (!try_profile(fd, drive, &profile, opts, idle))
+			break;
+		best = profile;
+	}
+
+	/* the final setting must pass twice as often */
+	opts->rounds *= 2;
+	if (!try_profile(fd, drive, &best, opts, 0) ||
+		!try_profile(fd, drive, &best, opts, idle)) {
+		fprintf(stderr, "Drive %i is not reliable at that speed, "
+			"keeping the slowest settings\n", drive);
+		best = start;
+		set_profile(fd, drive, &best);
+	}
+	opts->rounds /= 2;
+
+	fprintf(stderr, "Drive %i: step %lius, head load %lims (was %lius, "
+		"%lims)\n", drive, best.srt, best.hlt, params.srt, params.hlt);
+	if (opts->save) {
+		if (save_profile(drive, &best) < 0) {
+			perror("Error saving profile");
+			exit(1);
+		}
+	} else {
+		best.srt = params.srt;
+		best.hlt = params.hlt;
+		set_profile(fd, drive, &best);
+	}
+	close(fd);
+}
+
+void help_exit(int exitcode) {
+	fprintf(stderr, "usage: dskcal [options]\n");
+	fprintf(stderr, "options: -d | --drive <drive>    calibrate drive, repeat for more drives\n");
+	fprintf(stderr, "         -t | --tracks <n>       seek across n tracks, default 40\n");
+	fprintf(stderr, "         -r | --rounds <n>       try every setting n times, default 2\n");
+	fprintf(stderr, "         -n | --no-save          only show the results\n");
+	fprintf(stderr, "         -h                      this help\n");
+	fprintf(stderr, "needs a formatted disk in every drive, profiles go to %s\n",
+		PROFILE_DIR);
+	exit(exitcode);
+}
+
+int main(int argc, char **argv) {
+
+	static struct option long_options[] = {
+		{"drive", 1, 0, 'd'},
+		{"tracks", 1, 0, 't'},
+		{"rounds", 1, 0, 'r'},
+		{"no-save", 0, 0, 'n'},
+		{"help", 0, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+	int c, i;
+	Calopts opts;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.tracks = 40;
+	opts.rounds = 2;
+	opts.save = TRUE;
+
+	do {
+		int option_index = 0;
+		c = getopt_long(argc, argv, "d:t:r:nh",
+			long_options, &option_index);
+		switch(c) {
+			case 'h':
+			case '?':
+				help_exit(0);
+				break;
+			case 'd':
+				if (opts.ndrives == MAX_DRIVES)
+					help_exit(1);
+				opts.drives[opts.ndrives] = atoi(optarg);
+				if ((opts.drives[opts.ndrives] < 0) ||
+					(opts.drives[opts.ndrives] >=
+					MAX_DRIVES))
+					help_exit(1);
+				opts.ndrives++;
+				break;
+			case 't':
+				opts.tracks = atoi(optarg);
+				if ((opts.tracks < 2) ||
+					(opts.tracks > MAX_TRACKS))
+					help_exit(1);
+				break;
+			case 'r':
+				opts.rounds = atoi(optarg);
+				if (opts.rounds < 1)
+					help_exit(1);
+				break;
+			case 'n':
+				opts.save = FALSE;
+				break;
+		}
+	} while (c != -1);
+
+	if (argc != optind)
+		help_exit(1);
+	if (opts.ndrives == 0)
+		opts.ndrives = 1;	/* /dev/fd0 */
+
+	for (i=0; i<opts.ndrives; i++)
+		calibrate(opts.drives[i], &opts);
+
+	return 0;
+
+}
@@ -0,0 +1,185 @@
+/* $Id$
+ *
+ * dskcat.c - Small utility to keep a catalogue of known CPC disk images,
+ * which dskread uses to recognise disks and follow their layout.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "common.h"
+#include "catalogue.h"
+
+#include <unistd.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#define CAT_ADD 0
+#define CAT_LIST 1
+#define CAT_FIND 2
+
+/* Read an image, NULL (and a message) if it is broken */
+Image *open_image(char *filename, Image *image) {
+
+	FILE *in;
+	int err;
+
+	in = fopen(filename, "r");
+	if (in == NULL) {
+		perror(filename);
+		return NULL;
+	}
+	err = load_image(in, image);
+	fclose(in);
+	if (err < 0) {
+		fprintf(stderr, "%s: not a DSK or EDSK image\n", filename);
+		return NULL;
+	}
+	return image;
+}
+
+/* Add images under their full path, so dskread finds them from anywhere.
+ * Images already in the catalogue are left alone. */
+int cat_add(char *catname, char **names, int nnames) {
+
+	Catalogue cat;
+	Image image;
+	FILE *out;
+	char path[PATH_MAX];
+	int i, j, bad = 0;
+
+	if (cat_load(&cat, catname) < 0)
+		return 1;
+	out = fopen(catname, "a");
+	if (out == NULL) {
+		perror("Error opening catalogue");
+		return 1;
+	}
+	for (i=0; i<nnames; i++) {
+		if (realpath(names[i], path) == NULL) {
+			perror(names[i]);
+			bad++;
+			continue;
+		}
+		for (j=0; j<cat.nentries; j++)
+			if (strcmp(cat.entry[j].name, path) == 0)
+				break;
+		if (j < cat.nentries) {
+			fprintf(stderr, "%s: already catalogued\n", path);
+			continue;
+		}
+		if (open_image(path, &image) == NULL) {
+			bad++;
+			continue;
+		}
+		cat_write(out, path, &image);
+		free_image(&image);
+	}
+	fclose(out);
+	cat_free(&cat);
+	return bad ? 1 : 0;
+}
+
+void cat_list(Catalogue *cat) {
+
+	int i;
+
+	for (i=0; i<cat->nentries; i++)
+		printf("%3i %i %s\n", cat->entry[i].ntracks /
+			cat->entry[i].heads, cat->entry[i].heads,
+			cat->entry[i].name);
+}
+
+/* What would dskread recognise these images as? */
+int cat_find(Catalogue *cat, char **names, int nnames) {
+
+	Image image;
+	Catentry *entry;
+	int i, n, bad = 0;
+
+	for (i=0; i<nnames; i++) {
+		if (open_image(names[i], &image) == NULL) {
+			bad++;
+			continue;
+		}
+		n = CAT_TRACKS * image.diskinfo.heads;
+		if (n > image.ntracks)
+			n = image.ntracks;
+		entry = cat_match(cat, &image, n);
+		printf("%s: %s\n", names[i], entry ? entry->name : "unknown");
+		free_image(&image);
+	}
+	return bad ? 1 : 0;
+}
+
+void help_exit(int exitcode) {
+	fprintf(stderr, "usage: dskcat [options] <catalogue> [images]\n");
+	fprintf(stderr, "options: -l | --list             list the catalogue\n");
+	fprintf(stderr, "         -f | --find             look the images up in the catalogue\n");
+	fprintf(stderr, "         -h                      this help\n");
+	fprintf(stderr, "without options the images are added to the catalogue\n");
+	exit(exitcode);
+}
+
+int main(int argc, char **argv) {
+
+	static struct option long_options[] = {
+		{"list", 0, 0, 'l'},
+		{"find", 0, 0, 'f'},
+		{"help", 0, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+	int c, mode = CAT_ADD, err;
+	Catalogue cat;
+
+	do {
+		int option_index = 0;
+		c = getopt_long(argc, argv, "lfh",
+			long_options, &option_index);
+		switch(c) {
+			case 'h':
+			case '?':
+				help_exit(0);
+				break;
+			case 'l':
+				mode = CAT_LIST;
+				break;
+			case 'f':
+				mode = CAT_FIND;
+				break;
+		}
+	} while (c != -1);
+
+	if ((argc - optind < 1) ||
+		((mode == CAT_LIST) != (argc - optind == 1)))
+		help_exit(1);
+
+	if (mode == CAT_ADD)
+		return cat_add(argv[optind], argv + optind + 1,
+			argc - optind - 1);
+
+	if (cat_load(&cat, argv[optind]) < 0)
+		return 1;
+	err = 0;
+	if (mode == CAT_LIST)
+		cat_list(&cat);
+	else
+		err = cat_find(&cat, argv + optind + 1, argc - optind - 1);
+	cat_free(&cat);
+	return err;
+
+}
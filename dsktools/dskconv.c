@@ -0,0 +1,483 @@
+/* $Id$
+ *
+ * dskconv.c - Small utility to convert between DSK, EDSK and plain sector
+ * dumps of CPC disks.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "common.h"
+
+#include <unistd.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define KIND_KEEP 0		/* same kind as the input, DSK for dumps */
+#define KIND_DSK 1
+#define KIND_EDSK 2
+#define KIND_IMG 3
+
+#define MAX_JOBS 64
+
+/* Options for convert() */
+typedef struct convopts_t {
+	int kind;		/* output kind */
+	int base;		/* first sector of dumps: OFF_DAT, OFF_SYS... */
+	int sides;		/* sides of dumps */
+	int rotate;		/* start tracks with their lowest sector */
+	int jobs;		/* worker threads for directories */
+} Convopts;
+
+/* notes:
+ *
+ * DSK and EDSK differ only in their headers, the track data of an image in
+ * memory is written as it is. A dump (.img) holds the sectors of every
+ * track in sector number order, the tracks ordered by cylinder and head,
+ * like the PC floppy driver and most emulators see a disk.
+ */
+
+/* Start a track with its lowest sector. Tracks read by dskread start with
+ * the sector after the index, rotate_sectorids() has always hinted at
+ * this. The data moves with the IDs, in two pieces. */
+int rotate_track(Track *trk) {
+
+	unsigned char *data;
+	int i, pos = 0, off = 0, low = 0xFF;
+
+	for (i=0; i<trk->info.spt; i++) {
+		if (trk->info.sectorinfo[i].sector < low) {
+			low = trk->info.sectorinfo[i].sector;
+			pos = i;
+		}
+	}
+	if (pos == 0)
+		return 0;
+	for (i=0; i<pos; i++)
+		off += sector_len(&trk->info.sectorinfo[i]);
+
+	data = malloc(trk->len);
+	if (data == NULL) {
+		myabort("Error: Out of memory\n");
+	}
+	memcpy(data, trk->data + off, trk->len - off);
+	memcpy(data + trk->len - off, trk->data, off);
+	free(trk->data);
+	trk->data = data;
+	rotateleft_sectorids(&trk->info, pos);
+	return 1;
+}
+
+/* Read a dump of 9 sector tracks. The number of tracks follows from the
+ * file size. */
+int load_img(FILE *file, Image *image, Convopts *opts, char *name) {
+
+	struct stat st;
+	Track *trk;
+	int i, j, tracklen, tracks;
+
+	tracklen = SPT * (128 << BPS);
+	if ((fstat(fileno(file), &st) < 0) ||
+		(st.st_size % (tracklen * opts->sides)) ||
+		(st.st_size / (tracklen * opts->sides) > MAX_TRACKS) ||
+		(st.st_size == 0)) {
+		fprintf(stderr, "%s: not a DSK image or %i sided dump\n",
+			name, opts->sides);
+		return -1;
+	}
+	tracks = st.st_size / (tracklen * opts->sides);
+
+	init_image(image, tracks, opts->sides);
+	strncpy(image->diskinfo.magic, MAGIC_DISK_WRITE,
+		sizeof(image->diskinfo.magic));
+	for (i=0; i<image->ntracks; i++) {
+		trk = &image->track[i];
+		init_trackinfo(&trk->info, i / opts->sides, i % opts->sides);
+		trk->info.spt = SPT;
+		trk->info.fill = FILL;
+		for (j=0; j<SPT; j++) {
+			init_sectorinfo(&trk->info.sectorinfo[j],
+				i / opts->sides, i % opts->sides,
+				opts->base + j);
+			set_sector_len(&trk->info.sectorinfo[j], tracklen/SPT);
+		}
+		trk->len = tracklen;
+		trk->data = malloc(tracklen);
+		if (trk->data == NULL) {
+			myabort("Error: Out of memory\n");
+		}
+		if (fread(trk->data, 1, tracklen, file) != tracklen) {
+			fprintf(stderr, "%s: file to short\n", name);
+			free_image(image);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Write the sectors of every track in sector number order. Sectors are
+ * written straight from the image, multiple copies of weak sectors are
+ * dropped. Unformatted tracks are filled so the offsets stay right. */
+int save_img(FILE *file, Image *image, char *name) {
+
+	unsigned char fill[128 << BPS];
+	Track *trk;
+	Sectorinfo *sectorinfo;
+	int order[29], offset[29];
+	int i, j, n, off, size, tracklen = 0, plain = TRUE;
+
+	for (i=0; i<image->ntracks; i++) {
+		trk = &image->track[i];
+		if (trk->info.spt == 0)
+			continue;
+		size = 0;
+		for (j=0; j<trk->info.spt; j++)
+			size += sector_size(&trk->info.sectorinfo[j]);
+		if (!tracklen)
+			tracklen = size;
+		if ((size != tracklen) ||
+			!standard_layout(&trk->info, trk->info.track))
+			plain = FALSE;
+	}
+	if (!plain)
+		fprintf(stderr, "%s: not a plain format, offsets in the dump "
+			"will not be regular\n", name);
+
+	memset(fill, FILL, sizeof(fill));
+	for (i=0; i<image->ntracks; i++) {
+		trk = &image->track[i];
+		if (trk->info.spt == 0) {
+			for (off=0; off<tracklen; off+=n) {
+				n = tracklen - off;
+				if (n > sizeof(fill))
+					n = sizeof(fill);
+				if (fwrite(fill, 1, n, file) != n)
+					return -1;
+			}
+			continue;
+		}
+		off = 0;
+		for (j=0; j<trk->info.spt; j++) {
+			offset[j] = off;
+			off += sector_len(&trk->info.sectorinfo[j]);
+		}
+		interleave_sectors(&trk->info, order, 1, 0);
+		for (j=0; j<trk->info.spt; j++) {
+			sectorinfo = &trk->info.sectorinfo[order[j]];
+			size = sector_size(sectorinfo);
+			if (size > sector_len(sectorinfo))
+				size = sector_len(sectorinfo);
+			if (fwrite(trk->data + offset[order[j]], 1, size, file)
+				!= size)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/* Can a standard DSK hold the image? Not with weak sector copies or
+ * sectors shorter than their size. */
+int dsk_ok(Image *image) {
+
+	int i, j;
+	Sectorinfo *sectorinfo;
+
+	for (i=0; i<image->ntracks; i++) {
+		for (j=0; j<image->track[i].info.spt; j++) {
+			sectorinfo = &image->track[i].info.sectorinfo[j];
+			if (sector_len(sectorinfo) != sector_size(sectorinfo))
+				return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+int convert(char *inname, char *outname, Convopts *opts) {
+
+	Image image;
+	FILE *in, *out;
+	char magic[8];
+	int i, kind, err, rotated = 0;
+
+	in = fopen(inname, "r");
+	if (in == NULL) {
+		perror(inname);
+		return -1;
+	}
+
+	/* DSK and EDSK tell by their magic, everything else is a dump */
+	kind = KIND_IMG;
+	if (fread(magic, 1, sizeof(magic), in) == sizeof(magic)) {
+		if (!strncmp(magic, MAGIC_DISK, sizeof(magic)))
+			kind = KIND_DSK;
+		if (!strncmp(magic, MAGIC_EDISK, sizeof(magic)))
+			kind = KIND_EDSK;
+	}
+	rewind(in);
+	if (kind == KIND_IMG)
+		err = load_img(in, &image, opts, inname);
+	else
+		err = load_image(in, &image);
+	fclose(in);
+	if (err < 0) {
+		if (kind != KIND_IMG)
+			fprintf(stderr, "%s: skipped\n", inname);
+		return -1;
+	}
+
+	if (opts->rotate) {
+		for (i=0; i<image.ntracks; i++)
+			rotated += rotate_track(&image.track[i]);
+	}
+
+	if (opts->kind != KIND_KEEP)
+		kind = opts->kind;
+	else if (kind == KIND_IMG)
+		kind = KIND_DSK;
+	if ((kind == KIND_DSK) && !dsk_ok(&image)) {
+		fprintf(stderr, "%s: has weak or short sectors, needs EDSK\n",
+			inname);
+		free_image(&image);
+		return -1;
+	}
+
+	out = fopen(outname, "w");
+	if (out == NULL) {
+		perror(outname);
+		free_image(&image);
+		return -1;
+	}
+	err = 0;
+	if (kind == KIND_IMG) {
+		err = save_img(out, &image, inname);
+	} else {
+		image.edsk = (kind == KIND_EDSK);
+		err = write_image(out, &image);
+	}
+	if (fclose(out) || (err < 0)) {
+		perror(outname);
+		err = -1;
+	}
+	if (rotated)
+		fprintf(stderr, "%s: %i tracks rotated\n", inname, rotated);
+	free_image(&image);
+	return err;
+}
+
+/* Directory batch: each worker takes the next file until none are left */
+
+typedef struct batch_t {
+	pthread_mutex_t lock;
+	char **names;
+	int nnames;
+	int next;
+	int failed;
+	char *indir;
+	char *outdir;
+	Convopts *opts;
+} Batch;
+
+void *batch_worker(void *arg) {
+
+	Batch *batch = arg;
+	char inname[FILENAME_MAX], outname[FILENAME_MAX];
+	char *name, *dot;
+	int n, len;
+
+	for (;;) {
+		pthread_mutex_lock(&batch->lock);
+		n = batch->next++;
+		pthread_mutex_unlock(&batch->lock);
+		if (n >= batch->nnames)
+			break;
+
+		name = batch->names[n];
+		snprintf(inname, sizeof(inname), "%s/%s", batch->indir, name);
+		/* data.dsk becomes data.img, data.edsk data.edsk.dsk */
+		dot = strrchr(name, '.');
+		len = strlen(name);
+		if (dot && (!strcasecmp(dot, ".dsk") ||
+			!strcasecmp(dot, ".img")))
+			len = dot - name;
+		snprintf(outname, sizeof(outname), "%s/%.*s.%s", batch->outdir,
+			len, name,
+			(batch->opts->kind == KIND_IMG) ? "img" : "dsk");
+		if (convert(inname, outname, batch->opts) < 0) {
+			pthread_mutex_lock(&batch->lock);
+			batch->failed++;
+			pthread_mutex_unlock(&batch->lock);
+		}
+	}
+	return NULL;
+}
+
+int convert_dir(char *indir, char *outdir, Convopts *opts) {
+
+	Batch batch;
+	pthread_t threads[MAX_JOBS];
+	DIR *dir;
+	struct dirent *ent;
+	struct stat st;
+	char path[FILENAME_MAX];
+	int i, size = 0;
+
+	dir = opendir(indir);
+	if (dir == NULL) {
+		perror(indir);
+		exit(1);
+	}
+	memset(&batch, 0, sizeof(batch));
+	pthread_mutex_init(&batch.lock, NULL);
+	batch.indir = indir;
+	batch.outdir = outdir;
+	batch.opts = opts;
+	while ((ent = readdir(dir)) != NULL) {
+		snprintf(path, sizeof(path), "%s/%s", indir, ent->d_name);
+		if ((stat(path, &st) < 0) || !S_ISREG(st.st_mode))
+			continue;
+		if (batch.nnames == size) {
+			size = size ? 2*size : 64;
+			batch.names = realloc(batch.names,
+				size * sizeof(char *));
+			if (batch.names == NULL) {
+				myabort("Error: Out of memory\n");
+			}
+		}
+		batch.names[batch.nnames] = strdup(ent->d_name);
+		if (batch.names[batch.nnames++] == NULL) {
+			myabort("Error: Out of memory\n");
+		}
+	}
+	closedir(dir);
+	mkdir(outdir, 0777);
+
+	for (i=0; i<opts->jobs; i++) {
+		if (pthread_create(&threads[i], NULL, batch_worker, &batch)) {
+			perror("Error starting worker");
+			exit(1);
+		}
+	}
+	for (i=0; i<opts->jobs; i++)
+		pthread_join(threads[i], NULL);
+
+	fprintf(stderr, "%i images, %i failed\n", batch.nnames, batch.failed);
+	for (i=0; i<batch.nnames; i++)
+		free(batch.names[i]);
+	free(batch.names);
+	pthread_mutex_destroy(&batch.lock);
+	return batch.failed ? -1 : 0;
+}
+
+void help_exit(int exitcode) {
+	fprintf(stderr, "usage: dskconv [options] <input> <output>\n");
+	fprintf(stderr, "options: -d | --dsk              write a standard DSK\n");
+	fprintf(stderr, "         -e | --edsk             write an extended DSK\n");
+	fprintf(stderr, "         -i | --img              write the sectors in logical order\n");
+	fprintf(stderr, "         -f | --format <format>  data, system or ibm, for dumps read\n");
+	fprintf(stderr, "         -S | --sides <sides>    number of sides, for dumps read\n");
+	fprintf(stderr, "         -r | --rotate           start tracks with their lowest sector\n");
+	fprintf(stderr, "         -j | --jobs <n>         threads when converting directories\n");
+	fprintf(stderr, "         -h                      this help\n");
+	fprintf(stderr, "input and output may both be directories, the output kind defaults\n");
+	fprintf(stderr, "to the input kind, dumps are read as DSK\n");
+	exit(exitcode);
+}
+
+int main(int argc, char **argv) {
+
+	static struct option long_options[] = {
+		{"dsk", 0, 0, 'd'},
+		{"edsk", 0, 0, 'e'},
+		{"img", 0, 0, 'i'},
+		{"format", 1, 0, 'f'},
+		{"sides", 1, 0, 'S'},
+		{"rotate", 0, 0, 'r'},
+		{"jobs", 1, 0, 'j'},
+		{"help", 0, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+	int c;
+	struct stat st;
+	Convopts opts;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.base = OFF_DAT;
+	opts.sides = 1;
+	opts.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+	do {
+		int option_index = 0;
+		c = getopt_long(argc, argv, "deif:S:rj:h",
+			long_options, &option_index);
+		switch(c) {
+			case 'h':
+			case '?':
+				help_exit(0);
+				break;
+			case 'd':
+				opts.kind = KIND_DSK;
+				break;
+			case 'e':
+				opts.kind = KIND_EDSK;
+				break;
+			case 'i':
+				opts.kind = KIND_IMG;
+				break;
+			case 'f':
+				if (!strcmp(optarg, "data"))
+					opts.base = OFF_DAT;
+				else if (!strcmp(optarg, "system"))
+					opts.base = OFF_SYS;
+				else if (!strcmp(optarg, "ibm"))
+					opts.base = OFF_IBM;
+				else
+					help_exit(1);
+				break;
+			case 'S':
+				opts.sides = atoi(optarg);
+				break;
+			case 'r':
+				opts.rotate = TRUE;
+				break;
+			case 'j':
+				opts.jobs = atoi(optarg);
+				break;
+		}
+	} while (c != -1);
+
+	if ((argc - optind != 2) || (opts.sides < 1) ||
+		(opts.sides > MAX_SIDES)) {
+		help_exit(1);
+	}
+	if (opts.jobs < 1)
+		opts.jobs = 1;
+	if (opts.jobs > MAX_JOBS)
+		opts.jobs = MAX_JOBS;
+
+	if ((stat(argv[optind], &st) == 0) && S_ISDIR(st.st_mode)) {
+		if (convert_dir(argv[optind], argv[optind+1], &opts) < 0)
+			exit(1);
+	} else if (convert(argv[optind], argv[optind+1], &opts) < 0) {
+		exit(1);
+	}
+
+	return 0;
+
+}
@@ -0,0 +1,279 @@
+/* $Id$
+ *
+ * dskcopy.c - Small utility to copy a CPC disk from one floppy drive to
+ * another without going through an image file.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "common.h"
+
+#include <unistd.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <linux/fd.h>
+#include <linux/fdreg.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <fcntl.h>
+
+/* Options for copydsk() */
+typedef struct copyopts_t {
+	int from;		/* drive to read */
+	int to;			/* drive to write */
+	int sides;
+	int tracks;
+	int retries;		/* retries per sector that could not be read */
+	int single;		/* one command per sector, also on plain tracks */
+} Copyopts;
+
+/* notes:
+ *
+ * The source disk is copied a track at a time: the track is read as
+ * dskread does, then formatted and written on the target as dskwrite
+ * does, so no more than one track is ever held in memory. The floppy
+ * driver runs one raw command at a time for all controllers together, so
+ * reading one drive while writing the other is not possible and a copy
+ * takes about as long as reading plus writing, without an image file.
+ *
+ * Tracks that do not fit one revolution even with the smallest gap are
+ * left alone on the target. A sector that could not be read is written
+ * with what was read, without its error, and marked with ?; both are
+ * counted and make dskcopy fail at the end.
+ */
+
+/* One end of the copy */
+typedef struct end_t {
+	int drive;
+	int unit;
+	int fd;
+	Copyopts *opts;
+	long busy;		/* microseconds spent on the drive */
+	int bad;		/* sectors that could not be read */
+	int skipped;		/* tracks that could not be written */
+} End;
+
+static long now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+
+/* Read a track as dskread does, with the progress marks */
+void copy_read(End *end, Track *trk, int cyl, int head) {
+
+	static unsigned char scratch[MAX_EDSK_TRACKLEN];
+
+	fprintf(stderr, "read  ");
+	end->bad += read_track_data(end->fd, trk, cyl, head, end->unit,
+		scratch, end->opts->single, end->opts->retries, stderr);
+}
+
+/* Write a track as dskwrite does, with the gap shrunk to fit if needed */
+void copy_write(End *end, Track *trk, int cyl, int head) {
+
+	static unsigned char wbuf[MAX_EDSK_TRACKLEN];
+	Trackinfo *trackinfo = &trk->info;
+	Sectorinfo *sectorinfo;
+	unsigned char side = (head << 2) | end->unit;
+	unsigned char *sect;
+	int j, gap, gpl, room;
+
+	fprintf(stderr, "write ");
+	printtrackinfo(stderr, trackinfo);
+	if (trackinfo->spt == 0) {
+		fprintf(stderr, " not formatted, left alone\n");
+		return;
+	}
+	room = compute_gap(trackinfo, &gap, &gpl);
+	if (room < 0) {
+		fprintf(stderr, " needs %i bytes, left alone\n",
+			track_bytes(trackinfo, gap));
+		end->skipped++;
+		return;
+	}
+	trackinfo->gap = gap;
+	fprintf(stderr, " %X+%i [", gpl, room);
+
+	format_track(end->fd, cyl, trackinfo, side, NULL);
+
+	/* standard_layout() turns down tracks with read errors */
+	if (!end->opts->single && standard_layout(trackinfo, cyl)) {
+		id_order(trackinfo, trk->data, wbuf, TRUE);
+		if (write_sectors(end->fd, trackinfo, wbuf, side, gpl,
+			FALSE) == 0) {
+			for (j=0; j<trackinfo->spt; j++)
+				fprintf(stderr, "%02X+ ",
+					trackinfo->sectorinfo[j].sector);
+			fprintf(stderr, "]\n");
+			return;
+		}
+	}
+
+	sect = trk->data;
+	for (j=0; j<trackinfo->spt; j++) {
+		sectorinfo = &trackinfo->sectorinfo[j];
+		fprintf(stderr, "%02X", sectorinfo->sector);
+		write_sect(end->fd, sectorinfo, sect, side, gpl);
+
+		/* the target gets a good CRC and a data field where the
+		 * source had none; the deleted data mark is kept */
+		if (sectorinfo->err1 || (sectorinfo->err2 & ~ST2_CM))
+			fprintf(stderr, "? ");
+		else
+			fprintf(stderr, " ");
+		sect += sector_len(sectorinfo);
+	}
+	fprintf(stderr, "]\n");
+}
+
+void open_end(End *end, int drive, Copyopts *opts) {
+
+	end->drive = drive;
+	end->unit = drive & 3;
+	end->opts = opts;
+	end->fd = open_drive(drive);
+	init(end->fd, drive);
+}
+
+void copydsk(Copyopts *opts) {
+
+	End from, to;
+	Track trk;
+	long start, took, t;
+	int i, k;
+
+	memset(&from, 0, sizeof(from));
+	memset(&to, 0, sizeof(to));
+	open_end(&from, opts->from, opts);
+	open_end(&to, opts->to, opts);
+
+	start = now();
+	for (i=0; i<opts->tracks; i++) {
+		for (k=0; k<opts->sides; k++) {
+			t = now();
+			if (k == 0)
+				seek(from.fd, from.unit, i);
+			copy_read(&from, &trk, i, k);
+			from.busy += now() - t;
+
+			t = now();
+			copy_write(&to, &trk, i, k);
+			to.busy += now() - t;
+			free(trk.data);
+		}
+	}
+	took = now() - start;
+
+	fprintf(stderr, "Read %.1fs, written %.1fs, copied in %.1fs\n",
+		from.busy / 1000000.0, to.busy / 1000000.0, took / 1000000.0);
+	if (from.bad)
+		fprintf(stderr, "%i sectors could not be read, they were "
+			"written without their errors\n", from.bad);
+	if (to.skipped)
+		fprintf(stderr, "%i tracks do not fit on a disk and were not "
+			"written\n", to.skipped);
+
+	close(from.fd);
+	close(to.fd);
+	if (from.bad || to.skipped)
+		exit(1);
+}
+
+void help_exit(int exitcode) {
+	fprintf(stderr, "usage: dskcopy [options]\n");
+	fprintf(stderr, "options: -f | --from <drive>     read from /dev/fd<drive>, default 0\n");
+	fprintf(stderr, "         -d | --drive <drive>    write to /dev/fd<drive>, default 1\n");
+	fprintf(stderr, "         -S | --sides <sides>    number of sides\n");
+	fprintf(stderr, "         -t | --tracks <tracks>  number of tracks\n");
+	fprintf(stderr, "         -T | --retries <n>      retries of a sector that can not be read\n");
+	fprintf(stderr, "         -1 | --single           one command per sector, also on plain tracks\n");
+	fprintf(stderr, "         -h                      this help\n");
+	exit(exitcode);
+}
+
+int main(int argc, char **argv) {
+
+	static struct option long_options[] = {
+		{"from", 1, 0, 'f'},
+		{"drive", 1, 0, 'd'},
+		{"sides", 1, 0, 'S'},
+		{"tracks", 1, 0, 't'},
+		{"retries", 1, 0, 'T'},
+		{"single", 0, 0, '1'},
+		{"help", 0, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+	int c;
+	Copyopts opts;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.from = 0;
+	opts.to = 1;
+	opts.sides = 1;
+	opts.tracks = 40;
+	opts.retries = 10;
+
+	do {
+		int option_index = 0;
+		c = getopt_long(argc, argv, "f:d:S:t:T:1h",
+			long_options, &option_index);
+		switch(c) {
+			case 'h':
+			case '?':
+				help_exit(0);
+				break;
+			case 'f':
+				opts.from = atoi(optarg);
+				break;
+			case 'd':
+				opts.to = atoi(optarg);
+				break;
+			case 'S':
+				opts.sides = atoi(optarg);
+				break;
+			case 't':
+				opts.tracks = atoi(optarg);
+				break;
+			case 'T':
+				opts.retries = atoi(optarg);
+				break;
+			case '1':
+				opts.single = TRUE;
+				break;
+		}
+	} while (c != -1);
+
+	if ((argc != optind) ||
+		(opts.from < 0) || (opts.from >= MAX_DRIVES) ||
+		(opts.to < 0) || (opts.to >= MAX_DRIVES) ||
+		(opts.sides < 1) || (opts.sides > MAX_SIDES) ||
+		(opts.tracks < 1) || (opts.tracks > MAX_TRACKS)) {
+		help_exit(1);
+	}
+	if (opts.from == opts.to) {
+		fprintf(stderr, "source and target must be different drives\n");
+		exit(1);
+	}
+
+	copydsk(&opts);
+
+	return 0;
+
+}
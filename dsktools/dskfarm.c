@@ -0,0 +1,324 @@
+/* $Id$
+ *
+ * dskfarm.c - Read CPC disks into images on all drives of a station from
+ * a queue of jobs, one disk after the other.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "common.h"
+
+#include <unistd.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <linux/fd.h>
+#include <linux/fdreg.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#define MAX_FDCS (MAX_DRIVES / 4)
+#define FDC_OF(drive) ((drive) / 4)
+
+/* Options for the jobs */
+typedef struct farmopts_t {
+	int sides;
+	int tracks;
+	int retries;		/* retries per sector that could not be read */
+	int single;		/* one command per sector, also on plain tracks */
+} Farmopts;
+
+/* notes:
+ *
+ * The Linux floppy driver puts /dev/fd0 to /dev/fd3 on the first
+ * controller and /dev/fd4 to /dev/fd7 on the second one. It runs one raw
+ * command at a time for all controllers together (a SEEK holds it until
+ * the drive has stepped), so reading on several drives at once is no
+ * faster than reading them in turn, and dskfarm does them in turn: jobs
+ * ("<drive> <image>" lines) are taken in the order they come, from a file
+ * or from stdin as disks are put in, and each is read to the end before
+ * the next starts. What the station gains is that the next disk goes into
+ * one drive while another is read, so the drive that is read never waits
+ * for a disk to be swapped.
+ */
+
+/* A drive and what has been read from it */
+typedef struct drive_t {
+	int drive;		/* /dev/fd<drive> */
+	int unit;		/* unit number on its controller */
+	int fd;
+	int images;
+	int tracks;
+	int sectors;
+	int bad;		/* sectors that could not be read */
+	int failed;		/* images that could not be written */
+	long busy;		/* microseconds spent reading */
+} Drive;
+
+static long now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+
+/* Find the drives that are there: the device opens (its controller
+ * exists) and the head reaches track 0 on a recalibrate. Drives on the
+ * second controller usually have no CMOS type, so that is not asked. */
+int find_drives(Drive *drives, int *wanted, int nwanted) {
+
+	char name[32];
+	int i, fd, n = 0;
+
+	for (i=0; i<MAX_DRIVES; i++) {
+		if (nwanted && !wanted[i])
+			continue;
+		sprintf(name, "/dev/fd%01d", i);
+		fd = open(name, O_ACCMODE | O_NDELAY);
+		if (fd < 0)
+			continue;
+		if (!nwanted && (find_track0(fd, i & 3) != 0)) {
+			close(fd);
+			continue;
+		}
+		memset(&drives[n], 0, sizeof(drives[n]));
+		drives[n].drive = i;
+		drives[n].unit = i & 3;
+		drives[n].fd = fd;
+		n++;
+	}
+	return n;
+}
+
+/* Read the disk in drv into the image name */
+void farm_job(Drive *drv, char *name, Farmopts *opts) {
+
+	static unsigned char scratch[MAX_EDSK_TRACKLEN];
+	Image image;
+	Track *trk;
+	FILE *file;
+	long start;
+	struct stat st;
+	int i, k, bad, err, plain;
+
+	file = fopen(name, "w");
+	if (file == NULL) {
+		perror(name);
+		drv->failed++;
+		return;
+	}
+
+	start = now();
+	bad = drv->bad;
+	init(drv->fd, drv->drive);
+	init_image(&image, opts->tracks, opts->sides);
+	for (i=0; i<opts->tracks; i++) {
+		seek(drv->fd, drv->unit, i);
+		for (k=0; k<opts->sides; k++) {
+			trk = &image.track[i*opts->sides+k];
+			drv->bad += read_track_data(drv->fd, trk, i, k,
+				drv->unit, scratch, opts->single,
+				opts->retries, NULL);
+			drv->tracks++;
+			drv->sectors += trk->info.spt;
+		}
+	}
+	/* a file that could not be written fails this job only */
+	err = write_image(file, &image);
+	plain = (fstat(fileno(file), &st) == 0) && S_ISREG(st.st_mode);
+	if ((fclose(file) != 0) || (err < 0)) {
+		perror(name);
+		if (plain)
+			unlink(name);
+		err = -1;
+	}
+	free_image(&image);
+	drv->busy += now() - start;
+	if (err < 0) {
+		drv->failed++;
+		return;
+	}
+	drv->images++;
+
+	fprintf(stderr, "fd%i: %s, %i tracks, %i bad sectors, %.1fs\n",
+		drv->drive, name, opts->tracks * opts->sides,
+		drv->bad - bad, (now() - start) / 1000000.0);
+}
+
+/* Do the "<drive> <image>" lines in order, rejecting drives the station
+ * lacks. Returns the number of jobs not taken. */
+int run_jobs(FILE *in, Drive **bydrive, Farmopts *opts) {
+
+	char line[1024], name[1024];
+	int drive, failed = 0;
+
+	while (fgets(line, sizeof(line), in) != NULL) {
+		if ((line[0] == '#') || (line[0] == '\n'))
+			continue;
+		if ((sscanf(line, "%i %1023s", &drive, name) != 2) ||
+			(drive < 0) || (drive >= MAX_DRIVES) ||
+			(bydrive[drive] == NULL)) {
+			fprintf(stderr, "Job not taken: %s", line);
+			failed++;
+			continue;
+		}
+		farm_job(bydrive[drive], name, opts);
+	}
+	return failed;
+}
+
+void help_exit(int exitcode) {
+	fprintf(stderr, "usage: dskfarm [options] <jobs>\n");
+	fprintf(stderr, "options: -d | --drive <drive>    use this drive, repeat for more drives\n");
+	fprintf(stderr, "         -S | --sides <sides>    number of sides\n");
+	fprintf(stderr, "         -t | --tracks <tracks>  number of tracks\n");
+	fprintf(stderr, "         -T | --retries <n>      retries of a sector that can not be read\n");
+	fprintf(stderr, "         -1 | --single           one command per sector, also on plain tracks\n");
+	fprintf(stderr, "         -l | --list             list the drives and controllers found\n");
+	fprintf(stderr, "         -h                      this help\n");
+	fprintf(stderr, "jobs are \"<drive> <image>\" lines, - reads them from stdin\n");
+	fprintf(stderr, "without -d all drives that answer a recalibrate are used\n");
+	exit(exitcode);
+}
+
+int main(int argc, char **argv) {
+
+	static struct option long_options[] = {
+		{"drive", 1, 0, 'd'},
+		{"sides", 1, 0, 'S'},
+		{"tracks", 1, 0, 't'},
+		{"retries", 1, 0, 'T'},
+		{"single", 0, 0, '1'},
+		{"list", 0, 0, 'l'},
+		{"help", 0, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+	static Drive drives[MAX_DRIVES];
+	Drive *bydrive[MAX_DRIVES];
+	int c, i, d, list = FALSE, ndrives, nwanted = 0, nfdcs = 0;
+	int wanted[MAX_DRIVES], fdcs[MAX_FDCS];
+	int images = 0, tracks = 0, bad = 0, failed = 0, rejected;
+	long start, took;
+	Farmopts opts;
+	FILE *in;
+
+	memset(&opts, 0, sizeof(opts));
+	memset(wanted, 0, sizeof(wanted));
+	memset(fdcs, 0, sizeof(fdcs));
+	memset(bydrive, 0, sizeof(bydrive));
+	opts.sides = 1;
+	opts.tracks = 40;
+	opts.retries = 10;
+
+	do {
+		int option_index = 0;
+		c = getopt_long(argc, argv, "d:S:t:T:1lh",
+			long_options, &option_index);
+		switch(c) {
+			case 'h':
+			case '?':
+				help_exit(0);
+				break;
+			case 'd':
+				d = atoi(optarg);
+				if ((d < 0) || (d >= MAX_DRIVES))
+					help_exit(1);
+				if (!wanted[d])
+					nwanted++;
+				wanted[d] = TRUE;
+				break;
+			case 'S':
+				opts.sides = atoi(optarg);
+				break;
+			case 't':
+				opts.tracks = atoi(optarg);
+				break;
+			case 'T':
+				opts.retries = atoi(optarg);
+				break;
+			case '1':
+				opts.single = TRUE;
+				break;
+			case 'l':
+				list = TRUE;
+				break;
+		}
+	} while (c != -1);
+
+	if ((argc - optind != (list ? 0 : 1)) ||
+		(opts.sides < 1) || (opts.sides > MAX_SIDES) ||
+		(opts.tracks < 1) || (opts.tracks > MAX_TRACKS)) {
+		help_exit(1);
+	}
+
+	/* the station */
+	ndrives = find_drives(drives, wanted, nwanted);
+	for (i=0; i<ndrives; i++) {
+		if (!fdcs[FDC_OF(drives[i].drive)]++)
+			nfdcs++;
+		bydrive[drives[i].drive] = &drives[i];
+	}
+	fprintf(stderr, "%i drives on %i controllers\n", ndrives, nfdcs);
+	if (list) {
+		for (i=0; i<ndrives; i++)
+			printf("fd%i controller %i unit %i\n", drives[i].drive,
+				FDC_OF(drives[i].drive), drives[i].unit);
+		return 0;
+	}
+	if (ndrives == 0)
+		exit(1);
+
+	if (strcmp(argv[optind], "-") == 0) {
+		in = stdin;
+	} else {
+		in = fopen(argv[optind], "r");
+		if (in == NULL) {
+			perror("Error opening job list");
+			exit(1);
+		}
+	}
+
+	start = now();
+	rejected = run_jobs(in, bydrive, &opts);
+	if (in != stdin)
+		fclose(in);
+	took = now() - start;
+
+	/* what each drive and the whole station did */
+	for (i=0; i<ndrives; i++) {
+		fprintf(stderr, "fd%i: %i images, %i tracks, %i sectors, "
+			"%i bad, %i failed, busy %.1fs\n", drives[i].drive,
+			drives[i].images, drives[i].tracks, drives[i].sectors,
+			drives[i].bad, drives[i].failed,
+			drives[i].busy / 1000000.0);
+		images += drives[i].images;
+		failed += drives[i].failed;
+		tracks += drives[i].tracks;
+		bad += drives[i].bad;
+		close(drives[i].fd);
+	}
+	fprintf(stderr, "Station: %i images, %i tracks, %i bad sectors in "
+		"%.1fs", images, tracks, bad, took / 1000000.0);
+	if (images && took)
+		fprintf(stderr, ", %.0f images per hour", images * 3600.0 *
+			1000000.0 / took);
+	fprintf(stderr, "\n");
+	return (rejected || failed) ? 1 : 0;
+
+}
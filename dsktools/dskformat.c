@@ -0,0 +1,254 @@
+/* $Id$
+ *
+ * dskformat.c - Small utility to format blank CPC or PC disks without an
+ * image.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "common.h"
+
+#include <unistd.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <linux/fd.h>
+#include <linux/fdreg.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <fcntl.h>
+
+/* Options for formatdsk() */
+typedef struct formatopts_t {
+	int drive;
+	int base;		/* first sector: OFF_DAT, OFF_SYS or OFF_IBM */
+	int sides;
+	int tracks;
+	int skew;		/* sectors skewed per track, -1 measures */
+	int sideskew;		/* sectors skewed for side 1, -1 measures */
+	int plan;		/* only plan and estimate the job */
+} Formatopts;
+
+/* notes:
+ *
+ * Every cylinder is done with one chain of commands: SEEK, then FORMAT for
+ * each head. The sectors are left filled with FILL by the FORMAT command
+ * itself, no sector data is ever written. FORMAT starts at the index hole
+ * and runs until it comes round again, so the next FORMAT, on the other
+ * head or after the step, has just missed the index and waits another
+ * revolution: every track costs two revolutions, an 80 track double sided
+ * disk 320 (64s at 300rpm). The chain saves the host turnarounds, not
+ * revolutions. With skew the sector IDs are rotated from track to track,
+ * so a later read or write of the next track does not have to wait for its
+ * first sector.
+ */
+
+/* The format of a track, with the largest GAP3 that fits */
+void format_layout(Trackinfo *trackinfo, int track, int head, int base) {
+
+	int gap, gpl;
+
+	plain_layout(trackinfo, track, head, base);
+	compute_gap(trackinfo, &gap, &gpl);
+	trackinfo->gap = gap;
+}
+
+void formatdsk(Formatopts *opts) {
+
+	struct floppy_raw_cmd cmds[1 + MAX_SIDES], *cur_cmd;
+	static format_map_t map[MAX_SIDES][FORMAT_MAP];
+	Trackinfo trackinfo;
+	int order[29];
+	int fd, i, k, err, unit, skew, sideskew;
+	long steptime = 0;
+	unsigned char mask = 0xFF;
+	struct timeval start, end;
+
+	if (opts->plan)
+		plan_begin(stdout);
+	fd = open_drive(opts->drive);
+	unit = opts->drive & 3;
+	init(fd, opts->drive);
+
+	/* skew to cover stepping to the next track, and the time it takes
+	 * to issue the next command after a head switch */
+	format_layout(&trackinfo, 0, 0, opts->base);
+	skew = opts->skew;
+	if (skew < 0) {
+		steptime = seek_time(fd, unit);
+		skew = skew_for(&trackinfo, steptime);
+		fprintf(stderr, "Drive %i step time %lims, skew %i\n",
+			opts->drive, steptime / 1000, skew);
+	}
+	sideskew = opts->sideskew;
+	if ((sideskew < 0) && (opts->sides > 1)) {
+		sideskew = skew_for(&trackinfo, switch_time(fd, unit));
+		fprintf(stderr, "Drive %i side skew %i\n", opts->drive,
+			sideskew);
+	}
+
+	gettimeofday(&start, NULL);
+	for (i=0; i<opts->tracks; i++) {
+		cur_cmd = cmds;
+		init_raw_cmd(cur_cmd);
+		cur_cmd->flags = FD_RAW_INTR | FD_RAW_MORE;
+		cur_cmd->track = i;
+		cur_cmd->cmd[cur_cmd->cmd_count++] = FD_SEEK & mask;
+		cur_cmd->cmd[cur_cmd->cmd_count++] = unit;
+		cur_cmd->cmd[cur_cmd->cmd_count++] = i;
+
+		for (k=0; k<opts->sides; k++) {
+			format_layout(&trackinfo, i, k, opts->base);
+			interleave_sectors(&trackinfo, order, 1,
+				i * skew + (k ? sideskew : 0));
+			cur_cmd++;
+			format_cmd(cur_cmd, map[k], i, &trackinfo,
+				(k << 2) | unit, order);
+			if (k < opts->sides - 1)
+				cur_cmd->flags |= FD_RAW_MORE;
+			if (k)
+				fprintf(stderr, " ");
+			printtrackinfo(stderr, &trackinfo);
+		}
+		fprintf(stderr, "\n");
+
+		err = fdc_cmd(fd, cmds);
+		if (err < 0) {
+			perror("Error formatting");
+			exit(1);
+		}
+		for (k=1; k<=opts->sides; k++) {
+			if (cmds[k].reply[0] & 0x40) {
+				fprintf(stderr, "Could not format track %i "
+					"side %i\n", i, k - 1);
+				exit(1);
+			}
+		}
+	}
+	gettimeofday(&end, NULL);
+
+	if (opts->plan) {
+		if (plan_end())
+			exit(1);
+	} else {
+		fprintf(stderr, "%i tracks formatted in %.1fs\n",
+			opts->tracks * opts->sides,
+			(end.tv_sec - start.tv_sec) +
+			(end.tv_usec - start.tv_usec) / 1000000.0);
+		close(fd);
+	}
+}
+
+void help_exit(int exitcode) {
+	fprintf(stderr, "usage: dskformat [options]\n");
+	fprintf(stderr, "options: -d | --drive <drive>    format /dev/fd<drive>\n");
+	fprintf(stderr, "         -f | --format <data|system|ibm> format, default data\n");
+	fprintf(stderr, "         -S | --sides <sides>    number of sides\n");
+	fprintf(stderr, "         -t | --tracks <tracks>  number of tracks\n");
+	fprintf(stderr, "         -k | --skew <n|auto>    sectors skewed from track to track, default 0\n");
+	fprintf(stderr, "         -K | --side-skew <n|auto> sectors skewed on side 1, default 0\n");
+	fprintf(stderr, "         -L | --trace <file>     record all FDC commands to file\n");
+	fprintf(stderr, "         -Y | --replay <file>    take the FDC replies from a recorded trace\n");
+	fprintf(stderr, "         -p | --plan             list the FDC commands and estimate time only\n");
+	fprintf(stderr, "         -h                      this help\n");
+	fprintf(stderr, "every track takes two revolutions: FORMAT starts at the index hole and the\n");
+	fprintf(stderr, "next one can only start at the one after\n");
+	exit(exitcode);
+}
+
+int main(int argc, char **argv) {
+
+	static struct option long_options[] = {
+		{"drive", 1, 0, 'd'},
+		{"format", 1, 0, 'f'},
+		{"sides", 1, 0, 'S'},
+		{"tracks", 1, 0, 't'},
+		{"skew", 1, 0, 'k'},
+		{"side-skew", 1, 0, 'K'},
+		{"trace", 1, 0, 'L'},
+		{"replay", 1, 0, 'Y'},
+		{"plan", 0, 0, 'p'},
+		{"help", 0, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+	int c;
+	Formatopts opts;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.base = OFF_DAT;
+	opts.sides = 1;
+	opts.tracks = 40;
+
+	do {
+		int option_index = 0;
+		c = getopt_long(argc, argv, "d:f:S:t:k:K:L:Y:ph",
+			long_options, &option_index);
+		switch(c) {
+			case 'h':
+			case '?':
+				help_exit(0);
+				break;
+			case 'd':
+				opts.drive = atoi(optarg);
+				break;
+			case 'f':
+				if (!strcmp(optarg, "data"))
+					opts.base = OFF_DAT;
+				else if (!strcmp(optarg, "system"))
+					opts.base = OFF_SYS;
+				else if (!strcmp(optarg, "ibm"))
+					opts.base = OFF_IBM;
+				else
+					help_exit(1);
+				break;
+			case 'S':
+				opts.sides = atoi(optarg);
+				break;
+			case 't':
+				opts.tracks = atoi(optarg);
+				break;
+			case 'k':
+				opts.skew = strcmp(optarg, "auto") ?
+					atoi(optarg) : -1;
+				break;
+			case 'K':
+				opts.sideskew = strcmp(optarg, "auto") ?
+					atoi(optarg) : -1;
+				break;
+			case 'L':
+				trace_begin(optarg, FALSE);
+				break;
+			case 'Y':
+				trace_begin(optarg, TRUE);
+				break;
+			case 'p':
+				opts.plan = TRUE;
+				break;
+		}
+	} while (c != -1);
+
+	if ((argc != optind) ||
+		(opts.drive < 0) || (opts.drive >= MAX_DRIVES) ||
+		(opts.sides < 1) || (opts.sides > MAX_SIDES) ||
+		(opts.tracks < 1) || (opts.tracks > MAX_TRACKS)) {
+		help_exit(1);
+	}
+
+	formatdsk(&opts);
+
+	return 0;
+
+}
@@ -0,0 +1,436 @@
+/* $Id$
+ *
+ * dskpack.c - Small utility to keep CPC disk images in a store that holds
+ * every distinct track only once.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "common.h"
+
+#include <unistd.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <libgen.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#define PACK_ADD 0
+#define PACK_GET 1
+#define PACK_LIST 2
+
+#define PACK_MAGIC "dskpack 2"
+#define PACK_MAGIC_ANY "dskpack "	/* lists of all versions read alike */
+#define MAX_BLOCK (sizeof(Trackinfo) + MAX_EDSK_TRACKLEN)
+
+/* notes:
+ *
+ * A store is a directory with two subdirectories:
+ *
+ *	blocks/xx/<hash>	the Disk-Info block of an image, the
+ *				Track-Info block of a track, or the sector
+ *				data and padding of a track as they are in
+ *				the file
+ *	images/<name>		the blocks an image is made of, one line
+ *				each: first the Disk-Info, then the tracks in
+ *				file order as "<Track-Info> <data>" ("-" for
+ *				tracks left out of an EDSK)
+ *
+ * The Track-Info holds the cylinder and side numbers, so it is kept apart
+ * from the sector data: blank or identical tracks share their data on any
+ * cylinder of any image, only the small Track-Info blocks differ. Blocks
+ * are named after the 64 bit FNV-1a hash of their contents. Two different
+ * blocks with the same hash get a suffix (.1, .2, ...), so a block is only
+ * ever shared after comparing it byte by byte. Since blocks are stored
+ * exactly as they were in the file, images come back out unchanged, one
+ * block at a time; dskwrite reading one from a pipe still loads the whole
+ * image before it writes. Lists of "dskpack 1" stores, with a whole track
+ * in one block, are read the same way. Image lists are
+ * named after the file the image came from; a different image with a name
+ * already in the store gets a suffix the same way, so nothing stored is
+ * ever replaced.
+ */
+
+static unsigned long long fnv1a64(const unsigned char *buf, int len)
+{
+	unsigned long long hash = 0xCBF29CE484222325ULL;
+
+	while (len--) {
+		hash ^= *buf++;
+		hash *= 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+static void pack_dir(char *name)
+{
+	if ((mkdir(name, 0755) < 0) && (errno != EEXIST)) {
+		perror(name);
+		exit(1);
+	}
+}
+
+/* Read a whole block, returns its length or -1 */
+static int load_block(char *store, char *name, unsigned char *buf)
+{
+	char path[PATH_MAX];
+	FILE *in;
+	int len;
+
+	snprintf(path, sizeof(path), "%s/blocks/%.2s/%s", store, name, name);
+	in = fopen(path, "r");
+	if (in == NULL)
+		return -1;
+	len = fread(buf, 1, MAX_BLOCK, in);
+	fclose(in);
+	return len;
+}
+
+/* Store a block unless an identical one is there already. name receives
+ * the name of the block. Returns TRUE if it was new. */
+static int store_block(char *store, unsigned char *buf, int len, char *name)
+{
+	static unsigned char old[MAX_BLOCK];
+	char path[PATH_MAX], tmp[PATH_MAX];
+	unsigned long long hash;
+	FILE *out;
+	int n, oldlen;
+
+	hash = fnv1a64(buf, len);
+	for (n=0; ; n++) {
+		if (n)
+			sprintf(name, "%016llx.%i", hash, n);
+		else
+			sprintf(name, "%016llx", hash);
+		oldlen = load_block(store, name, old);
+		if (oldlen < 0)
+			break;
+		if ((oldlen == len) && (memcmp(old, buf, len) == 0))
+			return FALSE;
+	}
+
+	snprintf(path, sizeof(path), "%s/blocks/%.2s", store, name);
+	pack_dir(path);
+	snprintf(path, sizeof(path), "%s/blocks/%.2s/%s", store, name, name);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	out = fopen(tmp, "w");
+	if (out == NULL) {
+		perror(tmp);
+		exit(1);
+	}
+	if (fwrite(buf, 1, len, out) != len) {
+		myabort("Error writing block: File to short\n");
+	}
+	if ((fclose(out) != 0) || (rename(tmp, path) < 0)) {
+		perror(path);
+		exit(1);
+	}
+	return TRUE;
+}
+
+/* Do two files hold the same bytes? */
+static int same_file(char *a, char *b)
+{
+	FILE *fa, *fb;
+	int ca, cb;
+
+	fa = fopen(a, "r");
+	fb = fopen(b, "r");
+	if ((fa == NULL) || (fb == NULL)) {
+		if (fa != NULL)
+			fclose(fa);
+		if (fb != NULL)
+			fclose(fb);
+		return FALSE;
+	}
+	do {
+		ca = getc(fa);
+		cb = getc(fb);
+	} while ((ca == cb) && (ca != EOF));
+	fclose(fa);
+	fclose(fb);
+	return ca == cb;
+}
+
+/* Give a finished image list its name, base or base.1, base.2, ... if a
+ * different image already has it */
+static void store_list(char *store, char *tmp, char *base)
+{
+	char path[PATH_MAX];
+	int n;
+
+	for (n=0; ; n++) {
+		if (n)
+			snprintf(path, sizeof(path), "%s/images/%s.%i", store,
+				base, n);
+		else
+			snprintf(path, sizeof(path), "%s/images/%s", store,
+				base);
+		if (link(tmp, path) == 0) {
+			if (n)
+				fprintf(stderr, "%s: name taken, stored as "
+					"%s.%i\n", base, base, n);
+			break;
+		}
+		if (errno != EEXIST) {
+			perror(path);
+			exit(1);
+		}
+		if (same_file(tmp, path)) {
+			fprintf(stderr, "%s: already in the store\n", base);
+			break;
+		}
+	}
+	unlink(tmp);
+}
+
+/* Split an image into the Disk-Info and the Track-Info and data of every
+ * track. Returns -1 if it is not a DSK or EDSK image. */
+int pack_image(char *store, char *filename, long *bytes, long *stored) {
+
+	static unsigned char buf[MAX_BLOCK];
+	char tmp[PATH_MAX], copy[PATH_MAX], name[64], *base;
+	Diskinfo diskinfo;
+	FILE *in, *out;
+	int i, ntracks, tracklen, edsk;
+
+	in = fopen(filename, "r");
+	if (in == NULL) {
+		perror(filename);
+		return -1;
+	}
+	if (fread(&diskinfo, 1, sizeof(diskinfo), in) != sizeof(diskinfo))
+		goto bad;
+	edsk = strncmp(diskinfo.magic, MAGIC_DISK, strlen(MAGIC_DISK)) != 0;
+	if ((edsk && strncmp(diskinfo.magic, MAGIC_EDISK,
+		strlen(MAGIC_EDISK))) ||
+		(diskinfo.heads < 1) || (diskinfo.heads > MAX_SIDES) ||
+		(diskinfo.tracks * diskinfo.heads >
+		sizeof(diskinfo.tracklenhigh)))
+		goto bad;
+	ntracks = diskinfo.tracks * diskinfo.heads;
+
+	strncpy(copy, filename, sizeof(copy) - 1);
+	copy[sizeof(copy) - 1] = 0;
+	base = basename(copy);
+	snprintf(tmp, sizeof(tmp), "%s/images/.%s.tmp", store, base);
+	out = fopen(tmp, "w");
+	if (out == NULL) {
+		perror(tmp);
+		exit(1);
+	}
+	fprintf(out, "%s\n", PACK_MAGIC);
+
+	*bytes += sizeof(diskinfo);
+	if (store_block(store, (unsigned char *) &diskinfo, sizeof(diskinfo),
+		name))
+		*stored += sizeof(diskinfo);
+	fprintf(out, "%s\n", name);
+
+	tracklen = diskinfo.tracklen[0] + diskinfo.tracklen[1]*256;
+	for (i=0; i<ntracks; i++) {
+		if (edsk)
+			tracklen = diskinfo.tracklenhigh[i]*256;
+		if (tracklen == 0) {
+			fprintf(out, "-\n");
+			continue;
+		}
+		if ((tracklen < sizeof(Trackinfo)) || (tracklen > MAX_BLOCK) ||
+			(fread(buf, 1, tracklen, in) != tracklen) ||
+			strncmp((char *) buf, MAGIC_TRACK,
+			strlen(MAGIC_TRACK))) {
+			fclose(out);
+			unlink(tmp);
+			goto bad;
+		}
+		*bytes += tracklen;
+		if (store_block(store, buf, sizeof(Trackinfo), name))
+			*stored += sizeof(Trackinfo);
+		fprintf(out, "%s", name);
+		if (tracklen > sizeof(Trackinfo)) {
+			if (store_block(store, buf + sizeof(Trackinfo),
+				tracklen - sizeof(Trackinfo), name))
+				*stored += tracklen - sizeof(Trackinfo);
+			fprintf(out, " %s", name);
+		}
+		fprintf(out, "\n");
+	}
+	fclose(in);
+	if (fclose(out) != 0) {
+		perror(tmp);
+		exit(1);
+	}
+	store_list(store, tmp, base);
+	return 0;
+
+bad:
+	fprintf(stderr, "%s: not a DSK or EDSK image\n", filename);
+	fclose(in);
+	return -1;
+}
+
+/* Write an image back out block by block, holding only the current block
+ * in memory */
+int unpack_image(char *store, char *image, FILE *out) {
+
+	static unsigned char buf[MAX_BLOCK];
+	char path[PATH_MAX], name[64];
+	FILE *in;
+	int len, err = 0;
+
+	snprintf(path, sizeof(path), "%s/images/%s", store, image);
+	in = fopen(path, "r");
+	if (in == NULL) {
+		perror(path);
+		return -1;
+	}
+	if ((fgets(name, sizeof(name), in) == NULL) ||
+		strncmp(name, PACK_MAGIC_ANY, strlen(PACK_MAGIC_ANY))) {
+		fprintf(stderr, "%s: not a dskpack image list\n", path);
+		fclose(in);
+		return -1;
+	}
+	while (fscanf(in, "%63s", name) == 1) {
+		if (strcmp(name, "-") == 0)
+			continue;
+		len = load_block(store, name, buf);
+		if (len < 0) {
+			fprintf(stderr, "%s: block %s is missing\n", image,
+				name);
+			err = -1;
+			break;
+		}
+		if (fwrite(buf, 1, len, out) != len) {
+			perror("Error writing image");
+			exit(1);
+		}
+	}
+	fclose(in);
+	return err;
+}
+
+int pack_list(char *store) {
+
+	char path[PATH_MAX];
+	DIR *dir;
+	struct dirent *ent;
+
+	snprintf(path, sizeof(path), "%s/images", store);
+	dir = opendir(path);
+	if (dir == NULL) {
+		perror(path);
+		return 1;
+	}
+	while ((ent = readdir(dir)) != NULL) {
+		if (ent->d_name[0] != '.')
+			printf("%s\n", ent->d_name);
+	}
+	closedir(dir);
+	return 0;
+}
+
+void help_exit(int exitcode) {
+	fprintf(stderr, "usage: dskpack [options] <store> [images]\n");
+	fprintf(stderr, "options: -x | --extract <image>  write image to stdout\n");
+	fprintf(stderr, "         -o | --output <file>    write it to file instead\n");
+	fprintf(stderr, "         -l | --list             list the images in the store\n");
+	fprintf(stderr, "         -h                      this help\n");
+	fprintf(stderr, "without options the images are added to the store\n");
+	fprintf(stderr, "dskpack -x <image> <store> | dskwrite - writes an image from the store\n");
+	exit(exitcode);
+}
+
+int main(int argc, char **argv) {
+
+	static struct option long_options[] = {
+		{"extract", 1, 0, 'x'},
+		{"output", 1, 0, 'o'},
+		{"list", 0, 0, 'l'},
+		{"help", 0, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+	int c, i, mode = PACK_ADD, err = 0;
+	char *store, *image = NULL, *outname = NULL;
+	char path[PATH_MAX];
+	long bytes = 0, stored = 0;
+	FILE *out;
+
+	do {
+		int option_index = 0;
+		c = getopt_long(argc, argv, "x:o:lh",
+			long_options, &option_index);
+		switch(c) {
+			case 'h':
+			case '?':
+				help_exit(0);
+				break;
+			case 'x':
+				mode = PACK_GET;
+				image = optarg;
+				break;
+			case 'o':
+				outname = optarg;
+				break;
+			case 'l':
+				mode = PACK_LIST;
+				break;
+		}
+	} while (c != -1);
+
+	if ((argc - optind < 1) ||
+		((mode == PACK_ADD) == (argc - optind == 1)))
+		help_exit(1);
+	store = argv[optind];
+
+	if (mode == PACK_LIST)
+		return pack_list(store);
+
+	if (mode == PACK_GET) {
+		out = stdout;
+		if (outname != NULL) {
+			out = fopen(outname, "w");
+			if (out == NULL) {
+				perror(outname);
+				exit(1);
+			}
+		}
+		err = unpack_image(store, image, out);
+		if (fclose(out) != 0) {
+			perror("Error writing image");
+			exit(1);
+		}
+		if ((err < 0) && (outname != NULL))
+			unlink(outname);
+		return err ? 1 : 0;
+	}
+
+	pack_dir(store);
+	snprintf(path, sizeof(path), "%s/blocks", store);
+	pack_dir(path);
+	snprintf(path, sizeof(path), "%s/images", store);
+	pack_dir(path);
+	for (i=optind+1; i<argc; i++) {
+		if (pack_image(store, argv[i], &bytes, &stored) < 0)
+			err++;
+	}
+	fprintf(stderr, "%li bytes in %i images, %li bytes new in the "
+		"store\n", bytes, argc - optind - 1 - err, stored);
+	return err ? 1 : 0;
+
+}
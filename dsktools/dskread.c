@@ -20,6 +20,8 @@
  */
 
 #include "common.h"
+#include "amsdos.h"
+#include "catalogue.h"
 
 #include <unistd.h>
 #include <getopt.h>
@@ -33,475 +35,722 @@
 #include <fcntl.h>
 #include <time.h>
 
-void rotateleft_sectorids(Trackinfo *trackinfo, int pos) {
+#define MAX_COPIES 8
+
+/* Options for readdsk() */
+typedef struct readopts_t {
+	int drive;
+	int side;		/* first side to read */
+	int sides;
+	int tracks;
+	int rawtrack;		/* capture tracks with READ TRACK */
+	char *rawname;		/* dump raw captures to this file */
+	int copies;		/* reads of a weak sector, 0 retries instead */
+	char *weakname;		/* write variance maps to this file */
+	int edsk;		/* always write an extended image */
+	int plan;		/* only plan and estimate the job */
+	int single;		/* one command per sector, no MT */
+	int retries;		/* retries per sector in the recovery pass */
+	int amsdos;		/* read allocated AMSDOS blocks only */
+	int realtime;		/* real time mode, see realtime_begin() */
+	char *catname;		/* look the disk up in this catalogue */
+	int block;		/* plain tracks through the block device */
+} Readopts;
+
+/* Read a sector copies times with one chained command. Without a seek in
+ * between, the reads happen on consecutive revolutions, which is how weak
+ * (fuzzy) sectors used by copy protections have to be sampled. */
+
+void read_copies(int fd, Trackinfo *trackinfo, Sectorinfo *sectorinfo,
+	unsigned char *data, int copies, int track, int head, int drive) {
 
-	Sectorinfo sectorinfo[29];
-	int i, spt;
-
-	memcpy( sectorinfo, trackinfo->sectorinfo, sizeof( Sectorinfo ) * 30 );
+	int i, err;
+	struct floppy_raw_cmd cmds[MAX_COPIES];
+	struct floppy_raw_cmd *cur_cmd;
+	unsigned char mask = 0xFF;
 
-	spt = trackinfo->spt;
-	for( i=0; i<spt; i++ ) {
-		memcpy( &trackinfo->sectorinfo[i],
-			&sectorinfo[(i+pos)%spt], sizeof( Sectorinfo ) );
+	for (i=0; i<copies; i++) {
+		cur_cmd = &cmds[i];
+		init_raw_cmd(cur_cmd);
+		cur_cmd->flags = FD_RAW_READ | FD_RAW_INTR;
+		if (i != copies-1)
+			cur_cmd->flags |= FD_RAW_MORE;
+		cur_cmd->track = track;
+		cur_cmd->rate  = 2;	/* SD */
+		cur_cmd->length= sector_size(sectorinfo);
+		cur_cmd->data  = data + i*sector_size(sectorinfo);
+		cur_cmd->cmd[cur_cmd->cmd_count++] = READ_DATA & mask;
+		cur_cmd->cmd[cur_cmd->cmd_count++] = (head<<2) | drive;
+		cur_cmd->cmd[cur_cmd->cmd_count++] = sectorinfo->track;
+		cur_cmd->cmd[cur_cmd->cmd_count++] = sectorinfo->head;
+		cur_cmd->cmd[cur_cmd->cmd_count++] = sectorinfo->sector;
+		cur_cmd->cmd[cur_cmd->cmd_count++] = sectorinfo->bps;
+		cur_cmd->cmd[cur_cmd->cmd_count++] = sectorinfo->sector;
+		cur_cmd->cmd[cur_cmd->cmd_count++] = trackinfo->gap;
+		cur_cmd->cmd[cur_cmd->cmd_count++] = 0xFF;
 	}
 
+	err = fdc_cmd(fd, cmds);
+	if (err < 0) {
+		perror("Error reading copies");
+		exit(1);
+	}
 }
 
-void rotate_sectorids(Trackinfo *trackinfo) {
+/* Per byte variance of several copies of a sector: the number of different
+ * values seen minus one, so 0 means stable. Returns the number of bytes
+ * that vary. */
 
-	int i, low, pos, sector;
+int variance_map(unsigned char *data, int size, int copies,
+	unsigned char *map) {
 
-	low = 0xFF;
-	pos = 0;
+	int i, j, k, n, nvar = 0;
 
-	/* Find lowest sector number */
-	for( i=0; i<trackinfo->spt; i++ ) {
-		sector = trackinfo->sectorinfo[i].sector;
-		if ( sector < low ) {
-			low = sector;
-			pos = i;
+	for (i=0; i<size; i++) {
+		n = 0;
+		for (j=1; j<copies; j++) {
+			for (k=0; k<j; k++) {
+				if (data[j*size+i] == data[k*size+i])
+					break;
+			}
+			if (k == j)
+				n++;
 		}
+		map[i] = n;
+		if (n)
+			nvar++;
+	}
+	return nvar;
+}
+
+/* Sample a sector with a data CRC error several times. A stable sector
+ * keeps one copy, a weak one gets all copies stored one after the other
+ * (EDSK multi-copy layout) at off in the track data. Returns the number of
+ * copies stored. */
+
+int read_weak(int fd, Track *trk, Sectorinfo *sectorinfo, int off,
+	Readopts *opts, FILE *weakfile, int track, int head) {
+
+	unsigned char *copies, map[MAX_TRACKLEN];
+	int size, n, nvar;
+
+	size = sector_size(sectorinfo);
+	if (size > MAX_TRACKLEN)
+		return 1;
+	copies = malloc(opts->copies * size);
+	if (copies == NULL) {
+		myabort("Error: Out of memory\n");
 	}
 
-	/* Rotate sectorids in trackinfo left by pos positions */
-	rotateleft_sectorids(trackinfo, pos);
+	read_copies(fd, &trk->info, sectorinfo, copies, opts->copies,
+		track, head, opts->drive);
+	nvar = variance_map(copies, size, opts->copies, map);
+
+	n = nvar ? opts->copies : 1;
+	while ((n > 1) && (trk->len + (n-1)*size > MAX_EDSK_TRACKLEN))
+		n--;
+	if (n > 1) {
+		trk->data = realloc(trk->data, trk->len + (n-1)*size);
+		if (trk->data == NULL) {
+			myabort("Error: Out of memory\n");
+		}
+		memmove(trk->data + off + n*size, trk->data + off + size,
+			trk->len - off - size);
+		trk->len += (n-1)*size;
+		set_sector_len(sectorinfo, n*size);
+		fprintf(stderr, "W%d ", nvar);
+
+		/* variance map record: "WEAK", track, head, C, H, R, N,
+		 * copies, size (little endian), then one byte per byte */
+		if (weakfile != NULL) {
+			fprintf(weakfile, "WEAK%c%c%c%c%c%c%c%c%c",
+				track, head, sectorinfo->track,
+				sectorinfo->head, sectorinfo->sector,
+				sectorinfo->bps, n, size & 0xFF, size >> 8);
+			fwrite(map, 1, size, weakfile);
+		}
+	}
+	memcpy(trk->data + off, copies, n*size);
 
+	free(copies);
+	return n;
 }
 
-void	seek(int fd, int drive, int track)
-{
-	int i, err;
-	struct floppy_raw_cmd raw_cmd;
-	unsigned char mask = 0xFF;
 
-	init_raw_cmd(&raw_cmd);
-	raw_cmd.flags = FD_RAW_INTR;
-	raw_cmd.track = track;
-	raw_cmd.rate  = 0;
-	raw_cmd.length= 0;
+void init_diskinfo( Diskinfo *diskinfo, int tracks, int heads, int tracklen ) {
 
-	raw_cmd.cmd[raw_cmd.cmd_count++] = FD_SEEK & mask;
-	raw_cmd.cmd[raw_cmd.cmd_count++] = drive;
-	raw_cmd.cmd[raw_cmd.cmd_count++] = track;
+	memset(diskinfo, 0, sizeof(*diskinfo));
 
-	err = ioctl(fd, FDRAWCMD, &raw_cmd);
+	strncpy( diskinfo->magic, MAGIC_DISK_WRITE, sizeof( diskinfo->magic ) );
+	diskinfo->tracks = tracks;
+	diskinfo->heads = heads;
+	diskinfo->tracklen[0] = (char) tracklen;
+	diskinfo->tracklen[1] = (char) (tracklen >> 8);
+	//unsigned char tracklenhigh[0xCC];
 
-	if (err<0)
-		printf("error");
 }
 
-#define FD_READTRACK (2|0x040)
-#define READ_ID 0x04a
-#define READ_DATA 0x046
-#define NSECTS 9
-
-char buf[8*1024];
-int read_ids(int fd, Trackinfo *trackinfo, int head, int drive) {
+void timestamp_diskinfo( Diskinfo *diskinfo ) {
 
-	int i, err;
-	struct floppy_raw_cmd cmds[32];
-	struct floppy_raw_cmd *cur_cmd;
+	time_t t;
+	struct tm *ltime;
 
-	unsigned char mask = 0xFF;
+	t = time(NULL);
+	ltime = localtime(&t);
+	/* FIXME: Can the formatting be messed up by locale settings? */
+	strftime( diskinfo->magic+14, 16, "%d %b %g %H:%M", ltime );
 
-	cur_cmd = cmds;
-
-	/* --  detect unformatted track -- */
-	/* attempt to read an id and compare the result information
-	against what we are expecting for a unformatted track */
-
-	/* initialise this cmd */
-	init_raw_cmd(cur_cmd);
-	cur_cmd->flags = /*FD_RAW_READ |*/ FD_RAW_INTR;
-	cur_cmd->track = trackinfo->track;
-	cur_cmd->rate  = 2;	/* SD */
-	cur_cmd->length= /*(128<<(trackinfo->bps))*/ 0;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = READ_ID & mask;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = (head<<2) | drive;
-			
-	err = ioctl(fd, FDRAWCMD, cmds);
-
-	if ((cur_cmd->reply[0] & 0x0c0)==0x040) 
-	{
-		/* check for specific command response which indicates
-		a unformatted track */
-		if (
-			(cur_cmd->reply[1]==1) && /* ST1 */
-			(cur_cmd->reply[2]==0) && /* ST2 */
-			(cur_cmd->reply[4]==0) && /* H */
-			(cur_cmd->reply[5]==1) && /* R */
-			(cur_cmd->reply[6]==0) /* N */
-			)
-		{
-			return 0;
-		}
+}
 
-/*		int i;
-		for (i=0; i<7; i++)
-		{
-			printf("%02x ",cur_cmd->reply[i]);
-		}
-		printf("\r\n");
-*/
-	}	
-
-
-	/* setup a list of 32 read id commands:
-	- if each read id command is done seperatly then
-		some id's will be skipped. (the time between reading a id and
-		the next using seperate reads is too long for small sectors of
-		256 bytes in size!
-		- I've only seen up to 32 sectors on copyprotections,
-		I don't think there are copyprotections that use more.
-		- don't use seek flag; this seems to cause id's to be missed.
-		
-	   problems:
-		- need to calculate number of sectors per track
-		- need to find the first sector id
-	*/
-	/* synchronises with 2nd sector id on track */
-
-	cur_cmd=cmds;
-	init_raw_cmd(cur_cmd);
-	cur_cmd->flags = FD_RAW_READ | FD_RAW_INTR;
-	cur_cmd->flags |= FD_RAW_MORE;
-//	cur_cmd->flags |= FD_RAW_SPIN;
-
-	cur_cmd->data = buf;
-	cur_cmd->track = trackinfo->track;
-	cur_cmd->rate  = 2;	/* SD */
-	cur_cmd->length= 6500;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = FD_READTRACK & mask;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = (head<<2) | drive;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 7;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0x02a;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0x0ff;
-
-#if 0
-	/* synchronises with 2nd sector id on track */
-	cur_cmd=cmds;
-	init_raw_cmd(cur_cmd);
-	cur_cmd->flags = FD_RAW_READ | FD_RAW_INTR;
-	cur_cmd->flags |= FD_RAW_MORE;
-	cur_cmd->data = buf;
-	cur_cmd->track = trackinfo->track;
-	cur_cmd->rate  = 2;	/* SD */
-	cur_cmd->length= (128<<(trackinfo->bps));
-	cur_cmd->cmd[cur_cmd->cmd_count++] = FD_READTRACK & mask;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = (head<<2) | drive;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 1;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0x02a;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0x0ff;
-#endif
-#if 0
-	/* synchronises with 1st sector id on track */
-	/* attempt to read a non-existant sector */
-	cur_cmd=cmds;
-	init_raw_cmd(cur_cmd);
-	cur_cmd->flags = FD_RAW_READ | FD_RAW_INTR;
-	cur_cmd->flags |= FD_RAW_SPIN;
-	cur_cmd->flags |= FD_RAW_MORE;
-	cur_cmd->data = buf;
-	cur_cmd->track = trackinfo->track;
-	cur_cmd->rate  = 2;	/* SD */
-	cur_cmd->length= (128<<(trackinfo->bps));
-	cur_cmd->cmd[cur_cmd->cmd_count++] = FD_READ & mask;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = (head<<2) | drive;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0x0ca;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 2;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0x0ca;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0x02a;
-	cur_cmd->cmd[cur_cmd->cmd_count++] = 0x0ff;
-#endif
-
-	/* initialise the read id command list */
-	for (i=1; i<32; i++)
-	{
-		cur_cmd = &cmds[i];
+/* Read the directory of an AMSDOS DATA or SYSTEM disk and find the blocks
+ * in use. Returns FALSE if the disk is something else. */
 
-		/* initialise this cmd */
-		init_raw_cmd(cur_cmd);
-		cur_cmd->flags = /*FD_RAW_READ |*/ FD_RAW_INTR;
-		if (i!=(32-1))
-		{
-			cur_cmd->flags |= FD_RAW_MORE;
-		}
-		cur_cmd->track = trackinfo->track;
-		cur_cmd->rate  = 2;	/* SD */
-		cur_cmd->length= 0; /*(128<<(trackinfo->bps));*/
-		cur_cmd->cmd[cur_cmd->cmd_count++] = READ_ID & mask;
-		cur_cmd->cmd[cur_cmd->cmd_count++] = (head<<2) | drive;
-	}		
-	
-	err = ioctl(fd, FDRAWCMD, cmds);
+int amsdos_prepare(int fd, Amsdos *amsdos, Readopts *opts) {
 
-		if (err < 0) {
-		  perror("Error reading id");
-		  exit(1);
-		}
+	Trackinfo trackinfo;
+	unsigned char dir[AMSDOS_DIRSECTS * 512];
+	int dirtrack, live;
 
-/*	cur_cmd = cmds;
-	for (i=0; i<7; i++)
-	{
-		printf("%02x\r\n",cur_cmd->reply[i]);
+	init_trackinfo(&trackinfo, 0, 0);
+	seek(fd, opts->drive, 0);
+	read_ids(fd, &trackinfo, opts->side, opts->drive);
+	if (!amsdos_init(amsdos, &trackinfo, opts->tracks)) {
+		fprintf(stderr, "Not an AMSDOS DATA or SYSTEM disk\n");
+		return FALSE;
 	}
-*/	
 
-	trackinfo->spt = NSECTS;
-	for (i=1; i<NSECTS+1; i++)
-	{
-		cur_cmd = &cmds[i];
-		trackinfo->sectorinfo[i-1].track = cur_cmd->reply[3];
-		trackinfo->sectorinfo[i-1].head = cur_cmd->reply[4];
-		trackinfo->sectorinfo[i-1].sector = cur_cmd->reply[5];
-		trackinfo->sectorinfo[i-1].bps = cur_cmd->reply[6];
+	/* the directory sectors are the first ones by number */
+	dirtrack = amsdos_dirtrack(amsdos);
+	init_trackinfo(&trackinfo, dirtrack, 0);
+	seek(fd, opts->drive, dirtrack);
+	read_ids(fd, &trackinfo, opts->side, opts->drive);
+	if (!standard_layout(&trackinfo, dirtrack) ||
+		(first_sector(&trackinfo) != amsdos->base)) {
+		fprintf(stderr, "No AMSDOS directory on track %i\n", dirtrack);
+		return FALSE;
+	}
+	trackinfo.spt = AMSDOS_DIRSECTS;
+	trackinfo.sectorinfo[0].sector = amsdos->base;
+	if (read_sectors(fd, &trackinfo, dir, dirtrack, opts->side,
+		opts->drive, FALSE)) {
+		fprintf(stderr, "Could not read the AMSDOS directory\n");
+		return FALSE;
 	}
 
-	
-
-//	rotate_sectorids( trackinfo );
-
-	/* need to calculate number of sectors differently */	
-	return NSECTS;
+	live = amsdos_scan_dir(amsdos, dir);
+	fprintf(stderr, "AMSDOS %s format, %i directory entries, "
+		"%i blocks in use\n", (amsdos->base == OFF_DAT) ?
+		"DATA" : "SYSTEM", live, amsdos->nused);
+	return TRUE;
 }
 
-/* standard FD_READ causes problems and is slower! */
+/* The plain layout of the format for a track */
 
-void read_sect(int fd, Trackinfo *trackinfo, Sectorinfo *sectorinfo,
-	unsigned char *data, int track, int head, int drive) {
+void amsdos_plain(Amsdos *amsdos, Trackinfo *trackinfo, int track, int head) {
 
-	int i, err, retry=0, ok=0;
-	struct floppy_raw_cmd raw_cmd;
-	unsigned char mask = 0xFF;
+	int j;
 
-//	reset(fd);
+	init_trackinfo(trackinfo, track, head);
+	trackinfo->spt = AMSDOS_SPT;
+	trackinfo->fill = FILL;
+	for (j=0; j<AMSDOS_SPT; j++) {
+		init_sectorinfo(&trackinfo->sectorinfo[j], track, head,
+			amsdos->base + j);
+		set_sector_len(&trackinfo->sectorinfo[j], 512);
+	}
+}
 
-	do {
-		init_raw_cmd(&raw_cmd);
-		raw_cmd.flags = FD_RAW_READ | FD_RAW_INTR;
-		raw_cmd.track = track;
-		raw_cmd.rate  = 2;	/* SD */
-		raw_cmd.length= (128<<(sectorinfo->bps));
-		raw_cmd.data  = data;
-		raw_cmd.cmd_count = 0;
-		raw_cmd.cmd[raw_cmd.cmd_count++] = READ_DATA & mask;
-		raw_cmd.cmd[raw_cmd.cmd_count++] = (head<<2) | drive;	/* head */
-		raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->track;	/* track */
-		raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->head;	/* head */	
-		raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->sector;	/* sector */
-		raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->bps;	/* sectorsize */
-		raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->sector;	/* sector */
-		raw_cmd.cmd[raw_cmd.cmd_count++] = trackinfo->gap;	/* GPL */
-		raw_cmd.cmd[raw_cmd.cmd_count++] = 0xFF;		/* DTL */
-	
-		err = ioctl(fd, FDRAWCMD, &raw_cmd);
-		if (err < 0) {
-			perror("Error reading");
-			exit(1);
-		}
+/* A track without live data is not read at all, it gets the plain layout,
+ * filled with the filler byte and flagged unread */
 
-		if (((raw_cmd.reply[0] &0x0f8)==0x040) && (raw_cmd.reply[1]==0x080)) {
-			/* end of cylinder */
-			return;
-		}
+void amsdos_skip(Amsdos *amsdos, Track *trk, int track, int head) {
 
-		if (raw_cmd.reply[0] & 0x40) {
-			recalibrate(fd,drive);
-			retry++;
-			fprintf(stderr,"TRY %d \n",retry);
-		}
-		else ok = 1; // Read ok, go to next
-	} while((retry<10) && (ok == 0));
+	int j;
 
-	if(!ok) {
-		printf("\n%02x %02x %02x\r\n",raw_cmd.reply[0],raw_cmd.reply[1], raw_cmd.reply[2]);
-		fprintf(stderr, "Could not read sector %0X\n",
-			sectorinfo->sector);
+	amsdos_plain(amsdos, &trk->info, track, head);
+	set_unread(&trk->info, (1 << AMSDOS_SPT) - 1);
+	trk->len = AMSDOS_SPT * 512;
+	trk->data = malloc(trk->len);
+	if (trk->data == NULL) {
+		myabort("Error: Out of memory\n");
 	}
+	memset(trk->data, FILL, trk->len);
+	for (j=0; j<AMSDOS_SPT; j++)
+		fprintf(stderr, "%02X- ", amsdos->base + j);
 }
 
-void init_trackinfo( Trackinfo *trackinfo, int track, int side ) {
+/* Look the disk up in the catalogue once its first tracks are read, and
+ * load the image that matches. Its layout then drives the reads of the
+ * remaining tracks. */
 
-	int i;
+Catentry *cat_guide(Catalogue *cat, Image *image, int ntracks, Image *known) {
 
-	memset(trackinfo, 0, sizeof(*trackinfo));
-
-	strncpy( trackinfo->magic, MAGIC_TRACK, sizeof( trackinfo->magic ) );
-	//unsigned char unused1[0x03];
-	trackinfo->track = track;
-	trackinfo->head = side;
-	//unsigned char unused2[0x02];
-	trackinfo->bps = 2;
-	trackinfo->spt = 0;
-	trackinfo->gap = 82;
-	trackinfo->fill = 0xFF;
-	//trackinfo->sectorinfo[29];
-//	for ( i=0; i<9; i++ ) {
-//		init_sectorinfo( &trackinfo->sectorinfo[i], track, 0, 0xC1+i );
-//	}
+	Catentry *entry;
+	FILE *in;
+	int err;
 
-}
-
-void init_diskinfo( Diskinfo *diskinfo, int tracks, int heads, int tracklen ) {
+	entry = cat_match(cat, image, ntracks);
+	if (entry == NULL) {
+		fprintf(stderr, "Disk not in the catalogue\n");
+		return NULL;
+	}
+	fprintf(stderr, "Known disk %s\n", entry->name);
 
-	memset(diskinfo, 0, sizeof(*diskinfo));
+	in = fopen(entry->name, "r");
+	if (in == NULL) {
+		perror("Warning: could not open known image");
+		return NULL;
+	}
+	err = load_image(in, known);
+	fclose(in);
+	if (err < 0)
+		return NULL;
+	if (known->diskinfo.heads != image->diskinfo.heads) {
+		free_image(known);
+		return NULL;
+	}
+	return entry;
+}
 
-	strncpy( diskinfo->magic, MAGIC_DISK_WRITE, sizeof( diskinfo->magic ) );
-	diskinfo->tracks = tracks;
-	diskinfo->heads = heads;
-	diskinfo->tracklen[0] = (char) tracklen;
-	diskinfo->tracklen[1] = (char) (tracklen >> 8);
-	//unsigned char tracklenhigh[0xCC];
+/* Take the layout of a known track, once READ ID finds one of its sectors
+ * under the head (or nothing, if the track is unformatted). Returns FALSE
+ * if the disk has something else there. */
 
-}
+int cat_layout(int fd, Trackinfo *known, Trackinfo *trackinfo, int track,
+	int head, int drive) {
 
-void timestamp_diskinfo( Diskinfo *diskinfo ) {
+	unsigned char chrn[4];
+	Sectorinfo *sectorinfo;
+	int i;
 
-	time_t t;
-	struct tm *ltime;
+	if (read_id(fd, track, head, drive, chrn) < 0) {
+		if (known->spt)
+			return FALSE;
+	} else {
+		for (i=0; i<known->spt; i++) {
+			sectorinfo = &known->sectorinfo[i];
+			if ((sectorinfo->track == chrn[0]) &&
+				(sectorinfo->head == chrn[1]) &&
+				(sectorinfo->sector == chrn[2]) &&
+				(sectorinfo->bps == chrn[3]))
+				break;
+		}
+		if (i == known->spt)
+			return FALSE;
+	}
 
-	t = time(NULL);
-	ltime = localtime(&t);
-	/* FIXME: Can the formatting be messed up by locale settings? */
-	strftime( diskinfo->magic+14, 16, "%d %b %g %H:%M", ltime );
+	trackinfo->spt = known->spt;
+	trackinfo->bps = known->bps;
+	trackinfo->gap = known->gap;
+	trackinfo->fill = known->fill;
+	for (i=0; i<known->spt; i++) {
+		sectorinfo = &trackinfo->sectorinfo[i];
+		*sectorinfo = known->sectorinfo[i];
+		sectorinfo->err1 = 0;
+		sectorinfo->err2 = 0;
+	}
+	return TRUE;
+}
 
+/* Second pass over the sectors that could not be read in the first one,
+ * in cylinder order so the head moves across the disk only once. Only here
+ * are sectors retried. */
+
+void recover(int fd, Image *image, unsigned int *failed, Readopts *opts) {
+
+	Track *trk;
+	Sectorinfo *sectorinfo;
+	int i, j, k, off, ntrk, side, bad = 0, good = 0;
+
+	for (i=0; i<opts->tracks; i++) {
+		if (!failed[i*opts->sides] &&
+			((opts->sides < 2) || !failed[i*opts->sides+1]))
+			continue;
+		seek(fd, opts->drive, i);
+		for (k=0; k<opts->sides; k++) {
+			ntrk = (i*opts->sides)+k;
+			side = (opts->side+k)%MAX_SIDES;
+			trk = &image->track[ntrk];
+			if (!failed[ntrk])
+				continue;
+
+			fprintf(stderr, "Recovering ");
+			printtrackinfo(stderr, &trk->info);
+			fprintf(stderr, " [");
+			off = 0;
+			for (j=0; j<trk->info.spt; j++) {
+				sectorinfo = &trk->info.sectorinfo[j];
+				if (failed[ntrk] & (1 << j)) {
+					fprintf(stderr, "%02X",
+						sectorinfo->sector);
+					if (read_sect(fd, &trk->info,
+						sectorinfo, trk->data + off,
+						i, side, opts->drive, FALSE,
+						opts->retries)) {
+						fprintf(stderr, "! ");
+						bad++;
+					} else {
+						fprintf(stderr, " ");
+						good++;
+					}
+				}
+				off += sector_len(sectorinfo);
+			}
+			fprintf(stderr, "]\n");
+		}
+	}
+	if (good || bad)
+		fprintf(stderr, "%i sectors recovered, %i bad\n", good, bad);
 }
 
-void readdsk(char *filename, int drv, int startside, int nsides, int 
-ntracks) {
+void readdsk(char *filename, Readopts *opts) {
 
 	/* Variable declarations */
-	int fd, tmp, err;
-	char drive[32];
-	struct floppy_raw_cmd raw_cmd;
-
-	Diskinfo diskinfo;
-	Trackinfo trackinfo[MAX_TRACKS*MAX_SIDES];
-	Sectorinfo *sectorinfo, **sectorinfos;
-	unsigned char data[TRACKLEN*TRACKS], *sect, *track;
-	int tracklen;
-	FILE *file;
-	int i, j, count;
-	char *magic_disk = MAGIC_DISK;
-	char *magic_edisk = MAGIC_EDISK;
-	char *magic_track = MAGIC_TRACK;
-	char flag_edisk = FALSE;	// indicates extended disk image format
-
-	/* initialization */
-	sprintf(drive,"/dev/fd%01d",drv);
+	int fd;
+
+	Image image;
+	Track *trk;
+	Sectorinfo *sectorinfo;
+	unsigned char raw[RAW_CAPTURE_LEN];
+	static unsigned char scratch[MAX_EDSK_TRACKLEN];
+	FILE *file, *rawfile = NULL, *weakfile = NULL;
+	int i, j, k, off, len, rawlen, found, status, mt, ids, amsdos;
+	unsigned int failed[MAX_TRACKS*MAX_SIDES], live;
+	Amsdos ams;
+	char *mark;
+	Catalogue cat;
+	Catentry *entry = NULL;
+	Image known;
+	Trackinfo *expect;
+	int same = 0;
+	static unsigned char blockbuf[SPT * 512];
+	Trackinfo probe;
+	int bfd = -1, base = 0;
 
 	/* open drive */
-	fd = open( drive, O_ACCMODE | O_NDELAY);
-	if ( fd < 0 ){
-		perror("Error opening floppy device");
-		exit(1);
-	}
+	if (opts->plan)
+		plan_begin(stdout);
+	fd = open_drive(opts->drive);
 
 	printf("%s\n",filename);
 
-	/* open file */
-	file = fopen(filename, "w");
-	if (file == NULL) {
-		perror("Error opening image file");
+	/* open file, a plan only goes through the motions */
+	file = NULL;
+	if (!opts->plan) {
+		file = fopen(filename, "w");
+		if (file == NULL) {
+			perror("Error opening image file");
+			exit(1);
+		}
+	}
+
+	/* open raw track dump */
+	if (opts->rawname != NULL) {
+		rawfile = fopen(opts->rawname, "w");
+		if (rawfile == NULL) {
+			perror("Error opening raw track file");
+			exit(1);
+		}
+	}
+
+	/* open variance map file */
+	if (opts->weakname != NULL) {
+		weakfile = fopen(opts->weakname, "w");
+		if (weakfile == NULL) {
+			perror("Error opening weak sector file");
+			exit(1);
+		}
+	}
+
+	init_image( &image, opts->tracks, opts->sides );
+	memset(failed, 0, sizeof(failed));
+
+	if ((opts->catname != NULL) && (cat_load(&cat, opts->catname) < 0))
 		exit(1);
+
+	init( fd, opts->drive);
+
+	if (opts->realtime) {
+		realtime_begin();
+		realtime_prefault(scratch, sizeof(scratch));
+		realtime_prefault(raw, sizeof(raw));
 	}
 
-	init( fd, drv);
+	/* plain DATA and SYSTEM disks are read by the floppy driver */
+	if (opts->block && (opts->side == 0)) {
+		init_trackinfo(&probe, 0, 0);
+		seek(fd, opts->drive, 0);
+		read_ids(fd, &probe, 0, opts->drive);
+		base = block_layout(&probe, 0, 0);
+		if (base)
+			bfd = block_open(fd, opts->drive, base, opts->tracks,
+				opts->sides, FALSE);
+		if (bfd < 0)
+			fprintf(stderr, "Not using the block device\n");
+	}
+
+	/* AMSDOS disks are single sided */
+	amsdos = opts->amsdos && (opts->sides == 1) &&
+		amsdos_prepare(fd, &ams, opts);
 
-	sect = data;
-	for ( i=0; i<ntracks; i++ ) {
-		int k;
-		for (k=0; k<nsides; k++) {
+	for ( i=0; i<opts->tracks; i++ ) {
+		mt = FALSE;
+		for (k=0; k<opts->sides; k++) {
 			int spt;
 			int side;
 			int ntrk;
 
-			ntrk = (i*nsides)+k;
-			side = (startside+k)%MAX_SIDES;
+			ntrk = (i*opts->sides)+k;
+			side = (opts->side+k)%MAX_SIDES;
+			trk = &image.track[ntrk];
+
+			/* progress of the last track goes out now */
+			realtime_track();
 
-			init_trackinfo( &trackinfo[ntrk], i,k );
-			printtrackinfo(stderr, &trackinfo[ntrk]);
+			/* enough of the disk to recognise it */
+			if ((opts->catname != NULL) &&
+				(ntrk == CAT_TRACKS * opts->sides))
+				entry = cat_guide(&cat, &image, ntrk, &known);
+			expect = NULL;
+
+			init_trackinfo( &trk->info, i,k );
+			printtrackinfo(stderr, &trk->info);
 			fprintf(stderr, "\n");
 			fprintf(stderr, " [");
 
-			seek(fd, drv,i);
-			spt = read_ids(fd, &trackinfo[ntrk],side,drv);
-			/* Slow version: Read sectors in order */
-		
-			trackinfo->spt = spt;
-			for ( j=0; j<spt; j++ ) {
-				sectorinfo = &trackinfo[ntrk].sectorinfo[j];
-				fprintf(stderr, "%02X ", sectorinfo->sector);
-				read_sect(fd, &trackinfo[ntrk],sectorinfo,sect, i,side,drv);
-				sect += (128<<trackinfo[ntrk].bps);
+			/* plain tracks come from the block device, once
+			 * their IDs show nothing but the plain layout: the
+			 * driver only asks for the 9 sectors it expects */
+			ids = FALSE;
+			if (bfd >= 0) {
+				if (k == 0)
+					seek(fd, opts->drive, i);
+				read_ids(fd, &trk->info, side, opts->drive);
+				ids = TRUE;
+			}
+			if (ids && (block_layout(&trk->info, i, k) == base) &&
+				(block_io(bfd, blockbuf, i, k, opts->sides, 1,
+				FALSE) == 0)) {
+				for (j=0; j<trk->info.spt; j++)
+					set_sector_len(&trk->info.sectorinfo[j],
+						sector_size(
+						&trk->info.sectorinfo[j]));
+				trk->len = sizeof(blockbuf);
+				trk->data = malloc(trk->len);
+				if (trk->data == NULL) {
+					myabort("Error: Out of memory\n");
+				}
+				id_order(&trk->info, trk->data, blockbuf,
+					FALSE);
+				for (j=0; j<trk->info.spt; j++)
+					fprintf(stderr, "%02X= ",
+						trk->info.sectorinfo[j].sector);
+				fprintf(stderr, "]\n");
+				continue;
+			}
+
+			/* head 1 came with the MT read of head 0, as long as
+			 * its own IDs are laid out the same way */
+			if (mt) {
+				if (!ids)
+					read_ids(fd, &trk->info, side,
+						opts->drive);
+				ids = TRUE;
+				mt = mt_layout(&image.track[ntrk-1].info,
+					&trk->info, i);
+			}
+			if (mt) {
+				for (j=0; j<trk->info.spt; j++)
+					set_sector_len(&trk->info.sectorinfo[j],
+						sector_size(
+						&trk->info.sectorinfo[j]));
+				trk->len = image.track[ntrk-1].len;
+				trk->data = malloc(trk->len);
+				if (trk->data == NULL) {
+					myabort("Error: Out of memory\n");
+				}
+				id_order(&trk->info, trk->data,
+					scratch + trk->len, FALSE);
+				for (j=0; j<trk->info.spt; j++)
+					fprintf(stderr, "%02X+ ",
+						trk->info.sectorinfo[j].sector);
+				fprintf(stderr, "]\n");
+				continue;
 			}
-#if 0
-		trackinfo->spt = spt;
-		/* Fast version: Read sectors interleaved in two passes */
-		for ( j=0; j<spt; j+=2 ) {
-			sectorinfo = &trackinfo[i].sectorinfo[j];
-			fprintf(stderr, "%02X ", sectorinfo->sector);
-			read_sect(fd, &trackinfo[i], sectorinfo, sect,side,drv);
-			sect += 0x400;
-		}
-		sect = sect - ( 0x400 * j/2 ) + 0x200;
-		for ( j=1; j<spt; j+=2 ) {
-			sectorinfo = &trackinfo[i].sectorinfo[j];
-			fprintf(stderr, "%02X ", sectorinfo->sector);
-			read_sect(fd, &trackinfo[i], sectorinfo, sect,side,drv);
-			sect += 0x400;
-		}
-#endif
-			fprintf(stderr, "]\n");
-		}
-	}
 
-	init_diskinfo( &diskinfo, ntracks, nsides, TRACKLEN_INFO );
-	timestamp_diskinfo( &diskinfo );
-	printdiskinfo(stderr, &diskinfo);
+			/* nothing allocated on this track */
+			if (amsdos) {
+				Trackinfo plain;
 
-	count = fwrite(&diskinfo, 1, sizeof(diskinfo), file);
-	if (count != sizeof(diskinfo)) {
-		myabort("Error writing Disk-Info: File to short\n");
-	}
+				amsdos_plain(&ams, &plain, i, k);
+				if (amsdos_live(&ams, &plain, i) == 0) {
+					amsdos_skip(&ams, trk, i, k);
+					fprintf(stderr, "]\n");
+					continue;
+				}
+			}
 
-	track = data;
-	tracklen = TRACKLEN;
-	for (i=0; i<diskinfo.tracks; i++) 
-	{
-		int j;
-		for (j=0; j<diskinfo.heads; j++)
-		{
-			int ninfo = (i*diskinfo.heads)+j;
-
-			count = fwrite(&trackinfo[ninfo], 1, 
-sizeof(trackinfo[ninfo]), file);
-			if (count != sizeof(trackinfo[ninfo])) 
-			{
-				myabort("Error writing Track-Info: File to short\n");
+			/* the heads share the cylinder, step only once */
+			if ((k == 0) && !ids)
+				seek(fd, opts->drive,i);
+
+			/* Try to get the whole track from one revolution and
+			 * fall back to reading the IDs when that fails. */
+			found = -1;
+			mark = "* ";
+			if (opts->rawtrack) {
+				rawlen = read_track_raw(fd, raw, i, side,
+					opts->drive);
+				found = decode_track(raw, rawlen, &trk->info,
+					scratch, MAX_EDSK_TRACKLEN);
+				if (rawfile != NULL) {
+					fprintf(rawfile, "RTRK%c%c%c%c",
+						i, side, rawlen & 0xFF,
+						rawlen >> 8);
+					fwrite(raw, 1, rawlen, rawfile);
+				}
+			}
+
+			/* a known disk needs only one READ ID to confirm the
+			 * layout, its errors are taken as they come */
+			if ((found < 0) && (entry != NULL) &&
+				(ntrk < known.ntracks)) {
+				if (cat_layout(fd, &known.track[ntrk].info,
+					&trk->info, i, side, opts->drive)) {
+					expect = &known.track[ntrk].info;
+					found = 0;
+				} else {
+					fprintf(stderr, "(differs from %s) ",
+						entry->name);
+					free_image(&known);
+					entry = NULL;
+				}
+			}
+			if ((found < 0) && !ids)
+				read_ids(fd, &trk->info, side, opts->drive);
+			if (found < 0)
+				found = 0;
+			spt = trk->info.spt;
+
+			len = 0;
+			for ( j=0; j<spt; j++ ) {
+				len += sector_size(&trk->info.sectorinfo[j]);
 			}
-			count = fwrite(track, 1, tracklen, file);
-			if (count != tracklen) 
-			{
-				myabort("Error writing Track: File to short\n");
+			trk->data = malloc(len ? len : 1);
+			if (trk->data == NULL) {
+				myabort("Error: Out of memory\n");
 			}
+			trk->len = len;
+			if (found)
+				memcpy(trk->data, scratch, len);
+
+			/* Plain tracks take one command, for both heads if
+			 * they are numbered from 1 (MT) */
+			if (!found && !opts->single &&
+				standard_layout(&trk->info, i)) {
+				mt = (k == 0) && (opts->sides == 2) &&
+					(side == 0) &&
+					(2 * len <= MAX_EDSK_TRACKLEN) &&
+					mt_layout(&trk->info, NULL, i);
+				if (read_sectors(fd, &trk->info, scratch, i,
+					side, opts->drive, mt) == 0) {
+					id_order(&trk->info, trk->data,
+						scratch, FALSE);
+					found = (1 << spt) - 1;
+					mark = "+ ";
+				} else
+					mt = FALSE;
+			}
+
+			/* Slow version: Read sectors in order, only the live
+			 * ones of AMSDOS disks */
+			if (amsdos)
+				live = amsdos_live(&ams, &trk->info, i);
+			off = 0;
+			for ( j=0; j<spt; j++ ) {
+				sectorinfo = &trk->info.sectorinfo[j];
+				set_sector_len(sectorinfo,
+					sector_size(sectorinfo));
+				fprintf(stderr, "%02X", sectorinfo->sector);
+				if (found & (1 << j)) {
+					fprintf(stderr, mark);
+				} else if (amsdos && !(live & (1 << j))) {
+					fprintf(stderr, "- ");
+					memset(trk->data + off, FILL,
+						sector_len(sectorinfo));
+					set_unread(&trk->info,
+						get_unread(&trk->info) |
+						(1 << j));
+				} else {
+					fprintf(stderr, " ");
+					status = read_sect(fd, &trk->info,
+						sectorinfo, trk->data + off,
+						i, side, opts->drive,
+						opts->copies > 1, 0);
+					if ((opts->copies > 1) &&
+						((status >> 8) & ST2_CRC)) {
+						if (read_weak(fd, trk,
+							sectorinfo, off, opts,
+							weakfile, i, side) > 1)
+							image.edsk = TRUE;
+					} else if (status && (expect != NULL) &&
+						((expect->sectorinfo[j].err1 &
+						CAT_ERR1) ||
+						(expect->sectorinfo[j].err2 &
+						CAT_ERR2))) {
+						/* catalogued as bad */
+						fprintf(stderr, "e ");
+					} else if (status) {
+						/* no retries now, come back
+						 * later */
+						failed[ntrk] |= 1 << j;
+						fprintf(stderr, "? ");
+					}
+				}
+				off += sector_len(sectorinfo);
+			}
+			fprintf(stderr, "]\n");
+			if ((expect != NULL) &&
+				(content_print(trk) == entry->content[ntrk]))
+				same++;
 		}
-	
-		track += tracklen;
 	}
 
-	fclose(file);
+	if (bfd >= 0)
+		block_close(fd, bfd);
+
+	if (entry != NULL) {
+		fprintf(stderr, "%i tracks identical to %s\n", same,
+			entry->name);
+		free_image(&known);
+	}
+	if (opts->catname != NULL)
+		cat_free(&cat);
+
+	if (opts->retries)
+		recover(fd, &image, failed, opts);
+	realtime_end();
+
+	init_diskinfo( &image.diskinfo, opts->tracks, opts->sides,
+		TRACKLEN_INFO );
+	timestamp_diskinfo( &image.diskinfo );
+	printdiskinfo(stderr, &image.diskinfo);
+
+	if (opts->edsk)
+		image.edsk = TRUE;
+	if (opts->plan) {
+		if (plan_end())
+			exit(1);
+	} else {
+		if (write_image(file, &image) < 0)
+			exit(1);
+		fclose(file);
+	}
+	if (rawfile != NULL)
+		fclose(rawfile);
+	if (weakfile != NULL)
+		fclose(weakfile);
+	free_image(&image);
 
 }
 
@@ -511,6 +760,20 @@ void help_exit(int exitcode) {
 	fprintf(stderr, "         -s | --side <side>      select side\n");
 	fprintf(stderr, "         -S | --sides <sides>    number of sides\n");
 	fprintf(stderr, "         -t | --tracks <tracks>  number of tracks\n");
+	fprintf(stderr, "         -r | --raw              capture whole tracks in one revolution\n");
+	fprintf(stderr, "         -R | --rawfile <file>   also dump raw track captures to file\n");
+	fprintf(stderr, "         -w | --weak <copies>    read sectors with CRC errors several times\n");
+	fprintf(stderr, "         -W | --weakmap <file>   write variance maps of weak sectors to file\n");
+	fprintf(stderr, "         -e | --edsk             always write an extended image\n");
+	fprintf(stderr, "         -p | --plan             list the FDC commands and estimate time only\n");
+	fprintf(stderr, "         -1 | --single           one command per sector, also on plain tracks\n");
+	fprintf(stderr, "         -T | --retries <n>      retries of bad sectors after the first pass\n");
+	fprintf(stderr, "         -a | --amsdos           read only the sectors AMSDOS files use\n");
+	fprintf(stderr, "         -x | --realtime         lock memory, real time priority, quiet tracks\n");
+	fprintf(stderr, "         -c | --catalogue <file> follow the layout of known disks (see dskcat)\n");
+	fprintf(stderr, "         -B | --block            read plain DATA/SYSTEM tracks through the block device\n");
+	fprintf(stderr, "         -L | --trace <file>     record all FDC commands to file\n");
+	fprintf(stderr, "         -Y | --replay <file>    take the FDC replies from a recorded trace\n");
 	fprintf(stderr, "         -h                      this help\n");
 	exit(exitcode);
 }
@@ -522,6 +785,20 @@ int main(int argc, char **argv) {
 		{"side", 1, 0, 's'},
 		{"sides", 1, 0, 'S'},
 		{"tracks", 1, 0, 't'},
+		{"raw", 0, 0, 'r'},
+		{"rawfile", 1, 0, 'R'},
+		{"weak", 1, 0, 'w'},
+		{"weakmap", 1, 0, 'W'},
+		{"edsk", 0, 0, 'e'},
+		{"plan", 0, 0, 'p'},
+		{"single", 0, 0, '1'},
+		{"retries", 1, 0, 'T'},
+		{"amsdos", 0, 0, 'a'},
+		{"realtime", 0, 0, 'x'},
+		{"catalogue", 1, 0, 'c'},
+		{"block", 0, 0, 'B'},
+		{"trace", 1, 0, 'L'},
+		{"replay", 1, 0, 'Y'},
 		{"help", 0, 0, 'h'},
 		{0, 0, 0, 0}
 	};
@@ -530,15 +807,18 @@ int main(int argc, char **argv) {
 	char *side_string = NULL;
 	char *sides_string = NULL;
 	char *tracks_string = NULL;
-	int drive = 0;
-	char side = 0;
-	char sides = 1;
-	char tracks = 40;
+	char *weak_string = NULL;
+	Readopts opts;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.sides = 1;
+	opts.tracks = 40;
+	opts.retries = 10;
 
 	do {
 		int this_option_optind = optind ? optind : 1;
 		int option_index = 0;
-		c = getopt_long(argc, argv, "d:s:S:t:h",
+		c = getopt_long(argc, argv, "d:s:S:t:rR:w:W:ep1T:axc:BL:Y:h",
 			long_options, &option_index);
 		switch(c) {
 			case 'h':
@@ -557,6 +837,49 @@ int main(int argc, char **argv) {
 			case 't':
 				tracks_string = optarg;
 				break;
+			case 'r':
+				opts.rawtrack = TRUE;
+				break;
+			case 'R':
+				opts.rawname = optarg;
+				opts.rawtrack = TRUE;
+				break;
+			case 'w':
+				weak_string = optarg;
+				break;
+			case 'W':
+				opts.weakname = optarg;
+				break;
+			case 'e':
+				opts.edsk = TRUE;
+				break;
+			case 'p':
+				opts.plan = TRUE;
+				break;
+			case '1':
+				opts.single = TRUE;
+				break;
+			case 'T':
+				opts.retries = atoi(optarg);
+				break;
+			case 'a':
+				opts.amsdos = TRUE;
+				break;
+			case 'x':
+				opts.realtime = TRUE;
+				break;
+			case 'c':
+				opts.catname = optarg;
+				break;
+			case 'B':
+				opts.block = TRUE;
+				break;
+			case 'L':
+				trace_begin(optarg, FALSE);
+				break;
+			case 'Y':
+				trace_begin(optarg, TRUE);
+				break;
 		}
 	} while (c != -1);
 
@@ -564,12 +887,23 @@ int main(int argc, char **argv) {
 		help_exit(1);
 	}
 
-	if (drive_string != NULL) drive = atoi(drive_string);
-	if (side_string != NULL) side = atoi(side_string);
-	if (sides_string != NULL) sides = atoi(sides_string);
-	if (tracks_string != NULL) tracks = atoi(tracks_string);
+	if (drive_string != NULL) opts.drive = atoi(drive_string);
+	if (side_string != NULL) opts.side = atoi(side_string);
+	if (sides_string != NULL) opts.sides = atoi(sides_string);
+	if (tracks_string != NULL) opts.tracks = atoi(tracks_string);
+	if (weak_string != NULL) opts.copies = atoi(weak_string);
+
+	if ((opts.sides < 1) || (opts.sides > MAX_SIDES) ||
+		(opts.tracks < 1) || (opts.tracks > MAX_TRACKS)) {
+		help_exit(1);
+	}
+	if ((opts.copies < 0) || (opts.copies > MAX_COPIES)) {
+		fprintf(stderr, "at most %d copies of a weak sector\n",
+			MAX_COPIES);
+		exit(1);
+	}
 
-	readdsk( argv[optind], drive, side, sides, tracks );
+	readdsk( argv[optind], &opts );
 
 	return 0;
 
@@ -0,0 +1,370 @@
+/* $Id$
+ *
+ * dskverify.c - Small utility to compare a floppy disk against a CPC disk
+ * image under Linux with a standard PC FDC.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "common.h"
+
+#include <unistd.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <linux/fd.h>
+#include <linux/fdreg.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+
+#define SCAN_EQUAL 0x051	/* SCAN EQUAL, MFM */
+
+/* Options for verifydsk() */
+typedef struct verifyopts_t {
+	int drive;
+	unsigned char side;	/* physical side for single sided images */
+	int readback;		/* compare on the host, never SCAN */
+	int single;		/* one command per sector, no MT */
+	int plan;		/* only plan and estimate the job */
+} Verifyopts;
+
+/* notes:
+ *
+ * SCAN EQUAL has the FDC compare the data sent by the host with a sector on
+ * the disk, nothing is transferred back. With several sectors the command
+ * stops at the first one that matches, so every sector gets a command of
+ * its own. The commands of a track are chained in the order the sectors
+ * pass the head and complete in about one revolution. Many newer
+ * controllers (82077 and later) lack SCAN, they reject it as an invalid
+ * command and we read the sectors back instead.
+ */
+
+int scan_ok = TRUE;
+int differ = 0;
+
+void report(Trackinfo *trackinfo, Sectorinfo *sectorinfo, char *what,
+	unsigned char *reply) {
+
+	differ++;
+	printf("Track %02i side %i sector %02X: %s", trackinfo->track,
+		trackinfo->head, sectorinfo->sector, what);
+	if (reply != NULL)
+		printf(" (disk %02X %02X, image %02X %02X)",
+			reply[1] & ~ST1_EOC, reply[2] & ~(ST2_SEH | ST2_SNS),
+			sectorinfo->err1, sectorinfo->err2);
+	printf("\n");
+}
+
+/* Status of a sector as recorded in an image, FDC flags the scan sets
+ * itself and "end of cylinder" left out */
+int status_differs(Sectorinfo *sectorinfo, unsigned char *reply) {
+
+	return ((reply[1] & ~ST1_EOC) != sectorinfo->err1) ||
+		((reply[2] & ~(ST2_SEH | ST2_SNS)) != sectorinfo->err2);
+}
+
+/* Compare every sector of a track with one command each, chained. Returns
+ * -1 if the FDC does not know SCAN. */
+
+int verify_chain(int fd, Trackinfo *trackinfo, unsigned char *data,
+	unsigned char *buf, int track, unsigned char side, int drive,
+	int scan) {
+
+	int i, err, size;
+	struct floppy_raw_cmd cmds[29];
+	struct floppy_raw_cmd *cur_cmd;
+	Sectorinfo *sectorinfo;
+	unsigned char mask = 0xFF;
+	unsigned char *sect, *got;
+
+	sect = data;
+	got = buf;
+	for (i=0; i<trackinfo->spt; i++) {
+		sectorinfo = &trackinfo->sectorinfo[i];
+		size = sector_size(sectorinfo);
+		cur_cmd = &cmds[i];
+		init_raw_cmd(cur_cmd);
+		cur_cmd->flags = FD_RAW_INTR;
+		if (i != trackinfo->spt-1)
+			cur_cmd->flags |= FD_RAW_MORE;
+		cur_cmd->track = track;
+		cur_cmd->rate  = 2;	/* SD */
+		cur_cmd->length= size;
+
+		/* sectors stored with errors can only be compared by
+		 * their status */
+		if (scan && !sectorinfo->err1 && !sectorinfo->err2) {
+			cur_cmd->flags |= FD_RAW_WRITE;
+			cur_cmd->data = sect;
+			cur_cmd->cmd[cur_cmd->cmd_count++] = SCAN_EQUAL & mask;
+		} else {
+			cur_cmd->flags |= FD_RAW_READ;
+			cur_cmd->data = got;
+			cur_cmd->cmd[cur_cmd->cmd_count++] = READ_DATA & mask;
+		}
+		cur_cmd->cmd[cur_cmd->cmd_count++] = side | drive;
+		cur_cmd->cmd[cur_cmd->cmd_count++] = sectorinfo->track;
+		cur_cmd->cmd[cur_cmd->cmd_count++] = sectorinfo->head;
+		cur_cmd->cmd[cur_cmd->cmd_count++] = sectorinfo->sector;
+		cur_cmd->cmd[cur_cmd->cmd_count++] = sectorinfo->bps;
+		cur_cmd->cmd[cur_cmd->cmd_count++] = sectorinfo->sector;
+		cur_cmd->cmd[cur_cmd->cmd_count++] = trackinfo->gap;
+		/* DTL, or STP for SCAN */
+		cur_cmd->cmd[cur_cmd->cmd_count++] = scan ? 1 : 0xFF;
+
+		sect += sector_len(sectorinfo);
+		got += size;
+	}
+
+	err = fdc_cmd(fd, cmds);
+	if (err < 0) {
+		perror("Error verifying");
+		exit(1);
+	}
+
+	sect = data;
+	got = buf;
+	for (i=0; i<trackinfo->spt; i++) {
+		sectorinfo = &trackinfo->sectorinfo[i];
+		size = sector_size(sectorinfo);
+		cur_cmd = &cmds[i];
+		if ((cur_cmd->reply[0] & ST0_INTR) == 0x80)
+			return -1;
+		if (status_differs(sectorinfo, cur_cmd->reply)) {
+			report(trackinfo, sectorinfo, "status differs",
+				cur_cmd->reply);
+		} else if ((cur_cmd->cmd[0] & 0x1F) == (SCAN_EQUAL & 0x1F)) {
+			if (!(cur_cmd->reply[2] & ST2_SEH))
+				report(trackinfo, sectorinfo, "data differs",
+					NULL);
+		} else if (!sectorinfo->err1 && !sectorinfo->err2 &&
+			!plan_active &&
+			memcmp(got, sect, size < sector_len(sectorinfo) ?
+			size : sector_len(sectorinfo))) {
+			report(trackinfo, sectorinfo, "data differs", NULL);
+		}
+		sect += sector_len(sectorinfo);
+		got += size;
+	}
+	return 0;
+}
+
+/* Compare plain tracks read back with one command, both heads with MT */
+
+int verify_read(int fd, Track *trk, int n, unsigned char *buf, int track,
+	unsigned char side, int drive) {
+
+	static unsigned char want[2*MAX_EDSK_TRACKLEN];
+	Sectorinfo *sectorinfo;
+	unsigned char *got, *sect;
+	int h, j, size, len = 0;
+
+	if (read_sectors(fd, &trk[0].info, buf, track, side >> 2, drive,
+		n == 2))
+		return -1;
+	for (h=0; h<n; h++) {
+		id_order(&trk[h].info, trk[h].data, want + len, TRUE);
+		len += trk[h].len;
+	}
+	if (plan_active || (memcmp(buf, want, len) == 0))
+		return 0;
+
+	/* find the sectors that differ */
+	got = buf;
+	for (h=0; h<n; h++) {
+		sect = trk[h].data;
+		for (j=0; j<trk[h].info.spt; j++) {
+			sectorinfo = &trk[h].info.sectorinfo[j];
+			size = sector_size(sectorinfo);
+			if (memcmp(got + (sectorinfo->sector -
+				first_sector(&trk[h].info)) * size,
+				sect, size))
+				report(&trk[h].info, sectorinfo,
+					"data differs", NULL);
+			sect += sector_len(sectorinfo);
+		}
+		got += trk[h].len;
+	}
+	return 0;
+}
+
+void verifydsk(char *filename, Verifyopts *opts) {
+
+	/* Variable declarations */
+	int fd;
+	unsigned char side = opts->side;
+
+	Image image;
+	Track *trk;
+	static unsigned char buf[2*MAX_EDSK_TRACKLEN];
+	FILE *in;
+	int i, h, n, cyl, lastcyl = -1, mt;
+
+	/* open file */
+	if (strcmp(filename, "-") == 0) {
+		in = stdin;
+	} else {
+		in = fopen(filename, "r");
+		if (in == NULL) {
+			perror("Error opening image file");
+			exit(1);
+		}
+	}
+	read_image(in, &image);
+	if (in != stdin)
+		fclose(in);
+
+	/* open drive */
+	if (opts->plan)
+		plan_begin(stdout);
+	fd = open_drive(opts->drive);
+
+	init( fd, opts->drive );
+
+	for (i=0; i<image.ntracks; i+=n) {
+		cyl = i/image.diskinfo.heads;
+		trk = &image.track[i];
+
+		mt = !opts->single && (image.diskinfo.heads == 2) &&
+			(i % 2 == 0) && (i+1 < image.ntracks) &&
+			mt_layout(&trk[0].info, &trk[1].info, cyl);
+		n = mt ? 2 : 1;
+
+		/* use trackinfo.head to choose physical side for double
+		 * sided images only. */
+		if (image.diskinfo.heads == 2) {
+			side = (trk->info.head == 0) ? 0 : 4;
+		}
+
+		fprintf(stderr, "\rTrack %02i side %i", trk->info.track,
+			side >> 2);
+
+		/* nothing to compare on unformatted tracks */
+		if (trk->info.spt == 0)
+			continue;
+
+		if (cyl != lastcyl)
+			seek(fd, opts->drive, cyl);
+		lastcyl = cyl;
+
+		/* reading back plain tracks takes one command */
+		if ((opts->readback || !scan_ok) && !opts->single &&
+			(mt || standard_layout(&trk->info, cyl)) &&
+			(verify_read(fd, trk, n, buf, cyl, side,
+			opts->drive) == 0))
+			continue;
+
+		for (h=0; h<n; h++) {
+			if (mt)
+				side = h ? 4 : 0;
+			if (verify_chain(fd, &trk[h].info, trk[h].data, buf, cyl,
+				side, opts->drive,
+				scan_ok && !opts->readback) == 0)
+				continue;
+
+			fprintf(stderr, "\nNo SCAN EQUAL, reading back\n");
+			scan_ok = FALSE;
+			verify_chain(fd, &trk[h].info, trk[h].data, buf, cyl,
+				side, opts->drive, FALSE);
+		}
+	}
+	fprintf(stderr, "\n");
+
+	free_image(&image);
+	if (opts->plan) {
+		if (plan_end())
+			exit(1);
+		return;
+	}
+	printf("%i sectors differ\n", differ);
+	if (differ)
+		exit(1);
+}
+
+void help_exit(int exitcode) {
+	fprintf(stderr, "usage: dskverify [options] [b] <filename>\n");
+	fprintf(stderr, "options: -d | --drive <drive>    select drive\n");
+	fprintf(stderr, "         -r | --read             read back instead of SCAN EQUAL\n");
+	fprintf(stderr, "         -1 | --single           one command per sector, also on plain tracks\n");
+	fprintf(stderr, "         -p | --plan             list the FDC commands and estimate time only\n");
+	fprintf(stderr, "         -L | --trace <file>     record all FDC commands to file\n");
+	fprintf(stderr, "         -Y | --replay <file>    take the FDC replies from a recorded trace\n");
+	fprintf(stderr, "         -h                      this help\n");
+	fprintf(stderr, "b compares a single sided image with side B, - reads the image from stdin\n");
+	fprintf(stderr, "exits with 1 if the disk differs from the image\n");
+	exit(exitcode);
+}
+
+int main(int argc, char **argv) {
+
+	static struct option long_options[] = {
+		{"drive", 1, 0, 'd'},
+		{"read", 0, 0, 'r'},
+		{"single", 0, 0, '1'},
+		{"plan", 0, 0, 'p'},
+		{"trace", 1, 0, 'L'},
+		{"replay", 1, 0, 'Y'},
+		{"help", 0, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+	int c;
+	Verifyopts opts;
+
+	memset(&opts, 0, sizeof(opts));
+
+	do {
+		int option_index = 0;
+		c = getopt_long(argc, argv, "d:r1pL:Y:h",
+			long_options, &option_index);
+		switch(c) {
+			case 'h':
+			case '?':
+				help_exit(0);
+				break;
+			case 'd':
+				opts.drive = atoi(optarg);
+				break;
+			case 'r':
+				opts.readback = TRUE;
+				break;
+			case '1':
+				opts.single = TRUE;
+				break;
+			case 'p':
+				opts.plan = TRUE;
+				break;
+			case 'L':
+				trace_begin(optarg, FALSE);
+				break;
+			case 'Y':
+				trace_begin(optarg, TRUE);
+				break;
+		}
+	} while (c != -1);
+
+	if ((argc - optind == 2) && (strcmp(argv[optind],"b")==0)) {
+		opts.side = 4; //Compare with side B
+		optind++;
+	}
+	if ((argc - optind != 1) || (opts.drive < 0) || (opts.drive > 3)) {
+		help_exit(1);
+	}
+
+	verifydsk(argv[optind], &opts);
+
+	return 0;
+
+}
@@ -0,0 +1,464 @@
+/* $Id$
+ *
+ * dskview.c - Offer the disk in a drive as an EDSK image on a local
+ * socket, reading each track only when it is first asked for.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "common.h"
+#include "amsdos.h"
+
+#include <unistd.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define SLOT_DEFAULT (TRACKLEN + 0x100)	/* Track-Info and 9 * 512 bytes */
+#define MAX_REQUEST 0x10000
+
+/* Options for the view */
+typedef struct viewopts_t {
+	int drive;
+	int sides;
+	int tracks;
+	int slot;		/* bytes of every track in the image */
+	int retries;		/* retries per sector that could not be read */
+	char *cachename;	/* keep tracks read in this directory */
+} Viewopts;
+
+/* notes:
+ *
+ * The image is an EDSK whose tracks all take slot bytes, so the offset of
+ * every track is known before any of it has been read: the Disk-Info block
+ * comes first, track n starts at 0x100 + n * slot. A track is read from the
+ * drive the first time a byte of it is asked for, then kept in memory and,
+ * with -c, in a directory named after the hash of the first track and, on
+ * AMSDOS SYSTEM disks, the directory track, so the same disk is not read
+ * again next time. A track found in the cache is only used if a READ ID on
+ * the drive finds one of its IDs. Two disks with the same first and
+ * directory tracks whose other tracks share their IDs can still not be told
+ * apart without reading them, so keep such disks in caches of their own.
+ * When the change line says the disk was changed, the tracks in memory are
+ * dropped and the cache is looked up again. Tracks larger than a slot lose
+ * their last sectors (-s makes the slots larger).
+ *
+ * Clients talk to the socket a line at a time:
+ *
+ *	SIZE			OK <bytes of the image>
+ *	READ <offset> <len>	OK <n>, followed by n bytes of the image
+ *	STAT			OK <tracks read> <tracks in cache> <tracks>
+ *	QUIT			closes the connection
+ *
+ * Anything else gets ERR and a reason.
+ */
+
+/* The disk behind the socket */
+typedef struct view_t {
+	int fd;
+	int unit;
+	int ntracks;		/* tracks * sides */
+	long size;		/* bytes of the image */
+	Diskinfo diskinfo;
+	unsigned char *slot[MAX_TRACKS*MAX_SIDES];	/* NULL until read */
+	char cachedir[PATH_MAX];	/* empty without a cache */
+	int fromdrive;		/* tracks read from the drive */
+	int fromcache;		/* tracks found in the cache */
+	Viewopts *opts;
+	unsigned char scratch[MAX_EDSK_TRACKLEN];
+} View;
+
+/* Read track n from the drive and lay it out as in an EDSK file */
+void view_read(View *view, int n, unsigned char *slot) {
+
+	Viewopts *opts = view->opts;
+	Track trk;
+	int track = n / opts->sides, head = n % opts->sides;
+	int len, bad;
+
+	seek(view->fd, view->unit, track);
+	bad = read_track_data(view->fd, &trk, track, head, view->unit,
+		view->scratch, FALSE, opts->retries, NULL);
+
+	/* drop the sectors that do not fit */
+	len = trk.len;
+	while (sizeof(Trackinfo) + len > opts->slot) {
+		trk.info.spt--;
+		len -= sector_len(&trk.info.sectorinfo[trk.info.spt]);
+	}
+	if (len < trk.len)
+		fprintf(stderr, "Track %i side %i: %i bytes do not fit, use "
+			"-s\n", track, head, trk.len - len);
+
+	memset(slot, 0, opts->slot);
+	memcpy(slot, &trk.info, sizeof(Trackinfo));
+	memcpy(slot + sizeof(Trackinfo), trk.data, len);
+	free(trk.data);
+
+	fprintf(stderr, "Track %i side %i read, %i sectors", track, head,
+		trk.info.spt);
+	if (bad)
+		fprintf(stderr, ", %i bad", bad);
+	fprintf(stderr, "\n");
+}
+
+/* Keep track n in the cache directory */
+void view_save(View *view, int n) {
+
+	char path[PATH_MAX];
+	FILE *file;
+
+	snprintf(path, sizeof(path), "%s/%03i", view->cachedir, n);
+	file = fopen(path, "w");
+	if ((file == NULL) ||
+		(fwrite(view->slot[n], 1, view->opts->slot, file) !=
+		view->opts->slot) || (fclose(file) != 0))
+		perror(path);
+}
+
+/* TRUE if a READ ID on the drive finds an ID of the cached track n */
+int view_check(View *view, int n, unsigned char *slot) {
+
+	Trackinfo *info = (Trackinfo *) slot;
+	Sectorinfo *s;
+	unsigned char chrn[4];
+	int track = n / view->opts->sides, head = n % view->opts->sides;
+	int i;
+
+	seek(view->fd, view->unit, track);
+	if (read_id(view->fd, track, head, view->unit, chrn) < 0)
+		return info->spt == 0;
+	for (i=0; i<info->spt; i++) {
+		s = &info->sectorinfo[i];
+		if ((s->track == chrn[0]) && (s->head == chrn[1]) &&
+			(s->sector == chrn[2]) && (s->bps == chrn[3]))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* The bytes of track n, from memory, the cache or the drive */
+unsigned char *view_track(View *view, int n) {
+
+	char path[PATH_MAX];
+	unsigned char *slot;
+	FILE *file;
+	int size = view->opts->slot;
+
+	if (view->slot[n] != NULL)
+		return view->slot[n];
+	slot = malloc(size);
+	if (slot == NULL) {
+		myabort("Error: Out of memory\n");
+	}
+
+	if (view->cachedir[0]) {
+		snprintf(path, sizeof(path), "%s/%03i", view->cachedir, n);
+		file = fopen(path, "r");
+		if (file != NULL) {
+			if ((fread(slot, 1, size, file) == size) &&
+				view_check(view, n, slot)) {
+				fclose(file);
+				view->fromcache++;
+				view->slot[n] = slot;
+				return slot;
+			}
+			fclose(file);
+			fprintf(stderr, "Track %i side %i is not the cached one\n",
+				n / view->opts->sides, n % view->opts->sides);
+		}
+	}
+
+	view_read(view, n, slot);
+	view->fromdrive++;
+	view->slot[n] = slot;
+	if (view->cachedir[0])
+		view_save(view, n);
+	return slot;
+}
+
+/* Copy len bytes of the image from off on, returns how many there were */
+long view_bytes(View *view, long off, long len, unsigned char *buf) {
+
+	long done = 0, n, in;
+	int slot = view->opts->slot, t;
+
+	if (off >= view->size)
+		return 0;
+	if (off + len > view->size)
+		len = view->size - off;
+	while (done < len) {
+		if (off < sizeof(Diskinfo)) {
+			n = sizeof(Diskinfo) - off;
+			if (n > len - done)
+				n = len - done;
+			memcpy(buf + done, (unsigned char *) &view->diskinfo +
+				off, n);
+		} else {
+			t = (off - sizeof(Diskinfo)) / slot;
+			in = (off - sizeof(Diskinfo)) % slot;
+			n = slot - in;
+			if (n > len - done)
+				n = len - done;
+			memcpy(buf + done, view_track(view, t) + in, n);
+		}
+		done += n;
+		off += n;
+	}
+	return done;
+}
+
+/* Find the cache directory of the disk in the drive, named after the first
+ * track and the directory track of SYSTEM disks, both read from the drive */
+void view_key(View *view) {
+
+	Viewopts *opts = view->opts;
+	char dir[PATH_MAX];
+	unsigned int hash;
+	Amsdos amsdos;
+	int dirtrack = 0;
+
+	view->cachedir[0] = 0;
+	hash = fnv1a(FNV_INIT, view_track(view, 0), opts->slot);
+	if (amsdos_init(&amsdos, (Trackinfo *) view->slot[0], opts->tracks))
+		dirtrack = amsdos_dirtrack(&amsdos) * opts->sides;
+	if (dirtrack >= view->ntracks)
+		dirtrack = 0;
+	if (dirtrack)
+		hash = fnv1a(hash, view_track(view, dirtrack), opts->slot);
+
+	snprintf(dir, sizeof(dir), "%s/%08x-%i-%i-%i", opts->cachename, hash,
+		opts->tracks, opts->sides, opts->slot);
+	if ((mkdir(dir, 0755) < 0) && (errno != EEXIST)) {
+		perror(dir);
+		exit(1);
+	}
+	strcpy(view->cachedir, dir);
+	view_save(view, 0);
+	if (dirtrack)
+		view_save(view, dirtrack);
+	fprintf(stderr, "Cache %s\n", dir);
+}
+
+/* Forget the tracks of the disk that was taken out */
+void view_changed(View *view) {
+
+	int i;
+
+	for (i=0; i<view->ntracks; i++) {
+		free(view->slot[i]);
+		view->slot[i] = NULL;
+	}
+	fprintf(stderr, "Disk changed\n");
+	if (view->opts->cachename != NULL)
+		view_key(view);
+}
+
+void view_open(View *view, Viewopts *opts) {
+
+	int i;
+
+	memset(view, 0, sizeof(*view));
+	view->opts = opts;
+	view->unit = opts->drive & 3;
+	view->ntracks = opts->tracks * opts->sides;
+	view->size = sizeof(Diskinfo) + (long) view->ntracks * opts->slot;
+	view->fd = open_drive(opts->drive);
+	init(view->fd, opts->drive);
+
+	memcpy(view->diskinfo.magic, MAGIC_EDISK_WRITE,
+		sizeof(view->diskinfo.magic));
+	strncpy((char *) view->diskinfo.unused1, CREATOR,
+		sizeof(view->diskinfo.unused1));
+	view->diskinfo.tracks = opts->tracks;
+	view->diskinfo.heads = opts->sides;
+	for (i=0; i<view->ntracks; i++)
+		view->diskinfo.tracklenhigh[i] = opts->slot >> 8;
+
+	if (opts->cachename != NULL) {
+		if ((mkdir(opts->cachename, 0755) < 0) && (errno != EEXIST)) {
+			perror(opts->cachename);
+			exit(1);
+		}
+		view_key(view);
+	}
+}
+
+/* Answer the requests of one client until it goes away */
+void view_serve(View *view, int client) {
+
+	static unsigned char buf[MAX_REQUEST];
+	char line[256];
+	long off, len, n;
+	FILE *in, *out;
+
+	in = fdopen(client, "r");
+	out = fdopen(dup(client), "w");
+	if ((in == NULL) || (out == NULL)) {
+		perror("Error opening connection");
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), in) != NULL) {
+		if (strncmp(line, "SIZE", 4) == 0) {
+			fprintf(out, "OK %li\n", view->size);
+		} else if (strncmp(line, "READ", 4) == 0) {
+			if ((sscanf(line + 4, "%li %li", &off, &len) != 2) ||
+				(off < 0) || (len < 0) || (len > MAX_REQUEST)) {
+				fprintf(out, "ERR bad request\n");
+			} else {
+				if (disk_changed(view->fd, view->unit))
+					view_changed(view);
+				n = view_bytes(view, off, len, buf);
+				fprintf(out, "OK %li\n", n);
+				fwrite(buf, 1, n, out);
+			}
+		} else if (strncmp(line, "STAT", 4) == 0) {
+			fprintf(out, "OK %i %i %i\n", view->fromdrive,
+				view->fromcache, view->ntracks);
+		} else if (strncmp(line, "QUIT", 4) == 0) {
+			break;
+		} else {
+			fprintf(out, "ERR unknown command\n");
+		}
+		if (fflush(out) != 0)
+			break;
+	}
+	fclose(in);
+	fclose(out);
+}
+
+void view_run(View *view, char *name) {
+
+	struct sockaddr_un addr;
+	int sock, client;
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("Error creating socket");
+		exit(1);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, name, sizeof(addr.sun_path) - 1);
+	unlink(name);
+	if ((bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) ||
+		(listen(sock, 4) < 0)) {
+		perror(name);
+		exit(1);
+	}
+	fprintf(stderr, "Serving a %li byte EDSK image on %s\n", view->size,
+		name);
+
+	/* one client at a time, the drive can only do one thing anyway */
+	while ((client = accept(sock, NULL, NULL)) >= 0)
+		view_serve(view, client);
+	perror("Error accepting connection");
+	close(sock);
+	unlink(name);
+}
+
+void help_exit(int exitcode) {
+	fprintf(stderr, "usage: dskview [options] <socket>\n");
+	fprintf(stderr, "options: -d | --drive <drive>    select drive\n");
+	fprintf(stderr, "         -S | --sides <sides>    number of sides\n");
+	fprintf(stderr, "         -t | --tracks <tracks>  number of tracks\n");
+	fprintf(stderr, "         -s | --slot <bytes>     bytes per track in the image, default %i\n",
+		SLOT_DEFAULT);
+	fprintf(stderr, "         -c | --cache <dir>      keep the tracks read in dir\n");
+	fprintf(stderr, "         -T | --retries <n>      retries of a sector that can not be read\n");
+	fprintf(stderr, "         -h                      this help\n");
+	fprintf(stderr, "clients send SIZE, READ <offset> <length>, STAT or QUIT lines\n");
+	exit(exitcode);
+}
+
+int main(int argc, char **argv) {
+
+	static struct option long_options[] = {
+		{"drive", 1, 0, 'd'},
+		{"sides", 1, 0, 'S'},
+		{"tracks", 1, 0, 't'},
+		{"slot", 1, 0, 's'},
+		{"cache", 1, 0, 'c'},
+		{"retries", 1, 0, 'T'},
+		{"help", 0, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+	static View view;
+	int c;
+	Viewopts opts;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.sides = 1;
+	opts.tracks = 40;
+	opts.slot = SLOT_DEFAULT;
+	opts.retries = 10;
+
+	do {
+		int option_index = 0;
+		c = getopt_long(argc, argv, "d:S:t:s:c:T:h",
+			long_options, &option_index);
+		switch(c) {
+			case 'h':
+			case '?':
+				help_exit(0);
+				break;
+			case 'd':
+				opts.drive = atoi(optarg);
+				break;
+			case 'S':
+				opts.sides = atoi(optarg);
+				break;
+			case 't':
+				opts.tracks = atoi(optarg);
+				break;
+			case 's':
+				opts.slot = strtol(optarg, NULL, 0);
+				break;
+			case 'c':
+				opts.cachename = optarg;
+				break;
+			case 'T':
+				opts.retries = atoi(optarg);
+				break;
+		}
+	} while (c != -1);
+
+	/* EDSK track sizes are multiples of 256 */
+	opts.slot = (opts.slot + 0xFF) & ~0xFF;
+	if ((argc - optind != 1) ||
+		(opts.drive < 0) || (opts.drive >= MAX_DRIVES) ||
+		(opts.sides < 1) || (opts.sides > MAX_SIDES) ||
+		(opts.tracks < 1) || (opts.tracks > MAX_TRACKS) ||
+		(opts.slot < sizeof(Trackinfo)) ||
+		(opts.slot > sizeof(Trackinfo) + MAX_EDSK_TRACKLEN)) {
+		help_exit(1);
+	}
+
+	/* a client going away must not end the view */
+	signal(SIGPIPE, SIG_IGN);
+
+	view_open(&view, &opts);
+	view_run(&view, argv[optind]);
+
+	return 0;
+
+}
@@ -20,8 +20,10 @@
  */
 
 #include "common.h"
+#include "amsdos.h"
 
 #include <unistd.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -32,256 +34,514 @@
 #include <sys/time.h>
 #include <fcntl.h>
 
-#define MAX_RETRY 20
-
-/* notes:
- *
- * the C (track),H (head),R (sector id),N (sector size) parameters in the
- * sector id field do not need to be the same as the physical track and
- * physical side.
- */
-
-void format_track(int fd, int track, Trackinfo *trackinfo, unsigned char side) {
-
-	int i, err;
-	struct floppy_raw_cmd raw_cmd;
-	format_map_t data[20];		//FIXME
-	unsigned char mask = 0xFF;
-	Sectorinfo *sectorinfo;
-
-	sectorinfo = trackinfo->sectorinfo;
-	for (i=0; i<trackinfo->spt; i++) {
-		//data[i].sector = 0xC1+i;
-		//data[i].size = 2;	/* 0=128, 1=256, 2=512,... */
-		data[i].sector = sectorinfo->sector;
-		data[i].size = sectorinfo->bps;
-		data[i].cylinder = sectorinfo->track;
-		data[i].head = sectorinfo->head;
-		sectorinfo++;
-	}
-	//fprintf(stderr, "Formatting Track %i\n", track);
-	init_raw_cmd(&raw_cmd);
-	raw_cmd.flags = FD_RAW_WRITE | FD_RAW_INTR;
-	raw_cmd.flags |= FD_RAW_NEED_SEEK;
-	raw_cmd.track = track;
-	raw_cmd.rate  = 2;	/* SD */
-	//raw_cmd.length= 512;	/* Sectorsize */
-	raw_cmd.length= (128<<(trackinfo->bps));
-	raw_cmd.data  = data;
-
-	raw_cmd.cmd[raw_cmd.cmd_count++] = FD_FORMAT & mask;
-	raw_cmd.cmd[raw_cmd.cmd_count++] = side;	/* head: 4 or 0 */
-	//raw_cmd.cmd[raw_cmd.cmd_count++] = 2;	/* sectorsize */
-	//raw_cmd.cmd[raw_cmd.cmd_count++] = 9;	/* sectors */
-	//raw_cmd.cmd[raw_cmd.cmd_count++] = 82;/* GAP */
-	//raw_cmd.cmd[raw_cmd.cmd_count++] = 0;	/* filler */
-	raw_cmd.cmd[raw_cmd.cmd_count++] = trackinfo->bps;	/* sectorsize */
-	raw_cmd.cmd[raw_cmd.cmd_count++] = trackinfo->spt;	/* sectors */
-	raw_cmd.cmd[raw_cmd.cmd_count++] = trackinfo->gap;	/* GAP */
-	raw_cmd.cmd[raw_cmd.cmd_count++] = trackinfo->fill;	/* filler */
-	err = ioctl(fd, FDRAWCMD, &raw_cmd);
-	if (err < 0) {
-		perror("Error formatting");
-		exit(1);
-	}
-	if (raw_cmd.reply[0] & 0x40) {
-		fprintf(stderr, "Could not format track %i\n", track);
-		exit(1);
+/* Options for writedsk() */
+typedef struct writeopts_t {
+	unsigned char side;	/* physical side for single sided images */
+	int plan;		/* only plan and estimate the job */
+	int keepgap;		/* use the gaps of the image as they are */
+	int interleave;		/* sector interleave of standard tracks */
+	int skew;		/* sectors skewed per track, -1 measures */
+	int sideskew;		/* sectors skewed for side 1, -1 measures */
+	int single;		/* one command per sector, no MT */
+	int amsdos;		/* write only the live sectors of AMSDOS disks */
+	int realtime;		/* real time mode, see realtime_begin() */
+	int drives[MAX_DRIVES];	/* drives to write copies to */
+	int ndrives;
+	int block;		/* plain tracks through the block device */
+} Writeopts;
+
+/* Write the sectors of a plain track given by live (trackinfo order), each
+ * run of consecutive sector numbers with one command. data is in sector
+ * number order. */
+
+int write_runs(int fd, Trackinfo *trackinfo, unsigned char *data,
+	unsigned int live, unsigned char side, int gpl) {
+
+	Trackinfo run;
+	unsigned int bynum = 0;
+	int j, start, low, size;
+
+	low = first_sector(trackinfo);
+	size = sector_size(&trackinfo->sectorinfo[0]);
+	for (j=0; j<trackinfo->spt; j++)
+		if (live & (1 << j))
+			bynum |= 1 << (trackinfo->sectorinfo[j].sector - low);
+
+	run = *trackinfo;
+	for (j=0; j<trackinfo->spt; ) {
+		if (!(bynum & (1 << j))) {
+			j++;
+			continue;
+		}
+		for (start=j; (j<trackinfo->spt) && (bynum & (1 << j)); j++)
+			;
+		run.spt = j - start;
+		run.sectorinfo[0].sector = low + start;
+		if (write_sectors(fd, &run, data + start*size, side, gpl,
+			FALSE))
+			return -1;
 	}
+	return 0;
 }
 
-/* notes:
- *
- * when writing, you must specify the sector c,h,r,n exactly, otherwise fdc
- * will fail to write data to sector.
- */
+/* Find the blocks in use from the directory in the image. Returns FALSE if
+ * it is not a single sided AMSDOS DATA or SYSTEM image. */
 
-//void write_sect(int fd, int track, unsigned char sector, unsigned char *data) {
-void write_sect(int fd, Trackinfo *trackinfo, Sectorinfo *sectorinfo,
-	unsigned char *data, unsigned char side) {
+int amsdos_image(Image *image, Amsdos *amsdos) {
 
-	int i, err;
-	struct floppy_raw_cmd raw_cmd;
-	//format_map_t data[9];
-	unsigned char mask = 0xFF;
+	unsigned char dir[AMSDOS_SPT * 512];
+	Track *trk;
+	int dirtrack, live;
 
-	init_raw_cmd(&raw_cmd);
-	raw_cmd.flags = FD_RAW_WRITE | FD_RAW_INTR;
-	raw_cmd.flags |= FD_RAW_NEED_SEEK;
+	if ((image->diskinfo.heads != 1) ||
+		!amsdos_init(amsdos, &image->track[0].info,
+		image->diskinfo.tracks)) {
+		fprintf(stderr, "Not an AMSDOS DATA or SYSTEM image, "
+			"writing everything\n");
+		return FALSE;
+	}
+	dirtrack = amsdos_dirtrack(amsdos);
+	trk = &image->track[dirtrack];
+	if ((dirtrack >= image->ntracks) ||
+		!standard_layout(&trk->info, dirtrack) ||
+		(trk->info.spt != AMSDOS_SPT) ||
+		(first_sector(&trk->info) != amsdos->base)) {
+		fprintf(stderr, "No AMSDOS directory on track %i, "
+			"writing everything\n", dirtrack);
+		return FALSE;
+	}
+	id_order(&trk->info, trk->data, dir, TRUE);
 
-	raw_cmd.track = sectorinfo->track;
-	raw_cmd.rate  = 2;	/* SD */
-	raw_cmd.length= (128<<(sectorinfo->bps)); /* Sectorsize */
-	raw_cmd.data  = data;
+	live = amsdos_scan_dir(amsdos, dir);
+	fprintf(stderr, "AMSDOS %s format, %i directory entries, "
+		"%i blocks in use\n", (amsdos->base == OFF_DAT) ?
+		"DATA" : "SYSTEM", live, amsdos->nused);
+	return TRUE;
+}
 
-	if (sectorinfo->unused1 & 0x040)
-	{
-		/* "write deleted data" (totally untested!) */
-		raw_cmd.cmd[raw_cmd.cmd_count++] = FD_WRITE_DEL & mask;
-	}
-	else
-	{
-		/* "write data" */
-		raw_cmd.cmd[raw_cmd.cmd_count++] = FD_WRITE & mask;
+/* Check every track of the image before anything is written, so that an
+ * impossible layout does not stop the job halfway through the disk.
+ * Returns the number of tracks that can not be written. */
+int check_image(Image *image, Writeopts *opts) {
+
+	Trackinfo *trackinfo;
+	int i, gap, gpl, bad = 0;
+
+	for (i=0; i<image->ntracks; i++) {
+		trackinfo = &image->track[i].info;
+		if (opts->keepgap) {
+			gap = trackinfo->gap;
+			if (track_fits(trackinfo, gap))
+				continue;
+		} else {
+			if (compute_gap(trackinfo, &gap, &gpl) >= 0)
+				continue;
+		}
+		bad++;
+		if (plan_active) {
+			plan_error("track %i side %i needs %i bytes\n",
+				trackinfo->track, trackinfo->head,
+				track_bytes(trackinfo, gap));
+		} else {
+			fprintf(stderr, "Track %i side %i needs %i bytes\n",
+				trackinfo->track, trackinfo->head,
+				track_bytes(trackinfo, gap));
+		}
 	}
+	return bad;
+}
 
-	// these parameters are same for "write data" and "write deleted data".
-	raw_cmd.cmd[raw_cmd.cmd_count++] = side;		/* head */
-	raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->track;	/* track */
-	raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->head;	/* head */
-	raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->sector;	/* sector */
-	raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->bps;	/* sectorsize */
-	raw_cmd.cmd[raw_cmd.cmd_count++] = sectorinfo->sector;	/* sector */
-	raw_cmd.cmd[raw_cmd.cmd_count++] = trackinfo->gap;	/* GPL */
-	raw_cmd.cmd[raw_cmd.cmd_count++] = 0xFF;		/* DTL */
+/* One copy of the image being written to one drive */
+typedef struct copy_t {
+	int drive;		/* /dev/fd<drive> */
+	int unit;		/* unit number on its controller */
+	int fd;
+	int bfd;		/* block device, -1 if not used */
+	int base;		/* sector base the block device was set up for */
+	long steptime;
+	long switchtime;
+	Image *image;
+	Amsdos *ams;		/* NULL writes every sector */
+	Writeopts *opts;
+	unsigned char wbuf[2*MAX_TRACKLEN];
+} Copy;
+
+void write_copy(Copy *copy) {
+
+	Image *image = copy->image;
+	Writeopts *opts = copy->opts;
+	FILE *log = stderr;
+	int fd = copy->fd, unit = copy->unit;
+	unsigned char side = opts->side;
+	unsigned char *wbuf = copy->wbuf;
+
+	Trackinfo trackinfo[2];
+	Sectorinfo *sectorinfo;
+	unsigned char *sect;
+	int i, j, h, n, cyl, gap, gpl, room;
+	int order[29], *porder, skew, sideskew, mt, multi, block, len;
+	unsigned int live, all;
 
-	char ok=0, retry=0;
+	/*fprintf(stderr, "writing Track: ");*/
+	for (i=0; i<image->ntracks; i+=n) {
+		cyl = i/image->diskinfo.heads;
+
+		/* both heads of a plain IBM style cylinder are written with
+		 * one MT command after formatting them */
+		mt = !opts->single && (image->diskinfo.heads == 2) &&
+			(i % 2 == 0) && (i+1 < image->ntracks) &&
+			mt_layout(&image->track[i].info,
+				&image->track[i+1].info, cyl);
+		n = mt ? 2 : 1;
+
+		for (h=0; h<n; h++) {
+			trackinfo[h] = image->track[i+h].info;
+
+			/* shrink GAP3 where the track would not fit
+			 * otherwise */
+			if (opts->keepgap) {
+				gpl = trackinfo[h].gap;
+			} else {
+				room = compute_gap(&trackinfo[h], &gap, &gpl);
+				trackinfo[h].gap = gap;
+			}
+
+			/* use trackinfo.head to choose physical side for
+			 * double sided images only. */
+			if (image->diskinfo.heads == 2) {
+				side = (trackinfo[h].head == 0) ? 0 : 4;
+			}
+
+			printtrackinfo(log, &trackinfo[h]);
+			if (!opts->keepgap)
+				fprintf(log, " %X+%i", gpl, room);
+
+			/* reorder the sectors of plain tracks, leave others
+			 * alone */
+			porder = NULL;
+			if ((opts->interleave > 1 || opts->skew ||
+				opts->sideskew) &&
+				standard_layout(&trackinfo[h], cyl)) {
+				skew = opts->skew;
+				if (skew < 0)
+					skew = skew_for(&trackinfo[h],
+						copy->steptime);
+				sideskew = opts->sideskew;
+				if (sideskew < 0)
+					sideskew = skew_for(&trackinfo[h],
+						copy->switchtime);
+				interleave_sectors(&trackinfo[h], order,
+					opts->interleave,
+					cyl * skew + (side ? sideskew : 0));
+				porder = order;
+			}
+
+			/* format track */
+			format_track(fd, cyl, &trackinfo[h], side | unit,
+				porder);
+			if (h < n-1)
+				fprintf(log, "\n");
+		}
 
-	do {
-		err = ioctl(fd, FDRAWCMD, &raw_cmd);
-		if (err < 0) {
-			perror("Error writing");
-			exit(1);
+		/* sectors of AMSDOS disks that no file uses, or that were not
+		 * read from the original, keep what the format wrote */
+		all = (1 << trackinfo[0].spt) - 1;
+		live = all;
+		if (copy->ams)
+			live = amsdos_live(copy->ams, &trackinfo[0], cyl) &
+				~get_unread(&trackinfo[0]);
+
+		/* plain DATA and SYSTEM tracks are written by the floppy
+		 * driver */
+		block = (copy->bfd >= 0) && !mt && (live == all) &&
+			(block_layout(&trackinfo[0], cyl,
+			i % image->diskinfo.heads) == copy->base) &&
+			(image->track[i].len == SPT * 512);
+		if (block) {
+			id_order(&trackinfo[0], image->track[i].data, wbuf,
+				TRUE);
+			if (block_io(copy->bfd, wbuf, cyl,
+				i % image->diskinfo.heads,
+				image->diskinfo.heads, 1, TRUE))
+				block = FALSE;
 		}
-		if (raw_cmd.reply[0] & 0x40) {
-			retry++;
-			if (retry>MAX_RETRY) ok=1;
-			recalibrate(fd, 0); //Force the head to move again
+
+		/* write plain tracks with one command, others and tracks
+		 * where that failed sector by sector */
+		multi = !block && (mt || (!opts->single &&
+			standard_layout(&trackinfo[0], cyl)));
+		if (multi && live) {
+			len = 0;
+			for (h=0; h<n; h++) {
+				id_order(&trackinfo[h], image->track[i+h].data,
+					wbuf + len, TRUE);
+				len += image->track[i+h].len;
+			}
+			if (live != all) {
+				if (write_runs(fd, &trackinfo[0], wbuf, live,
+					side | unit, gpl))
+					multi = FALSE;
+			} else if (write_sectors(fd, &trackinfo[0], wbuf,
+				(mt ? 0 : side) | unit, gpl, mt))
+				multi = FALSE;
 		}
-		else ok=1;
-	} while (ok==0);
 
-	if (retry>MAX_RETRY)
-		fprintf(stderr, "Could not write sector %0X\n",
-			sectorinfo->sector);
+		fprintf(log, " [");
+		for (h=0; h<n; h++) {
+			sect = image->track[i+h].data;
+			sectorinfo = trackinfo[h].sectorinfo;
+			if (mt)
+				side = h ? 4 : 0;
+			for (j=0; j<trackinfo[h].spt; j++) {
+				if ((h == 0) && !(live & (1 << j))) {
+					fprintf(log, "%0X- ",
+						sectorinfo->sector);
+				} else if (block) {
+					fprintf(log, "%0X= ",
+						sectorinfo->sector);
+				} else if (multi) {
+					fprintf(log, "%0X+ ",
+						sectorinfo->sector);
+				} else {
+					fprintf(log, "%0X ",
+						sectorinfo->sector);
+					write_sect(fd, sectorinfo, sect,
+						side | unit, gpl);
+				}
+				sect += sector_len(sectorinfo);
+				sectorinfo++;
+			}
+		}
+		fprintf(log, "]\n");
+		realtime_track();
+	}
 }
 
-void writedsk(char *filename, unsigned char side) {
+void writedsk(char *filename, Writeopts *opts) {
 
 	/* Variable declarations */
-	int fd, tmp, err;
-	char *drive;
-	struct floppy_raw_cmd raw_cmd;
-	//char buffer[ 512 * 2 * 24 ];
-	//char buffer[ 512 * 9 ];
-	char buffer[ 9 * sizeof(format_map_t) ];
-	format_map_t *data;
-
-	Diskinfo diskinfo;
-	Trackinfo trackinfo;
-	Sectorinfo *sectorinfo, **sectorinfos;
-	unsigned char track[MAX_TRACKLEN], *sect;
-	int tracklen;
+	static Copy copies[MAX_DRIVES];
+	Copy *copy;
+	Image image;
 	FILE *in;
-	int i, j, count;
-	char *magic_disk = MAGIC_DISK;
-	char *magic_edisk = MAGIC_EDISK;
-	char *magic_track = MAGIC_TRACK;
-	char flag_edisk = FALSE;	// indicates extended disk image format
-
-	/* initialization */
-	drive = "/dev/fd0";
-
-	/* open drive */
-	fd = open( drive, O_ACCMODE | O_NDELAY);
-	if ( fd < 0 ){
-		perror("Error opening floppy device");
-		exit(1);
-	}
+	int i, amsdos;
+	Amsdos ams;
 
 	/* open file */
-	in = fopen(filename, "r");
-	if (in == NULL) {
-		perror("Error opening image file");
-		exit(1);
-	}
-
-	init( fd, 0 );
-
-	/* read disk info, detect extended image */
-	count = fread(&diskinfo, 1, sizeof(diskinfo), in);
-	if (count != sizeof(diskinfo)) {
-		myabort("Error reading Disk-Info: File to short\n");
-	}
-	if (strncmp(diskinfo.magic, magic_disk, strlen(magic_disk))) {
-		if (strncmp(diskinfo.magic, magic_edisk, strlen(magic_edisk))) {
-			myabort("Error reading Disk-Info: Invalid Disk-Info\n");
+	if (strcmp(filename, "-") == 0) {
+		in = stdin;
+	} else {
+		in = fopen(filename, "r");
+		if (in == NULL) {
+			perror("Error opening image file");
+			exit(1);
 		}
-		flag_edisk = TRUE;
 	}
-	printdiskinfo(stderr, &diskinfo);
-
-	/* Get tracklen for normal disk images */
-	tracklen = (diskinfo.tracklen[0] + diskinfo.tracklen[1]*256) - 0x100;
 
-	/*fprintf(stderr, "writing Track: ");*/
-	for (i=0; i<diskinfo.tracks * diskinfo.heads; i++) {
-		/* read in track */
-		/*fprintf(stderr, "%2.2i ",i);
-		fflush(stderr);*/
-		if (flag_edisk) tracklen = diskinfo.tracklenhigh[i]*256 - 0x100;
-		if (tracklen > MAX_TRACKLEN) {
-			myabort("Error: Track to long.\n");
-		}
+	/* read the whole image, and reject it before touching the disk if
+	 * some track can not be written */
+	read_image(in, &image);
+	if (in != stdin)
+		fclose(in);
+	printdiskinfo(stderr, &image.diskinfo);
+
+	if (opts->plan)
+		plan_begin(stdout);
+	if (check_image(&image, opts) && !opts->plan) {
+		myabort("Error: Image layout does not fit on disk\n");
+	}
 
-		/* read trackinfo */
-		memset(&trackinfo, 0, sizeof(trackinfo));
-		count = fread(&trackinfo, 1, sizeof(trackinfo), in);
-		if (count != sizeof(trackinfo)) {
-			myabort("Error reading Track-Info: File to short\n");
-		}
-		if (strncmp(trackinfo.magic, magic_track, strlen(magic_track)))
-			myabort("Error reading Track-Info: Invalid Track-Info\n");
-
-		/* when 10 sectors per track should be written and gap size
- 		 * greater 0x38 is given, reduce gap size to 0x2a to
-		 * make it work. */
-		if ((trackinfo.spt == 10) && (trackinfo.gap > 0x38)) {
-			trackinfo.gap = 0x2a;
+	/* protected disks are written completely unless asked otherwise */
+	amsdos = opts->amsdos && amsdos_image(&image, &ams);
+
+	/* the image is parsed once and shared by all copies */
+	for (i=0; i<opts->ndrives; i++) {
+		copy = &copies[i];
+		copy->drive = opts->drives[i];
+		copy->unit = copy->drive & 3;
+		copy->image = &image;
+		copy->ams = amsdos ? &ams : NULL;
+		copy->opts = opts;
+
+		/* open drive */
+		copy->fd = open_drive(copy->drive);
+
+		init( copy->fd, copy->drive );
+
+		/* plain DATA and SYSTEM images, judged by the first track,
+		 * go through the block device where they can */
+		copy->bfd = -1;
+		copy->base = 0;
+		if (opts->block && !opts->side)
+			copy->base = block_layout(&image.track[0].info, 0, 0);
+		if (copy->base)
+			copy->bfd = block_open(copy->fd, copy->drive,
+				copy->base, image.diskinfo.tracks,
+				image.diskinfo.heads, TRUE);
+		if (opts->block && (copy->bfd < 0))
+			fprintf(stderr, "Drive %i not using the block device\n",
+				copy->drive);
+
+		/* skew to cover stepping to the next track, and the time it
+		 * takes to issue the next command after a head switch */
+		if ((opts->skew < 0) || (opts->sideskew < 0)) {
+			copy->steptime = seek_time(copy->fd, copy->unit);
+			copy->switchtime = switch_time(copy->fd, copy->unit);
+			fprintf(stderr, "Drive %i step time %lims, head switch "
+				"%lius\n", copy->drive, copy->steptime / 1000,
+				copy->switchtime);
 		}
+	}
 
-		/* use trackinfo.head to choose physical side for double
-		 * sided images only. */
-		if (diskinfo.heads == 2) {
-			side = (trackinfo.head == 0) ? 0 : 4;
-		}
+	if (opts->realtime) {
+		realtime_begin();
+		for (i=0; i<opts->ndrives; i++)
+			realtime_prefault(copies[i].wbuf,
+				sizeof(copies[i].wbuf));
+	}
 
-		printtrackinfo(stderr, &trackinfo);
-
-		/* read track */
-		count = fread(track, 1, tracklen, in);
-		if (count != tracklen)
-			myabort("Error reading Track: File to short\n");
-
-		/* format track */
-		format_track(fd, i/diskinfo.heads, &trackinfo, side);
-
-		/* write track */
-		sect = track;
-		sectorinfo = trackinfo.sectorinfo;
-		fprintf(stderr, " [");
-		for (j=0; j<trackinfo.spt; j++) {
-			fprintf(stderr, "%0X ", sectorinfo->sector);
-			write_sect(fd, &trackinfo, sectorinfo, sect, side);
-			sectorinfo++;
-			sect += (128<<trackinfo.bps);
-		}
-		fprintf(stderr, "]\n");
+	/* the copies are written one after the other: the floppy driver
+	 * runs one raw command at a time for all controllers, a SEEK until
+	 * its interrupt included, so drives can not step while another
+	 * transfers */
+	for (i=0; i<opts->ndrives; i++) {
+		if (opts->ndrives > 1)
+			fprintf(stderr, "Drive %i\n", copies[i].drive);
+		write_copy(&copies[i]);
 	}
 	fprintf(stderr,"\n");
+	realtime_end();
 
+	for (i=0; i<opts->ndrives; i++) {
+		if (copies[i].bfd >= 0)
+			block_close(copies[i].fd, copies[i].bfd);
+		if (!opts->plan)
+			close(copies[i].fd);
+	}
+	free_image(&image);
+	if (opts->plan && plan_end())
+		exit(1);
+}
+
+void help_exit(int exitcode) {
+	fprintf(stderr, "usage: dskwrite [options] [b] <filename>\n");
+	fprintf(stderr, "options: -d | --drive <n>        write to /dev/fd<n>, repeat for copies\n");
+	fprintf(stderr, "         -g | --keep-gap         use the gaps of the image unchanged\n");
+	fprintf(stderr, "         -i | --interleave <n>   sector interleave\n");
+	fprintf(stderr, "         -k | --skew <n|auto>    sectors skewed from track to track, default 0\n");
+	fprintf(stderr, "         -K | --side-skew <n|auto> sectors skewed on side 1, default 0\n");
+	fprintf(stderr, "         -1 | --single           one command per sector, also on plain tracks\n");
+	fprintf(stderr, "         -a | --amsdos           write only sectors AMSDOS files use\n");
+	fprintf(stderr, "         -x | --realtime         lock memory, real time priority, quiet tracks\n");
+	fprintf(stderr, "         -B | --block            write plain DATA/SYSTEM tracks through the block device\n");
+	fprintf(stderr, "         -L | --trace <file>     record all FDC commands to file\n");
+	fprintf(stderr, "         -Y | --replay <file>    take the FDC replies from a recorded trace\n");
+	fprintf(stderr, "         -p | --plan             list the FDC commands and estimate time only\n");
+	fprintf(stderr, "         -h                      this help\n");
+	fprintf(stderr, "b writes a single sided image to side B, - reads the image from stdin\n");
+	fprintf(stderr, "interleave and skew only apply to plain tracks, never to protected ones\n");
+	exit(exitcode);
 }
 
 int main(int argc, char **argv) {
 
-	if (argc == 2) {
-		writedsk(argv[1],0);
-	} else if( (argc==3) && (strcmp(argv[1],"b")==0) ) {
-		writedsk(argv[2],4); //Write on side B
-	} else {
-		fprintf(stderr, "usage: dskwrite [b] <filename>\n");
+	static struct option long_options[] = {
+		{"drive", 1, 0, 'd'},
+		{"keep-gap", 0, 0, 'g'},
+		{"interleave", 1, 0, 'i'},
+		{"skew", 1, 0, 'k'},
+		{"side-skew", 1, 0, 'K'},
+		{"single", 0, 0, '1'},
+		{"amsdos", 0, 0, 'a'},
+		{"realtime", 0, 0, 'x'},
+		{"block", 0, 0, 'B'},
+		{"trace", 1, 0, 'L'},
+		{"replay", 1, 0, 'Y'},
+		{"plan", 0, 0, 'p'},
+		{"help", 0, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+	int c;
+	Writeopts opts;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.interleave = 1;
+
+	do {
+		int option_index = 0;
+		c = getopt_long(argc, argv, "d:gi:k:K:1axBL:Y:ph",
+			long_options, &option_index);
+		switch(c) {
+			case 'h':
+			case '?':
+				help_exit(0);
+				break;
+			case 'd':
+				if (opts.ndrives == MAX_DRIVES)
+					help_exit(1);
+				opts.drives[opts.ndrives] = atoi(optarg);
+				if ((opts.drives[opts.ndrives] < 0) ||
+					(opts.drives[opts.ndrives] >=
+					MAX_DRIVES))
+					help_exit(1);
+				opts.ndrives++;
+				break;
+			case 'g':
+				opts.keepgap = TRUE;
+				break;
+			case 'i':
+				opts.interleave = atoi(optarg);
+				if (opts.interleave < 1)
+					help_exit(1);
+				break;
+			case 'k':
+				opts.skew = strcmp(optarg, "auto") ?
+					atoi(optarg) : -1;
+				break;
+			case 'K':
+				opts.sideskew = strcmp(optarg, "auto") ?
+					atoi(optarg) : -1;
+				break;
+			case '1':
+				opts.single = TRUE;
+				break;
+			case 'a':
+				opts.amsdos = TRUE;
+				break;
+			case 'x':
+				opts.realtime = TRUE;
+				break;
+			case 'B':
+				opts.block = TRUE;
+				break;
+			case 'L':
+				trace_begin(optarg, FALSE);
+				break;
+			case 'Y':
+				trace_begin(optarg, TRUE);
+				break;
+			case 'p':
+				opts.plan = TRUE;
+				break;
+		}
+	} while (c != -1);
+
+	if ((argc - optind == 2) && (strcmp(argv[optind],"b")==0)) {
+		opts.side = 4; //Write on side B
+		optind++;
+	}
+	if (argc - optind != 1) {
+		help_exit(1);
+	}
+	if (opts.ndrives == 0)
+		opts.ndrives = 1;	/* /dev/fd0 */
+	if ((trace_active || replay_active) && (opts.ndrives > 1)) {
+		fprintf(stderr, "traces cover a single drive\n");
+		exit(1);
 	}
+
+	writedsk(argv[optind], &opts);
+
 	return 0;
 
 }
-
@@ -0,0 +1,456 @@
+/* $Id$
+ *
+ * plan.c - Dry-run planner for dsktools. Raw FDC commands are simulated
+ * against a model of the rotating disk instead of being sent to a drive.
+ * Copyright (C)2001 Andreas Micklei <nurgle@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "common.h"
+
+#include <stdarg.h>
+
+/* notes:
+ *
+ * time is kept in microseconds. At 300rpm and 250kbps one MFM byte takes
+ * 32us and a revolution 200ms, so the angular position of the disk is
+ * simply the time modulo PLAN_REV. Every command waits for the position it
+ * needs (an ID field, the index hole) and then takes as long as the bytes
+ * it passes over. Sectors missed because the host was too slow therefore
+ * cost a full revolution, just like on the real thing.
+ */
+
+#define PLAN_BYTE 32		/* us per MFM byte */
+#define PLAN_REV (RAW_TRACK_BYTES * PLAN_BYTE)
+#define PLAN_CHAIN 200		/* us between chained commands */
+
+typedef struct simtrack_t {
+	int formatted;		/* 0 = not laid out yet */
+	int spt;
+	int gap;
+	int fill;
+	format_map_t id[29];
+	int pos[29];		/* ID field offset from the index hole */
+} Simtrack;
+
+int plan_active = FALSE;
+
+Drivetiming drivetiming[4] = {
+	{ PLAN_STEP, PLAN_SETTLE, PLAN_CMD },
+	{ PLAN_STEP, PLAN_SETTLE, PLAN_CMD },
+	{ PLAN_STEP, PLAN_SETTLE, PLAN_CMD },
+	{ PLAN_STEP, PLAN_SETTLE, PLAN_CMD },
+};
+
+static FILE *plan_out;
+static long plan_now;
+static long plan_busy;
+static int plan_cmds;
+static int plan_errors;
+static int plan_cyl[4];
+static Simtrack plan_tracks[4][MAX_TRACKS][MAX_SIDES];
+
+static char *plan_name(int op)
+{
+	switch (op) {
+		case 0x02: return "READ TRACK";
+		case 0x03: return "SPECIFY";
+		case 0x04: return "SENSE DRV";
+		case 0x05: return "WRITE";
+		case 0x06: return "READ";
+		case 0x07: return "RECAL";
+		case 0x08: return "SENSE INT";
+		case 0x09: return "WRITE DEL";
+		case 0x0A: return "READ ID";
+		case 0x0C: return "READ DEL";
+		case 0x0D: return "FORMAT";
+		case 0x0F: return "SEEK";
+		case 0x11: return "SCAN EQ";
+	}
+	return "?";
+}
+
+/* Lay out the sectors of a track as the FDC would format them */
+static void plan_layout(Simtrack *t)
+{
+	int i, pos = RAW_INDEX_BYTES;
+
+	for (i=0; i<t->spt; i++) {
+		t->pos[i] = pos % RAW_TRACK_BYTES;
+		pos += RAW_SECT_BYTES + (128 << (t->id[i].size & 7)) + t->gap;
+	}
+}
+
+/* Tracks nobody formatted during the plan hold a standard DATA format */
+static Simtrack *plan_track(int drive, int cyl, int head)
+{
+	Simtrack *t;
+	int i;
+
+	if (cyl >= MAX_TRACKS)
+		cyl = MAX_TRACKS - 1;
+	t = &plan_tracks[drive][cyl][head];
+	if (t->formatted == 0) {
+		t->spt = SPT;
+		t->gap = GAP;
+		t->fill = FILL;
+		for (i=0; i<SPT; i++) {
+			t->id[i].cylinder = cyl;
+			t->id[i].head = head;
+			t->id[i].sector = OFF_DAT + i;
+			t->id[i].size = BPS;
+		}
+		plan_layout(t);
+		t->formatted = 1;
+	}
+	return t;
+}
+
+/* Wait until byte pos of the track passes under the head */
+static void plan_wait(int pos)
+{
+	long angle = plan_now % PLAN_REV;
+	long target = (long) pos * PLAN_BYTE;
+
+	if (target < angle)
+		target += PLAN_REV;
+	plan_now += target - angle;
+}
+
+static void plan_seek(int drive, int cyl)
+{
+	int steps = abs(cyl - plan_cyl[drive]);
+
+	if (steps) {
+		plan_now += steps * drivetiming[drive].step;
+		plan_now += drivetiming[drive].settle;
+	}
+	plan_cyl[drive] = cyl;
+}
+
+static unsigned short plan_crc(unsigned char type, unsigned char *buf, int len)
+{
+	unsigned char mark[4] = { 0xA1, 0xA1, 0xA1, 0 };
+
+	mark[3] = type;
+	return crc16_ccitt(crc16_ccitt(0xFFFF, mark, 4), buf, len);
+}
+
+/* Bytes of one revolution as the FDC decodes them, starting at the index */
+static void plan_build(Simtrack *t, unsigned char *img)
+{
+	unsigned char field[MAX_TRACKLEN + 8];
+	unsigned short crc;
+	int i, j, k, n, size;
+
+	memset(img, 0x4E, RAW_TRACK_BYTES);
+	for (i=0; i<t->spt; i++) {
+		size = 128 << (t->id[i].size & 7);
+		if (size > MAX_TRACKLEN)
+			size = MAX_TRACKLEN;
+		n = 0;
+		for (j=0; j<12; j++) field[n++] = 0x00;
+		for (j=0; j<3; j++) field[n++] = 0xA1;
+		field[n++] = 0xFE;
+		field[n++] = t->id[i].cylinder;
+		field[n++] = t->id[i].head;
+		field[n++] = t->id[i].sector;
+		field[n++] = t->id[i].size;
+		crc = plan_crc(0xFE, field + n - 4, 4);
+		field[n++] = crc >> 8;
+		field[n++] = crc & 0xFF;
+		for (k=0; k<n; k++)
+			img[(t->pos[i] + k) % RAW_TRACK_BYTES] = field[k];
+
+		n = 0;
+		for (j=0; j<12; j++) field[n++] = 0x00;
+		for (j=0; j<3; j++) field[n++] = 0xA1;
+		field[n++] = 0xFB;
+		memset(field + n, t->fill, size);
+		crc = plan_crc(0xFB, field + n, size);
+		n += size;
+		field[n++] = crc >> 8;
+		field[n++] = crc & 0xFF;
+		for (k=0; k<n; k++)
+			img[(t->pos[i] + 44 + k) % RAW_TRACK_BYTES] = field[k];
+	}
+}
+
+static void plan_readid(struct floppy_raw_cmd *c, int drive, int head)
+{
+	Simtrack *t = plan_track(drive, plan_cyl[drive], head);
+	long angle = (plan_now % PLAN_REV) / PLAN_BYTE;
+	int i, best = -1;
+
+	if (t->spt == 0) {
+		/* no address mark within two index pulses */
+		plan_now += 2 * PLAN_REV;
+		c->reply[0] |= 0x40;
+		c->reply[1] = ST1_MAM;
+		c->reply[5] = 1;
+		return;
+	}
+	for (i=0; i<t->spt; i++) {
+		if ((best < 0) ||
+			((t->pos[i] - angle + RAW_TRACK_BYTES) % RAW_TRACK_BYTES <
+			(t->pos[best] - angle + RAW_TRACK_BYTES) % RAW_TRACK_BYTES))
+			best = i;
+	}
+	plan_wait(t->pos[best]);
+	plan_now += 22 * PLAN_BYTE;
+	c->reply[3] = t->id[best].cylinder;
+	c->reply[4] = t->id[best].head;
+	c->reply[5] = t->id[best].sector;
+	c->reply[6] = t->id[best].size;
+}
+
+static void plan_readtrack(struct floppy_raw_cmd *c, int drive, int head)
+{
+	Simtrack *t = plan_track(drive, plan_cyl[drive], head);
+	unsigned char img[RAW_TRACK_BYTES];
+	long len = c->length;
+	int i, start;
+
+	plan_wait(0);
+	if (t->spt == 0) {
+		plan_now += 2 * PLAN_REV;
+		c->reply[0] |= 0x40;
+		c->reply[1] = ST1_MAM;
+		return;
+	}
+
+	/* the transfer starts with the data of the first sector */
+	start = t->pos[0] + 12 + RAW_ID_TO_DATA;
+	plan_build(t, img);
+	if (c->flags & FD_RAW_READ) {
+		for (i=0; i<len; i++)
+			((unsigned char *) c->data)[i] =
+				img[(start + i) % RAW_TRACK_BYTES];
+	}
+	plan_wait(start);
+	plan_now += len * PLAN_BYTE;
+	c->length = 0;
+	c->reply[0] |= 0x40;
+	c->reply[1] = ST1_CRC;
+	c->reply[2] = ST2_CRC;
+}
+
+/* READ, WRITE and SCAN: sectors R to EOT, continuing on head 1 with MT */
+static void plan_transfer(struct floppy_raw_cmd *c, int drive, int head)
+{
+	Simtrack *t;
+	int mt = c->cmd[0] & 0x80;
+	int C = c->cmd[2], H = c->cmd[3], R = c->cmd[4], N = c->cmd[5];
+	int eot = c->cmd[6];
+	long done = 0, size;
+	int i;
+
+	t = plan_track(drive, plan_cyl[drive], head);
+	for (;;) {
+		for (i=0; i<t->spt; i++) {
+			if ((t->id[i].cylinder == C) && (t->id[i].head == H) &&
+				(t->id[i].sector == R) && (t->id[i].size == N))
+				break;
+		}
+		if (i == t->spt) {
+			plan_now += 2 * PLAN_REV;
+			c->reply[0] |= 0x40;
+			c->reply[1] = ST1_ND;
+			break;
+		}
+		size = 128 << (N & 7);
+		plan_wait(t->pos[i]);
+		plan_now += (RAW_SECT_BYTES + size) * PLAN_BYTE;
+		if ((c->flags & FD_RAW_READ) && (done + size <= c->length))
+			memset((unsigned char *) c->data + done, t->fill, size);
+		done += size;
+
+		/* DMA terminal count ends the command */
+		if (done >= c->length)
+			break;
+		if (R == eot) {
+			if (!mt || head)
+				break;
+			head = 1;
+			H ^= 1;
+			R = 1;
+			c->reply[0] |= 4;
+			t = plan_track(drive, plan_cyl[drive], head);
+		} else
+			R++;
+	}
+	if (done > c->length)
+		done = c->length;
+	c->length -= done;
+
+	/* the simulated disk always holds what is being compared */
+	if (((c->cmd[0] & 0x1F) == 0x11) && !(c->reply[0] & 0x40))
+		c->reply[2] |= ST2_SEH;
+	c->reply[3] = C;
+	c->reply[4] = H;
+	c->reply[5] = R;
+	c->reply[6] = N;
+}
+
+static void plan_format(struct floppy_raw_cmd *c, int drive, int head)
+{
+	Simtrack *t;
+	int cyl = plan_cyl[drive];
+
+	if (cyl >= MAX_TRACKS)
+		cyl = MAX_TRACKS - 1;
+	t = &plan_tracks[drive][cyl][head];
+	t->formatted = 1;
+	t->spt = c->cmd[3] > 29 ? 29 : c->cmd[3];
+	t->gap = c->cmd[4];
+	t->fill = c->cmd[5];
+	memcpy(t->id, c->data, t->spt * sizeof(format_map_t));
+	plan_layout(t);
+
+	plan_wait(0);
+	plan_now += PLAN_REV;
+	c->length = 0;
+}
+
+static void plan_log(struct floppy_raw_cmd *c, long start)
+{
+	int i;
+
+	fprintf(plan_out, "%10.3f %8.3f  %-10s", start / 1000.0,
+		(plan_now - start) / 1000.0, plan_name(c->cmd[0] & 0x1F));
+	for (i=0; i<c->cmd_count; i++)
+		fprintf(plan_out, " %02X", c->cmd[i]);
+	if (c->reply[0] & 0xC0)
+		fprintf(plan_out, "  -> %02X %02X %02X", c->reply[0],
+			c->reply[1], c->reply[2]);
+	fprintf(plan_out, "\n");
+}
+
+/* Simulate one raw command, or a chain linked with FD_RAW_MORE */
+int plan_cmd(struct floppy_raw_cmd *cmd)
+{
+	struct floppy_raw_cmd *c;
+	int drive, head, op;
+	long start;
+
+	for (c = cmd; ; c++) {
+		op = c->cmd[0] & 0x1F;
+		drive = c->cmd[1] & 3;
+		head = (c->cmd[1] >> 2) & 1;
+
+		plan_now += (c == cmd) ? drivetiming[drive].cmd : PLAN_CHAIN;
+		if ((c->flags & FD_RAW_NEED_SEEK) &&
+			(plan_cyl[drive] != c->track))
+			plan_seek(drive, c->track);
+
+		start = plan_now;
+		memset(c->reply, 0, sizeof(c->reply));
+		c->reply[0] = (head << 2) | drive;
+		c->reply_count = 7;
+
+		switch (op) {
+			case 0x0F:	/* seek */
+				plan_seek(drive, c->cmd[2]);
+				c->reply[0] |= ST0_SE;
+				c->reply[1] = plan_cyl[drive];
+				c->reply_count = 2;
+				break;
+			case 0x07:	/* recalibrate */
+				plan_seek(drive, 0);
+				c->reply[0] |= ST0_SE;
+				c->reply_count = 2;
+				break;
+			case 0x04:	/* sense drive status */
+				c->reply[0] |= ST3_RY;
+				if (plan_cyl[drive] == 0)
+					c->reply[0] |= ST3_TZ;
+				c->reply_count = 1;
+				break;
+			case 0x0A:
+				plan_readid(c, drive, head);
+				break;
+			case 0x02:
+				plan_readtrack(c, drive, head);
+				break;
+			case 0x05:
+			case 0x06:
+			case 0x09:
+			case 0x0C:
+			case 0x11:
+				plan_transfer(c, drive, head);
+				break;
+			case 0x0D:
+				plan_format(c, drive, head);
+				break;
+			default:
+				c->reply_count = 0;
+				break;
+		}
+
+		plan_busy += plan_now - start;
+		plan_cmds++;
+		plan_log(c, start);
+
+		if (!(c->flags & FD_RAW_MORE))
+			break;
+	}
+	return 0;
+}
+
+void plan_begin(FILE *out)
+{
+	plan_out = out;
+	plan_now = 0;
+	plan_busy = 0;
+	plan_cmds = 0;
+	plan_errors = 0;
+	memset(plan_cyl, 0, sizeof(plan_cyl));
+	memset(plan_tracks, 0, sizeof(plan_tracks));
+	plan_active = TRUE;
+
+	fprintf(plan_out, "%10s %8s  %-10s %s\n", "ms", "took", "command",
+		"bytes");
+}
+
+void plan_note(char *name)
+{
+	fprintf(plan_out, "%10.3f %8.3f  %s\n", plan_now / 1000.0, 0.0, name);
+}
+
+void plan_error(char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	fprintf(plan_out, "! ");
+	vfprintf(plan_out, format, ap);
+	va_end(ap);
+	plan_errors++;
+}
+
+int plan_end(void)
+{
+	plan_active = FALSE;
+
+	fprintf(plan_out, "\n%d commands, FDC busy %.1fs\n", plan_cmds,
+		plan_busy / 1000000.0);
+	fprintf(plan_out, "estimated %.1f revolutions, %.1fs\n",
+		(double) plan_now / PLAN_REV, plan_now / 1000000.0);
+	if (plan_errors)
+		fprintf(plan_out, "%d problems, job can not be run as is\n",
+			plan_errors);
+	return plan_errors;
+}
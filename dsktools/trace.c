@@ -0,0 +1,256 @@
+/* $Id$
+ *
+ * trace.c - Record raw FDC commands of a dsktools run to a file, and run a
+ * tool again against such a recording instead of a drive.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "common.h"
+
+#include <errno.h>
+#include <time.h>
+
+/* notes:
+ *
+ * A trace starts with TRACE_MAGIC and then holds one Tracerec per command
+ * (every command of a chain has its own), in host byte order. Read data
+ * follows its record, so a replay hands the tool exactly what the drive
+ * gave; written data is only kept as a hash, and a replay reports writes
+ * whose data is not the same any more. A replay also waits as long as the
+ * drive took for every command, so the run takes as long as the recorded
+ * one did, apart from the time the host spends between the commands. That
+ * is the part changes to the tools are meant to improve.
+ */
+
+#define TRACE_MAGIC "DSKTRACE1"
+#define TRACE_CMD 0
+#define TRACE_RESET 1
+
+typedef struct tracerec_t {
+	unsigned char type;
+	unsigned char rate;
+	unsigned char cmd_count;
+	unsigned char reply_count;
+	unsigned int flags;
+	int track;
+	int length;		/* bytes to transfer */
+	int residue;		/* bytes left untransferred */
+	int err;		/* errno of a failed ioctl, or 0 */
+	unsigned int start;	/* us since the trace began */
+	unsigned int took;	/* us the ioctl took, on the first of a chain */
+	unsigned int hash;	/* FNV-1a of the data transferred */
+	unsigned int datalen;	/* bytes of read data after the record */
+	unsigned char cmd[16];
+	unsigned char reply[16];
+} Tracerec;
+
+int trace_active = FALSE;
+int replay_active = FALSE;
+
+static FILE *trace_file;
+static long trace_t0;
+static long trace_recorded;	/* us the replayed commands took back then */
+static int trace_cmds;
+
+static long trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static void trace_wait(long us)
+{
+	struct timespec ts;
+
+	ts.tv_sec = us / 1000000L;
+	ts.tv_nsec = (us % 1000000L) * 1000;
+	while (nanosleep(&ts, &ts) < 0)
+		;
+}
+
+static void trace_write(Tracerec *rec, void *data)
+{
+	if ((fwrite(rec, 1, sizeof(*rec), trace_file) != sizeof(*rec)) ||
+		(fwrite(data, 1, rec->datalen, trace_file) != rec->datalen)) {
+		myabort("Error writing trace: File to short\n");
+	}
+}
+
+static void trace_read(Tracerec *rec, char *what)
+{
+	if (fread(rec, 1, sizeof(*rec), trace_file) != sizeof(*rec)) {
+		fprintf(stderr, "Trace ends before %s (command %i)\n", what,
+			trace_cmds + 1);
+		exit(1);
+	}
+}
+
+void trace_begin(char *filename, int replay)
+{
+	char magic[sizeof(TRACE_MAGIC)];
+
+	trace_file = fopen(filename, replay ? "r" : "w");
+	if (trace_file == NULL) {
+		perror("Error opening trace");
+		exit(1);
+	}
+	if (replay) {
+		if ((fread(magic, 1, sizeof(magic), trace_file) !=
+			sizeof(magic)) || memcmp(magic, TRACE_MAGIC,
+			sizeof(magic))) {
+			fprintf(stderr, "%s is not a trace\n", filename);
+			exit(1);
+		}
+		replay_active = TRUE;
+	} else {
+		fwrite(TRACE_MAGIC, 1, sizeof(TRACE_MAGIC), trace_file);
+		trace_active = TRUE;
+	}
+	trace_t0 = trace_now();
+	trace_recorded = 0;
+	trace_cmds = 0;
+	atexit(trace_end);
+}
+
+void trace_end(void)
+{
+	if (trace_active) {
+		fprintf(stderr, "Traced %i commands in %.1fs\n", trace_cmds,
+			(trace_now() - trace_t0) / 1000000.0);
+		if (fclose(trace_file) != 0)
+			perror("Error writing trace");
+	} else if (replay_active) {
+		fprintf(stderr, "Replayed %i commands in %.1fs, recorded run "
+			"%.1fs\n", trace_cmds,
+			(trace_now() - trace_t0) / 1000000.0,
+			trace_recorded / 1000000.0);
+		fclose(trace_file);
+	}
+	trace_active = FALSE;
+	replay_active = FALSE;
+}
+
+/* Log the commands of a chain after the ioctl returned */
+void trace_cmd(struct floppy_raw_cmd *raw_cmd, long *length, long start,
+	int err)
+{
+	struct floppy_raw_cmd *c;
+	Tracerec rec;
+	long done, end = trace_now();
+	int i;
+
+	for (c = raw_cmd, i = 0; ; c++, i++) {
+		memset(&rec, 0, sizeof(rec));
+		rec.type = TRACE_CMD;
+		rec.rate = c->rate;
+		rec.cmd_count = c->cmd_count;
+		rec.reply_count = c->reply_count;
+		rec.flags = c->flags;
+		rec.track = c->track;
+		rec.length = (i < TRACE_CHAIN) ? length[i] : c->length;
+		rec.residue = c->length;
+		rec.err = (err < 0) ? errno : 0;
+		rec.start = start - trace_t0;
+		rec.took = (c == raw_cmd) ? end - start : 0;
+		memcpy(rec.cmd, c->cmd, sizeof(rec.cmd));
+		memcpy(rec.reply, c->reply, sizeof(rec.reply));
+
+		done = rec.length - c->length;
+		if ((c->data != NULL) && (done > 0)) {
+			rec.hash = fnv1a(FNV_INIT, c->data, done);
+			if (c->flags & FD_RAW_READ)
+				rec.datalen = done;
+		}
+		trace_write(&rec, c->data);
+		trace_cmds++;
+
+		if (!(c->flags & FD_RAW_MORE))
+			break;
+	}
+}
+
+/* Answer a chain from the trace. The tool has to issue the same commands
+ * as it did when the trace was recorded. */
+int replay_cmd(struct floppy_raw_cmd *raw_cmd)
+{
+	struct floppy_raw_cmd *c;
+	Tracerec rec;
+	long done;
+	int err = 0;
+
+	for (c = raw_cmd; ; c++) {
+		trace_read(&rec, "this command");
+		trace_cmds++;
+		if ((rec.type != TRACE_CMD) || (rec.cmd_count != c->cmd_count) ||
+			memcmp(rec.cmd, c->cmd, c->cmd_count) ||
+			(rec.length != c->length)) {
+			fprintf(stderr, "Trace differs at command %i\n",
+				trace_cmds);
+			exit(1);
+		}
+		if (rec.took) {
+			trace_wait(rec.took);
+			trace_recorded += rec.took;
+		}
+
+		done = rec.length - rec.residue;
+		if ((c->flags & FD_RAW_WRITE) && (done > 0) &&
+			(fnv1a(FNV_INIT, c->data, done) != rec.hash))
+			fprintf(stderr, "Command %i writes other data than "
+				"recorded\n", trace_cmds);
+		if ((rec.datalen > c->length) || (rec.datalen &&
+			(fread(c->data, 1, rec.datalen, trace_file) !=
+			rec.datalen))) {
+			fprintf(stderr, "Broken trace at command %i\n",
+				trace_cmds);
+			exit(1);
+		}
+		c->length = rec.residue;
+		c->reply_count = rec.reply_count;
+		memcpy(c->reply, rec.reply, sizeof(rec.reply));
+		c->flags = rec.flags;
+		if (rec.err) {
+			errno = rec.err;
+			err = -1;
+		}
+
+		if (!(c->flags & FD_RAW_MORE))
+			break;
+	}
+	return err;
+}
+
+void trace_reset(void)
+{
+	Tracerec rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = TRACE_RESET;
+	if (replay_active) {
+		trace_read(&rec, "a reset");
+		if (rec.type != TRACE_RESET) {
+			fprintf(stderr, "Trace differs at command %i\n",
+				trace_cmds + 1);
+			exit(1);
+		}
+	} else {
+		rec.start = trace_now() - trace_t0;
+		trace_write(&rec, NULL);
+	}
+	trace_cmds++;
+}